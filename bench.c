@@ -0,0 +1,1862 @@
+/* Benchmarks for xs.c.  They reach into its internals and share the test
+ * strings, so they are built together with it as one translation unit:
+ *
+ *     make bench && ./bench all
+ */
+#define XS_NO_MAIN
+#include "xs.c"
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#define BENCH_NR_KEYS 200000
+
+/* Random keys whose lengths are spread over the Small and Medium ranges */
+static char *bench_random_key(char *buf, size_t max)
+{
+    size_t len = 4 + rand() % (max - 4);
+
+    for (size_t n = 0; n < len; n++)
+        buf[n] = charset[rand() % (sizeof charset - 1)];
+    buf[len] = 0;
+    return buf;
+}
+
+/* Chained hash map with strdup() keys: the baseline for xs_map */
+struct chained_node {
+    char *key;
+    void *value;
+    struct chained_node *next;
+};
+
+struct chained_map {
+    struct chained_node **buckets;
+    size_t nr_buckets, size;
+};
+
+static struct chained_node **chained_lookup(struct chained_map *m,
+                                            const char *key)
+{
+    uint64_t h = xs_hash_bytes(key, strlen(key));
+    struct chained_node **pp = &m->buckets[h & (m->nr_buckets - 1)];
+
+    for (; *pp; pp = &(*pp)->next)
+        if (!strcmp((*pp)->key, key))
+            break;
+    return pp;
+}
+
+static void chained_insert(struct chained_map *m, const char *key, void *value)
+{
+    struct chained_node **pp = chained_lookup(m, key), *n;
+
+    if (*pp) {
+        (*pp)->value = value;
+        return;
+    }
+    n = malloc(sizeof(*n));
+    n->key = strdup(key);
+    n->value = value;
+    n->next = NULL;
+    *pp = n;
+
+    if (++m->size > m->nr_buckets) {
+        size_t nr = m->nr_buckets * 2;
+        struct chained_node **b = calloc(nr, sizeof(*b));
+        for (size_t i = 0; i < m->nr_buckets; i++) {
+            while ((n = m->buckets[i])) {
+                uint64_t h = xs_hash_bytes(n->key, strlen(n->key));
+                m->buckets[i] = n->next;
+                n->next = b[h & (nr - 1)];
+                b[h & (nr - 1)] = n;
+            }
+        }
+        free(m->buckets);
+        m->buckets = b;
+        m->nr_buckets = nr;
+    }
+}
+
+static void chained_erase(struct chained_map *m, const char *key)
+{
+    struct chained_node **pp = chained_lookup(m, key), *n = *pp;
+
+    if (!n)
+        return;
+    *pp = n->next;
+    free(n->key);
+    free(n);
+    m->size--;
+}
+
+static void chained_free(struct chained_map *m)
+{
+    for (size_t i = 0; i < m->nr_buckets; i++) {
+        struct chained_node *n, *next;
+        for (n = m->buckets[i]; n; n = next) {
+            next = n->next;
+            free(n->key);
+            free(n);
+        }
+    }
+    free(m->buckets);
+}
+
+static void bench_map(void)
+{
+    static char keybuf[BENCH_NR_KEYS][40];
+    xs *keys = malloc(BENCH_NR_KEYS * sizeof(xs));
+    struct chained_map cm = {calloc(16, sizeof(struct chained_node *)), 16, 0};
+    xs_map m;
+    size_t i, hits = 0;
+    double t;
+
+    for (i = 0; i < BENCH_NR_KEYS; i++)
+        xs_new(&keys[i], bench_random_key(keybuf[i], sizeof keybuf[i]));
+
+    printf("%d keys of 4-39 bytes\n", BENCH_NR_KEYS);
+
+    xs_map_init(&m);
+    t = now_sec();
+    for (i = 0; i < BENCH_NR_KEYS; i++)
+        xs_map_insert(&m, &keys[i], (void *) i);
+    printf("xs_map   insert: %.3f s\n", now_sec() - t);
+    t = now_sec();
+    for (i = 0; i < BENCH_NR_KEYS; i++)
+        hits += !!xs_map_find(&m, &keys[i]);
+    printf("xs_map   find  : %.3f s (%zu hits)\n", now_sec() - t, hits);
+    t = now_sec();
+    for (i = 0; i < BENCH_NR_KEYS; i++)
+        xs_map_erase(&m, &keys[i]);
+    printf("xs_map   erase : %.3f s (%zu left)\n", now_sec() - t, m.size);
+    xs_map_free(&m);
+
+    hits = 0;
+    t = now_sec();
+    for (i = 0; i < BENCH_NR_KEYS; i++)
+        chained_insert(&cm, keybuf[i], (void *) i);
+    printf("chained  insert: %.3f s\n", now_sec() - t);
+    t = now_sec();
+    for (i = 0; i < BENCH_NR_KEYS; i++)
+        hits += !!*chained_lookup(&cm, keybuf[i]);
+    printf("chained  find  : %.3f s (%zu hits)\n", now_sec() - t, hits);
+    t = now_sec();
+    for (i = 0; i < BENCH_NR_KEYS; i++)
+        chained_erase(&cm, keybuf[i]);
+    printf("chained  erase : %.3f s (%zu left)\n", now_sec() - t, cm.size);
+    chained_free(&cm);
+
+    for (i = 0; i < BENCH_NR_KEYS; i++)
+        xs_free(&keys[i]);
+    free(keys);
+}
+
+#define BENCH_INTERN_THREADS 4
+#define BENCH_INTERN_BLOBS 64
+#define BENCH_INTERN_STRINGS 20000
+
+struct bench_intern_arg {
+    xs *strings;
+    size_t n;
+};
+
+static void *bench_intern_worker(void *data)
+{
+    struct bench_intern_arg *arg = data;
+
+    for (size_t i = 0; i < arg->n; i++)
+        xs_intern(&arg->strings[i]);
+    return NULL;
+}
+
+static void bench_intern(void)
+{
+    static char blob[BENCH_INTERN_BLOBS][4096];
+    xs *strings = malloc(BENCH_INTERN_STRINGS * sizeof(xs));
+    pthread_t threads[BENCH_INTERN_THREADS];
+    struct bench_intern_arg args[BENCH_INTERN_THREADS];
+    size_t per_thread = BENCH_INTERN_STRINGS / BENCH_INTERN_THREADS, i;
+    struct xs_intern_stats st;
+    double t;
+
+    /* the same few header blobs, each duplicate in its own buffer */
+    for (i = 0; i < BENCH_INTERN_BLOBS; i++) {
+        for (size_t n = 0; n < sizeof blob[i] - 1; n++)
+            blob[i][n] = charset[rand() % (sizeof charset - 1)];
+    }
+    for (i = 0; i < BENCH_INTERN_STRINGS; i++)
+        xs_new(&strings[i], blob[rand() % BENCH_INTERN_BLOBS]);
+
+    t = now_sec();
+    for (i = 0; i < BENCH_INTERN_THREADS; i++) {
+        args[i].strings = strings + i * per_thread;
+        args[i].n = per_thread;
+        pthread_create(&threads[i], NULL, bench_intern_worker, &args[i]);
+    }
+    for (i = 0; i < BENCH_INTERN_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    t = now_sec() - t;
+
+    st = xs_intern_get_stats();
+    printf("interned %zu strings of %zu bytes on %d threads: %.3f s\n",
+           st.lookups, sizeof blob[0] - 1, BENCH_INTERN_THREADS, t);
+    printf("distinct: %zu (%zu bytes), hits: %zu, bytes saved: %zu\n",
+           st.strings, st.bytes, st.hits, st.bytes_saved);
+
+    for (i = 0; i < BENCH_INTERN_STRINGS; i++)
+        xs_free(&strings[i]);
+    xs_intern_purge();
+    st = xs_intern_get_stats();
+    printf("after purge: %zu distinct strings\n", st.strings);
+    free(strings);
+}
+
+#define BENCH_NR_SORT 1000000
+
+static int bench_cmp_xs(const void *a, const void *b)
+{
+    return xs_cmp(a, b);
+}
+
+static int bench_cmp_strcmp(const void *a, const void *b)
+{
+    return strcmp(xs_data(a), xs_data(b));
+}
+
+/* Mixed Small/Medium/Large strings with long common prefixes; every fourth
+ * Large string is a CoW copy of an earlier one.
+ */
+static void bench_sort_strings(xs *arr, size_t n)
+{
+    static char buf[1024];
+    size_t len_max[] = {XS_INLINE_MAX, 255, 1023};
+
+    memset(buf, 'p', sizeof buf);
+    for (size_t i = 0; i < n; i++) {
+        int type = rand() % 10 < 6 ? SMALL_STRING
+                                   : rand() % 3 ? MEDIUM_STRING : LARGE_STRING;
+        size_t len = len_max[type] - rand() % 8, pos = len - 1 - rand() % 8;
+
+        if (type == LARGE_STRING && i >= 4 && !(i % 4) &&
+            xs_is_large_string(&arr[i - 4])) {
+            xs_copy(&arr[i], &arr[i - 4]);
+            continue;
+        }
+        buf[pos] = charset[rand() % (sizeof charset - 1)];
+        buf[len] = 0;
+        xs_new(&arr[i], buf);
+        buf[len] = 'p';
+        buf[pos] = 'p';
+    }
+}
+
+static void bench_sort(void)
+{
+    xs *arr = malloc(BENCH_NR_SORT * sizeof(xs));
+    unsigned int seed = time(NULL);
+    double t;
+
+    static const char *desc[] = {"xs_sort", "qsort with xs_cmp",
+                                 "qsort with strcmp"};
+
+    /* every pass sorts the same strings */
+    for (int pass = 0; pass < 3; pass++) {
+        srand(seed);
+        bench_sort_strings(arr, BENCH_NR_SORT);
+        t = now_sec();
+        if (pass)
+            qsort(arr, BENCH_NR_SORT, sizeof(xs),
+                  pass == 1 ? bench_cmp_xs : bench_cmp_strcmp);
+        else
+            xs_sort(arr, BENCH_NR_SORT);
+        printf("%d mixed strings, %-17s: %.3f s\n", BENCH_NR_SORT,
+               desc[pass], now_sec() - t);
+        for (size_t i = 1; i < BENCH_NR_SORT; i++) {
+            if (xs_cmp(&arr[i - 1], &arr[i]) > 0) {
+                printf("[Error]: not sorted at %zu\n", i);
+                break;
+            }
+        }
+        for (size_t i = 0; i < BENCH_NR_SORT; i++)
+            xs_free(&arr[i]);
+    }
+    free(arr);
+}
+
+#define BENCH_NR_BATCH 1000000
+
+static void bench_batch(void)
+{
+    xs *arr = malloc(BENCH_NR_BATCH * sizeof(xs)), *orig;
+    uint64_t *hashes = malloc(BENCH_NR_BATCH * sizeof(uint64_t));
+    size_t *pos = malloc(BENCH_NR_BATCH * sizeof(size_t));
+    xs needle = *xs_tmp("zz9"), prefix = *xs_tmp("((("),
+       suffix = *xs_tmp(")))");
+    int nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int seed = time(NULL);
+
+    printf("%d mixed strings, %d online CPUs\n", BENCH_NR_BATCH, nr_cpus);
+    printf("threads    sort    trim  concat    hash    find\n");
+
+    for (int nr = 1;; nr = nr * 2 < nr_cpus ? nr * 2 : nr_cpus) {
+        struct xs_pool *pool = xs_pool_create(nr);
+        double t[5];
+
+        srand(seed);
+        bench_sort_strings(arr, BENCH_NR_BATCH);
+
+        t[0] = now_sec();
+        xs_batch_sort(pool, arr, BENCH_NR_BATCH);
+        t[1] = now_sec();
+        xs_batch_trim(pool, arr, BENCH_NR_BATCH, "p");
+        t[2] = now_sec();
+        xs_batch_concat(pool, arr, BENCH_NR_BATCH, &prefix, &suffix);
+        t[3] = now_sec();
+        xs_batch_hash(pool, arr, BENCH_NR_BATCH, hashes);
+        t[4] = now_sec();
+        xs_batch_find(pool, arr, BENCH_NR_BATCH, &needle, pos);
+        printf("%7d %7.3f %7.3f %7.3f %7.3f %7.3f\n", nr, t[1] - t[0],
+               t[2] - t[1], t[3] - t[2], t[4] - t[3], now_sec() - t[4]);
+
+        xs_pool_destroy(pool);
+        for (size_t i = 0; i < BENCH_NR_BATCH; i++)
+            xs_free(&arr[i]);
+        if (nr >= nr_cpus)
+            break;
+    }
+
+    /* CoW: every string shares one buffer, each trim breaks the sharing */
+    struct xs_pool *pool = xs_pool_create(nr_cpus);
+    init_random_string((uint8_t *) random_string[LARGE_STRING], LARGE_STRING);
+    orig = xs_new(&(xs){0}, random_string[LARGE_STRING]);
+    for (size_t i = 0; i < 64; i++)
+        xs_copy(&arr[i], orig);
+    xs_batch_trim(pool, arr, 64, "@#");
+    printf("trim 64 CoW copies of a large string, ref. count: %d\n",
+           xs_get_ref_count(orig));
+    for (size_t i = 0; i < 64; i++)
+        xs_free(&arr[i]);
+    xs_free(orig);
+    xs_pool_destroy(pool);
+
+    free(pos);
+    free(hashes);
+    free(arr);
+}
+
+static void bench_parallel(void)
+{
+    int nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    struct xs_pool *pool = xs_pool_create(nr_cpus > 1 ? nr_cpus : 2);
+    xs needle = *xs_tmp("@@##");
+    char *buf = malloc((64 << 20) + 1);
+
+    for (size_t i = 0; i < 64 << 20; i++)
+        buf[i] = charset[rand() % (sizeof charset - 1)];
+
+    printf("%d online CPUs, pool of %d threads\n", nr_cpus,
+           nr_cpus > 1 ? nr_cpus : 2);
+    printf("   bytes threads  CoW copy      find     count   tolower\n");
+
+    for (size_t size = 64 << 10; size <= 64 << 20; size *= 4) {
+        char saved = buf[size];
+        xs x, copy;
+
+        buf[size] = 0;
+        xs_new(&x, buf);
+        buf[size] = saved;
+
+        for (int pass = 0; pass < 2; pass++) {
+            double t[4];
+
+            /* threshold 0 forces the pool, SIZE_MAX keeps one thread */
+            xs_set_pool(pool, pass ? 0 : SIZE_MAX);
+
+            t[0] = now_sec();
+            xs_copy(&copy, &x);
+            xs_trim(&copy, "@");
+            t[1] = now_sec();
+            xs_find(&x, &needle, 0);
+            t[2] = now_sec();
+            xs_count(&x, &needle);
+            t[3] = now_sec();
+            xs_tolower(&copy);
+            printf("%8zu %7s %9.6f %9.6f %9.6f %9.6f\n", size,
+                   pass ? "pool" : "1", t[1] - t[0], t[2] - t[1],
+                   t[3] - t[2], now_sec() - t[3]);
+            xs_free(&copy);
+        }
+        xs_free(&x);
+    }
+
+    xs_set_pool(NULL, SIZE_MAX);
+    xs_pool_destroy(pool);
+    free(buf);
+}
+
+static void bench_case(void)
+{
+    char *buf = random_string[LARGE_STRING];
+    xs x, copy, needle = *xs_tmp("@NeEdLe#");
+    size_t i, size;
+    double t;
+    int r = 0;
+
+    init_random_string((uint8_t *) buf, LARGE_STRING);
+    size = strlen(buf);
+    for (i = 0; i < size; i += 7)
+        buf[i] = toupper(buf[i]);
+    xs_new(&x, buf);
+    printf("%zu bytes, mixed case\n", size);
+
+    /* writing through xs_data() would modify every CoW copy: own buffer */
+    xs_new(&copy, buf);
+    t = now_sec();
+    for (char *p = xs_data(&copy); *p; p++)
+        *p = tolower(*p);
+    printf("tolower() loop         : %.6f s\n", now_sec() - t);
+    xs_free(&copy);
+
+    xs_copy(&copy, &x);
+    t = now_sec();
+    xs_tolower(&copy);
+    printf("xs_tolower (CoW break) : %.6f s\n", now_sec() - t);
+
+    /* already lower case: the copy keeps sharing the buffer */
+    xs lower = copy;
+    xs_copy(&copy, &lower);
+    t = now_sec();
+    xs_tolower(&copy);
+    printf("xs_tolower (no-op)     : %.6f s, ref. count: %d\n",
+           now_sec() - t, xs_get_ref_count(&copy));
+    xs_free(&copy);
+
+    t = now_sec();
+    for (i = 0; i < 100; i++)
+        r += strcasecmp(xs_data(&x), xs_data(&lower));
+    printf("strcasecmp x100        : %.6f s\n", now_sec() - t);
+    t = now_sec();
+    for (i = 0; i < 100; i++)
+        r += xs_casecmp(&x, &lower);
+    printf("xs_casecmp x100        : %.6f s\n", now_sec() - t);
+
+    t = now_sec();
+    for (i = 0; i < 100; i++)
+        r += xs_casefind(&x, &needle, 0) != XS_NPOS;
+    printf("xs_casefind x100       : %.6f s (%d)\n", now_sec() - t, r);
+
+    xs_free(&lower);
+    xs_free(&x);
+}
+
+static void bench_utf8(void)
+{
+    /* 1, 2, 3 and 4 byte sequences */
+    static const char *const text[] = {"a", "\xc3\xa9", "\xe2\x82\xac",
+                                       "\xf0\x9f\x98\x80"};
+    char *buf = random_string[LARGE_STRING];
+    size_t size, len;
+    double t;
+    xs x;
+
+    for (int ascii = 1; ascii >= 0; ascii--) {
+        size = 0;
+        while (size + 4 < TEST_MAX_STRING) {
+            const char *c = text[ascii ? 0 : rand() % 4];
+            size_t n = strlen(c);
+            memcpy(buf + size, c, n);
+            size += n;
+        }
+        buf[size] = 0;
+        xs_new(&x, buf);
+
+        printf("%zu bytes of %s text\n", size, ascii ? "ASCII" : "mixed");
+        t = now_sec();
+        bool valid = xs_utf8_validate_scalar((uint8_t *) buf, size);
+        printf("  scalar validation : %.6f s (%s)\n", now_sec() - t,
+               valid ? "valid" : "invalid");
+        t = now_sec();
+        valid = xs_utf8_valid(&x);
+        printf("  xs_utf8_valid     : %.6f s (%s)\n", now_sec() - t,
+               valid ? "valid" : "invalid");
+        t = now_sec();
+        valid = xs_utf8_valid(&x);
+        printf("  cached            : %.6f s\n", now_sec() - t);
+        t = now_sec();
+        len = xs_utf8_length(&x);
+        printf("  xs_utf8_length    : %.6f s (%zu code points)\n",
+               now_sec() - t, len);
+        xs_free(&x);
+    }
+}
+
+#define BENCH_NUMBERS 1000000
+
+static void bench_number(void)
+{
+    int64_t *ints = malloc(BENCH_NUMBERS * sizeof(*ints));
+    double *dbls = malloc(BENCH_NUMBERS * sizeof(*dbls));
+    xs *strs = malloc(BENCH_NUMBERS * sizeof(*strs));
+    char buf[32];
+    double t;
+    size_t bad;
+
+    srand(1);
+    for (int i = 0; i < BENCH_NUMBERS; i++) {
+        ints[i] = ((int64_t) rand() << 31 | rand()) >> (rand() % 62);
+        dbls[i] = (double) rand() / RAND_MAX * 1e-20;
+        for (int e = rand() % 40; e; e--)
+            dbls[i] *= 10;
+    }
+    /* build the tables outside the timed loops */
+    xs_free(xs_append_double(&xs_literal_empty(), 1));
+
+    printf("%d integers\n", BENCH_NUMBERS);
+    t = now_sec();
+    for (int i = 0; i < BENCH_NUMBERS; i++) {
+        snprintf(buf, sizeof(buf), "%lld", (long long) ints[i]);
+        xs_new(&strs[i], buf);
+    }
+    printf("  snprintf + xs_new : %.6f s\n", now_sec() - t);
+    for (int i = 0; i < BENCH_NUMBERS; i++)
+        xs_free(&strs[i]);
+    t = now_sec();
+    for (int i = 0; i < BENCH_NUMBERS; i++)
+        xs_append_int(xs_newempty(&strs[i]), ints[i]);
+    printf("  xs_append_int     : %.6f s\n", now_sec() - t);
+    t = now_sec();
+    bad = 0;
+    for (int i = 0; i < BENCH_NUMBERS; i++)
+        bad += strtoll(xs_data(&strs[i]), NULL, 10) != ints[i];
+    printf("  strtoll           : %.6f s (%zu mismatches)\n", now_sec() - t,
+           bad);
+    t = now_sec();
+    bad = 0;
+    for (int i = 0; i < BENCH_NUMBERS; i++) {
+        int64_t v;
+        bad += !xs_to_int64(&strs[i], &v) || v != ints[i];
+    }
+    printf("  xs_to_int64       : %.6f s (%zu mismatches)\n", now_sec() - t,
+           bad);
+    for (int i = 0; i < BENCH_NUMBERS; i++)
+        xs_free(&strs[i]);
+
+    printf("%d doubles\n", BENCH_NUMBERS);
+    t = now_sec();
+    for (int i = 0; i < BENCH_NUMBERS; i++) {
+        snprintf(buf, sizeof(buf), "%.17g", dbls[i]);
+        xs_new(&strs[i], buf);
+    }
+    printf("  snprintf + xs_new : %.6f s\n", now_sec() - t);
+    for (int i = 0; i < BENCH_NUMBERS; i++)
+        xs_free(&strs[i]);
+    t = now_sec();
+    for (int i = 0; i < BENCH_NUMBERS; i++)
+        xs_append_double(xs_newempty(&strs[i]), dbls[i]);
+    printf("  xs_append_double  : %.6f s\n", now_sec() - t);
+    t = now_sec();
+    bad = 0;
+    for (int i = 0; i < BENCH_NUMBERS; i++)
+        bad += strtod(xs_data(&strs[i]), NULL) != dbls[i];
+    printf("  strtod            : %.6f s (%zu mismatches)\n", now_sec() - t,
+           bad);
+    t = now_sec();
+    bad = 0;
+    for (int i = 0; i < BENCH_NUMBERS; i++) {
+        double v;
+        bad += !xs_to_double(&strs[i], &v) || v != dbls[i];
+    }
+    printf("  xs_to_double      : %.6f s (%zu mismatches)\n", now_sec() - t,
+           bad);
+    for (int i = 0; i < BENCH_NUMBERS; i++)
+        xs_free(&strs[i]);
+
+    free(strs);
+    free(dbls);
+    free(ints);
+}
+
+#define BENCH_LOG_LINES 1000000
+
+static void bench_printf(void)
+{
+    static const char *const levels[] = {"debug", "info", "warn", "error"};
+    xs *lines = malloc(BENCH_LOG_LINES * sizeof(*lines));
+    xs msg, log, empty = xs_literal_empty();
+    char buf[256];
+    double t;
+
+    xs_new(&msg, "request served from cache");
+
+    printf("%d log lines\n", BENCH_LOG_LINES);
+    t = now_sec();
+    for (int i = 0; i < BENCH_LOG_LINES; i++) {
+        snprintf(buf, sizeof(buf), "ts=%d level=%s code=%d msg=%s", i,
+                 levels[i & 3], i % 600, xs_data(&msg));
+        xs_new(&lines[i], buf);
+    }
+    printf("  snprintf + xs_new      : %.6f s\n", now_sec() - t);
+    for (int i = 0; i < BENCH_LOG_LINES; i++)
+        xs_free(&lines[i]);
+    t = now_sec();
+    for (int i = 0; i < BENCH_LOG_LINES; i++) {
+        xs_printf(xs_newempty(&lines[i]), "ts=%d level=%s code=%d msg=%S", i,
+                  levels[i & 3], i % 600, &msg);
+    }
+    printf("  xs_printf              : %.6f s\n", now_sec() - t);
+    for (int i = 0; i < BENCH_LOG_LINES; i++)
+        xs_free(&lines[i]);
+
+    printf("%d lines appended to one log\n", BENCH_LOG_LINES);
+    xs_newempty(&log);
+    t = now_sec();
+    for (int i = 0; i < BENCH_LOG_LINES; i++) {
+        xs line;
+        snprintf(buf, sizeof(buf), "ts=%d level=%s code=%d msg=%s\n", i,
+                 levels[i & 3], i % 600, xs_data(&msg));
+        xs_concat(&log, &empty, xs_new(&line, buf));
+        xs_free(&line);
+    }
+    printf("  snprintf + xs_concat   : %.6f s\n", now_sec() - t);
+    xs_free(&log);
+    t = now_sec();
+    for (int i = 0; i < BENCH_LOG_LINES; i++) {
+        xs_printf_append(&log, "ts=%d level=%s code=%d msg=%S\n", i,
+                         levels[i & 3], i % 600, &msg);
+    }
+    printf("  xs_printf_append       : %.6f s (%zu bytes)\n", now_sec() - t,
+           xs_size(&log));
+    xs_free(&log);
+
+    xs_free(&msg);
+    free(lines);
+}
+
+#define BENCH_RECORDS (NR_TESTS * 3)
+
+static void bench_new_batch(void)
+{
+    const char **ptrs = malloc(BENCH_RECORDS * sizeof(*ptrs));
+    size_t *lens = malloc(BENCH_RECORDS * sizeof(*lens));
+    xs *strs = malloc(BENCH_RECORDS * sizeof(*strs)), proto;
+    char *text = random_string[LARGE_STRING];
+    double t;
+
+    /* NUL-terminated records of 4 to 200 bytes, parsed out of one buffer:
+     * about 3 MiB, within the 4 MiB of random text
+     */
+    init_random_string((uint8_t *) text, LARGE_STRING);
+    srand(1);
+    for (size_t i = 0, off = 0; i < BENCH_RECORDS; i++) {
+        lens[i] = 4 + rand() % 197;
+        ptrs[i] = text + off;
+        text[off + lens[i]] = 0;
+        off += lens[i] + 1;
+    }
+
+    printf("%d records of 4 to 200 bytes\n", BENCH_RECORDS);
+    xs_new(&proto, ptrs[0] + 1);
+    t = now_sec();
+    for (int i = 0; i < BENCH_RECORDS; i++)
+        xs_copy(&strs[i], &proto);
+    printf("  xs_copy of one %zu-byte string : %.6f s\n", xs_size(&proto),
+           now_sec() - t);
+    for (int i = 0; i < BENCH_RECORDS; i++)
+        xs_free(&strs[i]);
+    xs_free(&proto);
+
+    t = now_sec();
+    for (int i = 0; i < BENCH_RECORDS; i++)
+        xs_new(&strs[i], ptrs[i]);
+    printf("  xs_new                        : %.6f s\n", now_sec() - t);
+    t = now_sec();
+    for (int i = 0; i < BENCH_RECORDS; i++)
+        xs_free(&strs[i]);
+    printf("  xs_free                       : %.6f s\n", now_sec() - t);
+
+    t = now_sec();
+    void *slab = xs_new_batch(strs, ptrs, lens, BENCH_RECORDS);
+    printf("  xs_new_batch                  : %.6f s\n", now_sec() - t);
+    t = now_sec();
+    for (int i = 0; i < BENCH_RECORDS; i++)
+        xs_free(&strs[i]);
+    free(slab);
+    printf("  xs_free + slab                : %.6f s\n", now_sec() - t);
+
+    free(strs);
+    free(lens);
+    free(ptrs);
+}
+
+#define BENCH_NR_LAYOUT_KEYS 500000
+
+/* Key lengths as they come: short ids, hostnames, composite keys such as
+ * "user:12345678" and UUIDs in text form
+ */
+static size_t bench_key_len(void)
+{
+    int r = rand() % 10;
+
+    if (r < 3)
+        return 4 + rand() % 9;
+    if (r < 7)
+        return 12 + rand() % 17;
+    if (r < 9)
+        return 16 + rand() % 8;
+    return 36;
+}
+
+static void bench_layout(void)
+{
+    static char keybuf[BENCH_NR_LAYOUT_KEYS][40];
+    xs *keys = malloc(BENCH_NR_LAYOUT_KEYS * sizeof(xs));
+    size_t i, heap = 0, bytes = 0, hits = 0;
+    xs_map m;
+    double t;
+
+    srand(1);
+    for (i = 0; i < BENCH_NR_LAYOUT_KEYS; i++) {
+        size_t len = bench_key_len();
+        for (size_t n = 0; n < len; n++)
+            keybuf[i][n] = charset[rand() % (sizeof charset - 1)];
+        keybuf[i][len] = 0;
+    }
+
+    printf("%zu-byte xs, %d bytes inline, %d keys of 4-36 bytes\n",
+           sizeof(xs), XS_INLINE_MAX, BENCH_NR_LAYOUT_KEYS);
+    t = now_sec();
+    for (i = 0; i < BENCH_NR_LAYOUT_KEYS; i++)
+        xs_new(&keys[i], keybuf[i]);
+    printf("  xs_new         : %.6f s\n", now_sec() - t);
+    for (i = 0; i < BENCH_NR_LAYOUT_KEYS; i++) {
+        if (xs_is_ptr(&keys[i])) {
+            heap++;
+            bytes += (size_t) 1 << keys[i].capacity;
+        }
+    }
+    printf("  heap allocations: %zu (%.1f%%), %zu bytes, plus %zu in the "
+           "array\n",
+           heap, 100.0 * heap / BENCH_NR_LAYOUT_KEYS, bytes,
+           BENCH_NR_LAYOUT_KEYS * sizeof(xs));
+
+    xs_map_init(&m);
+    t = now_sec();
+    for (i = 0; i < BENCH_NR_LAYOUT_KEYS; i++)
+        xs_map_insert(&m, &keys[i], (void *) i);
+    printf("  xs_map insert  : %.6f s\n", now_sec() - t);
+    t = now_sec();
+    for (i = 0; i < BENCH_NR_LAYOUT_KEYS; i++)
+        hits += !!xs_map_find(&m, &keys[i]);
+    printf("  xs_map find    : %.6f s (%zu hits)\n", now_sec() - t, hits);
+    xs_map_free(&m);
+
+    t = now_sec();
+    xs_sort(keys, BENCH_NR_LAYOUT_KEYS);
+    printf("  xs_sort        : %.6f s\n", now_sec() - t);
+
+    t = now_sec();
+    for (i = 0; i < BENCH_NR_LAYOUT_KEYS; i++)
+        xs_free(&keys[i]);
+    printf("  xs_free        : %.6f s\n", now_sec() - t);
+    free(keys);
+}
+
+#define BENCH_NR_IO 200000
+
+/* write(2) and writev(2) calls made so far, as the kernel counts them */
+static size_t bench_io_syscw(void)
+{
+    char line[64];
+    size_t n = 0;
+    FILE *f = fopen("/proc/self/io", "r");
+
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "syscw: %zu", &n) == 1)
+            break;
+    fclose(f);
+    return n;
+}
+
+/* Write @strs to @fd one way or another; returns the system calls made */
+static size_t bench_io_write(int how, int fd, xs *strs, size_t n)
+{
+    size_t calls = bench_io_syscw();
+
+    if (how == 0) {
+        for (size_t i = 0; i < n; i++)
+            if (write(fd, xs_data(&strs[i]), xs_size(&strs[i])) < 0)
+                perror("write");
+    } else if (how == 1) {
+        if (xs_writev(fd, strs, n) < 0)
+            perror("xs_writev");
+    } else {
+        struct xs_writer *w = xs_writer_create(fd);
+        /* as a server would, a few records at a time */
+        for (size_t i = 0; i < n; i += 64)
+            xs_writer_add(w, &strs[i], n - i < 64 ? n - i : 64);
+        if (xs_writer_flush(w))
+            perror("xs_writer");
+        calls = w->syscalls;
+        xs_writer_destroy(w);
+        return calls;
+    }
+    return bench_io_syscw() - calls;
+}
+
+static void bench_io(void)
+{
+    static const char *const how[] = {"write loop", "xs_writev",
+                                      "xs_writer"};
+    xs *strs = malloc(BENCH_NR_IO * sizeof(xs));
+    char *text = random_string[LARGE_STRING];
+    size_t bytes = 0;
+
+    /* records of 4 to 200 bytes and every 64th a large one of 1-8 KiB */
+    init_random_string((uint8_t *) text, LARGE_STRING);
+    srand(1);
+    for (size_t i = 0; i < BENCH_NR_IO; i++) {
+        size_t len = i % 64 ? 4 + rand() % 197 : 1024 + rand() % 7169;
+        xs_newempty(&strs[i]);
+        memcpy(xs_append_space(&strs[i], len),
+               text + rand() % (TEST_MAX_STRING - len), len);
+        xs_set_size(&strs[i], len);
+        bytes += len;
+    }
+
+    printf("%d strings, %.1f MiB\n", BENCH_NR_IO, bytes / 1048576.0);
+    for (int pipe_out = 0; pipe_out < 2; pipe_out++) {
+        for (int i = 0; i < 3; i++) {
+            char path[] = "/tmp/xs-bench-XXXXXX";
+            pid_t child = -1;
+            int fd, fds[2];
+
+            if (pipe_out) {
+                if (pipe(fds) < 0)
+                    return perror("pipe");
+                child = fork();
+                if (!child) {
+                    static char buf[1 << 16];
+                    size_t got = 0;
+                    ssize_t ret;
+                    close(fds[1]);
+                    while ((ret = read(fds[0], buf, sizeof(buf))) > 0)
+                        got += ret;
+                    _exit(got != bytes);
+                }
+                close(fds[0]);
+                fd = fds[1];
+            } else {
+                fd = mkstemp(path);
+                if (fd < 0)
+                    return perror("mkstemp");
+                unlink(path);
+            }
+
+            double t = now_sec();
+            size_t calls = bench_io_write(i, fd, strs, BENCH_NR_IO);
+            int status = 0;
+            bool ok;
+            if (pipe_out) {
+                close(fd);
+                waitpid(child, &status, 0);
+                ok = WIFEXITED(status) && !WEXITSTATUS(status);
+            } else {
+                ok = lseek(fd, 0, SEEK_END) == (off_t) bytes;
+                close(fd);
+            }
+            t = now_sec() - t;
+            printf("  %s %-10s: %.6f s, %7.1f MB/s, %6zu syscalls "
+                   "(%.0f/s)%s\n",
+                   pipe_out ? "pipe" : "file", how[i], t, bytes / t / 1e6,
+                   calls, calls / t, ok ? "" : " SHORT");
+        }
+    }
+
+    for (size_t i = 0; i < BENCH_NR_IO; i++)
+        xs_free(&strs[i]);
+    free(strs);
+}
+
+#define BENCH_NR_FILES 1000
+#define BENCH_FILES_GROUP 250
+
+/* Drop the file from the page cache so that it comes from the disk */
+static void bench_evict(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+/* What the library offered so far: read(2) into a stack buffer, copy on */
+static size_t bench_read_loop(xs *out, const char *const *paths, size_t n)
+{
+    char buf[65536];
+    size_t ok = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        int fd = open(paths[i], O_RDONLY);
+        ssize_t ret;
+
+        xs_newempty(&out[i]);
+        if (fd < 0)
+            continue;
+        while ((ret = read(fd, buf, sizeof(buf))) > 0) {
+            memcpy(xs_append_space(&out[i], ret), buf, ret);
+            xs_set_size(&out[i], xs_size(&out[i]) + ret);
+        }
+        ok += !ret;
+        close(fd);
+    }
+    return ok;
+}
+
+static size_t bench_read_file_loop(xs *out,
+                                   const char *const *paths,
+                                   size_t n)
+{
+    size_t ok = 0;
+
+    for (size_t i = 0; i < n; i++)
+        ok += !xs_read_file(&out[i], paths[i]);
+    return ok;
+}
+
+static size_t bench_read_files(xs *out, const char *const *paths, size_t n)
+{
+    return xs_read_files(out, paths, n, NULL);
+}
+
+static void bench_read(void)
+{
+    static const struct {
+        const char *name;
+        size_t (*read)(xs *, const char *const *, size_t);
+    } how[] = {
+        {"read(2) loop", bench_read_loop},
+        {"xs_read_file", bench_read_file_loop},
+        {"xs_read_files", bench_read_files},
+    };
+    char dir[] = "/tmp/xs-bench-XXXXXX";
+    char (*paths)[64] = malloc(BENCH_NR_FILES * sizeof(*paths));
+    const char **ptrs = malloc(BENCH_NR_FILES * sizeof(*ptrs));
+    xs *out = malloc(BENCH_FILES_GROUP * sizeof(xs));
+    char *text = random_string[LARGE_STRING];
+    size_t bytes = 0;
+
+    if (!mkdtemp(dir))
+        return perror("mkdtemp");
+    for (size_t i = 0; i < BENCH_FILES_GROUP; i++)
+        xs_newempty(&out[i]);
+
+    /* 4 KiB to 4 MiB, evenly spread over the powers of two */
+    init_random_string((uint8_t *) text, LARGE_STRING);
+    srand(1);
+    for (size_t i = 0; i < BENCH_NR_FILES; i++) {
+        size_t len = (size_t) 4096 << rand() % 10;
+        len += rand() % len;
+        if (len > TEST_MAX_STRING)
+            len = TEST_MAX_STRING;
+        snprintf(paths[i], sizeof(paths[i]), "%s/%zu", dir, i);
+        ptrs[i] = paths[i];
+        int fd = open(paths[i], O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0 || write(fd, text, len) != (ssize_t) len)
+            perror(paths[i]);
+        fsync(fd);
+        close(fd);
+        bytes += len;
+    }
+
+    printf("%d files of 4 KiB to 4 MiB, %.1f MiB, read %d at a time\n",
+           BENCH_NR_FILES, bytes / 1048576.0, BENCH_FILES_GROUP);
+    for (int cold = 1; cold >= 0; cold--) {
+        for (size_t m = 0; m < sizeof(how) / sizeof(how[0]); m++) {
+            size_t ok = 0, got = 0;
+            double t = 0;
+
+            for (size_t i = 0; cold && i < BENCH_NR_FILES; i++)
+                bench_evict(paths[i]);
+            for (size_t i = 0; i < BENCH_NR_FILES; i += BENCH_FILES_GROUP) {
+                size_t n = BENCH_NR_FILES - i < BENCH_FILES_GROUP
+                               ? BENCH_NR_FILES - i
+                               : BENCH_FILES_GROUP;
+                double t0 = now_sec();
+                ok += how[m].read(out, &ptrs[i], n);
+                t += now_sec() - t0;
+                for (size_t j = 0; j < n; j++) {
+                    got += xs_size(&out[j]);
+                    xs_free(&out[j]);
+                }
+            }
+            printf("  %s %-13s: %.6f s, %7.1f MB/s, %zu files%s\n",
+                   cold ? "cold" : "warm", how[m].name, t, got / t / 1e6,
+                   ok, got == bytes ? "" : " SHORT");
+        }
+    }
+
+    for (size_t i = 0; i < BENCH_NR_FILES; i++)
+        unlink(paths[i]);
+    rmdir(dir);
+    free(out);
+    free(ptrs);
+    free(paths);
+}
+
+#define BENCH_NR_ARCHIVE 10000000
+
+static void bench_archive(void)
+{
+    char text_path[] = "/tmp/xs-bench-XXXXXX", path[64];
+    xs *strs = malloc(BENCH_NR_ARCHIVE * sizeof(xs)), text, x;
+    size_t i, bytes = 0, got = 0;
+    struct xs_archive a;
+    double t;
+    int fd;
+
+    /* one key per line: the way it was stored so far */
+    srand(1);
+    xs_newempty(&text);
+    for (i = 0; i < BENCH_NR_ARCHIVE; i++) {
+        size_t len = bench_key_len();
+        char *p = xs_append_space(&text, len + 1);
+        for (size_t n = 0; n < len; n++)
+            p[n] = charset[rand() % (sizeof charset - 1)];
+        p[len] = '\n';
+        xs_set_size(&text, xs_size(&text) + len + 1);
+        bytes += len;
+    }
+    fd = mkstemp(text_path);
+    if (fd < 0 || xs_write_all(fd, xs_data(&text), xs_size(&text)))
+        return perror(text_path);
+    fsync(fd);
+    close(fd);
+    xs_free(&text);
+    snprintf(path, sizeof(path), "%s.xsa", text_path);
+
+    printf("%d keys of 4-36 bytes, %.1f MiB\n", BENCH_NR_ARCHIVE,
+           bytes / 1048576.0);
+    bench_evict(text_path);
+    t = now_sec();
+    xs_read_file(&text, text_path);
+    char *line = xs_data(&text), *end = line + xs_size(&text);
+    for (i = 0; line < end; i++) {
+        char *nl = memchr(line, '\n', end - line);
+        *nl = 0;
+        xs_new(&strs[i], line);
+        line = nl + 1;
+    }
+    printf("  cold text + xs_new each : %.6f s\n", now_sec() - t);
+    xs_free(&text);
+
+    t = now_sec();
+    if (xs_save(path, strs, BENCH_NR_ARCHIVE))
+        perror(path);
+    fd = open(path, O_RDONLY);
+    fsync(fd);
+    printf("  xs_save                 : %.6f s, %.1f MiB\n", now_sec() - t,
+           lseek(fd, 0, SEEK_END) / 1048576.0);
+    close(fd);
+    for (i = 0; i < BENCH_NR_ARCHIVE; i++)
+        xs_free(&strs[i]);
+
+    for (int cold = 1; cold >= 0; cold--) {
+        if (cold)
+            bench_evict(path);
+        t = now_sec();
+        xs_archive_open(&a, path);
+        xs_archive_load(&a, strs);
+        t = now_sec() - t;
+        for (i = 0, got = 0; i < a.n; i++) {
+            got += xs_size(&strs[i]);
+            xs_free(&strs[i]);
+        }
+        printf("  %s xs_archive_load    : %.6f s%s\n", cold ? "cold" : "warm",
+               t, got == bytes ? "" : " MISMATCH");
+        xs_archive_close(&a);
+    }
+
+    /* what it takes to start serving: open, then only what is asked for */
+    bench_evict(path);
+    t = now_sec();
+    xs_archive_open(&a, path);
+    for (i = 0; i < 1000; i++) {
+        xs_archive_get(&a, (size_t) rand() % a.n, &x);
+        got += xs_size(&x);
+    }
+    printf("  cold open + 1000 gets   : %.6f s\n", now_sec() - t);
+    xs_archive_close(&a);
+
+    unlink(path);
+    unlink(text_path);
+    free(strs);
+}
+
+#define BENCH_NR_DICT 1000000
+
+static bool bench_dict_count(const xs *key, size_t i, void *arg)
+{
+    *(size_t *) arg += xs_size(key) + i;
+    return true;
+}
+
+static void bench_dict(void)
+{
+    static const char *const tld[] = {"com", "net", "org", "io"};
+    xs *keys = malloc(BENCH_NR_DICT * sizeof(xs)), *queries, x;
+    size_t i, heap = 0, hits = 0, sum = 0;
+    struct xs_fcdict d;
+    char buf[128];
+    double t;
+
+    /* URLs: a few thousand hosts with deep, repetitive paths */
+    srand(1);
+    for (i = 0; i < BENCH_NR_DICT; i++) {
+        snprintf(buf, sizeof(buf),
+                 "https://www.host%d.example.%s/static/v%d/assets/"
+                 "section%d/item%06d.html",
+                 rand() % 5000, tld[rand() % 4], rand() % 3, rand() % 20,
+                 rand() % 1000000);
+        xs_new(&keys[i], buf);
+    }
+    xs_sort(keys, BENCH_NR_DICT);
+    for (i = 0; i < BENCH_NR_DICT; i++) {
+        sum += xs_size(&keys[i]);
+        if (xs_is_ptr(&keys[i]))
+            heap += ((size_t) 1 << keys[i].capacity) +
+                    4 * xs_is_large_string(&keys[i]);
+    }
+
+    t = now_sec();
+    xs_fcdict_build(&d, keys, BENCH_NR_DICT);
+    printf("%d sorted URLs, %.1f MiB of text\n", BENCH_NR_DICT,
+           sum / 1048576.0);
+    printf("  xs_fcdict_build    : %.6f s\n", now_sec() - t);
+    printf("  memory: xs array %.1f MiB (+ malloc overhead), "
+           "xs_fcdict %.1f MiB\n",
+           (BENCH_NR_DICT * sizeof(xs) + heap) / 1048576.0,
+           xs_fcdict_memory(&d) / 1048576.0);
+
+    queries = malloc(BENCH_NR_DICT * sizeof(xs));
+    for (i = 0; i < BENCH_NR_DICT; i++)
+        queries[i] = keys[rand() % BENCH_NR_DICT];
+
+    t = now_sec();
+    for (i = 0; i < BENCH_NR_DICT; i++)
+        hits += !!bsearch(&queries[i], keys, BENCH_NR_DICT, sizeof(xs),
+                          bench_cmp_xs);
+    t = now_sec() - t;
+    printf("  bsearch            : %.0f ns/lookup (%zu hits)\n",
+           t * 1e9 / BENCH_NR_DICT, hits);
+    hits = 0;
+    t = now_sec();
+    for (i = 0; i < BENCH_NR_DICT; i++)
+        hits += xs_fcdict_find(&d, &queries[i], NULL);
+    t = now_sec() - t;
+    printf("  xs_fcdict_find     : %.0f ns/lookup (%zu hits)\n",
+           t * 1e9 / BENCH_NR_DICT, hits);
+
+    t = now_sec();
+    for (i = 0; i < BENCH_NR_DICT; i++) {
+        xs_fcdict_get(&d, rand() % BENCH_NR_DICT, &x);
+        sum += xs_size(&x);
+        xs_free(&x);
+    }
+    t = now_sec() - t;
+    printf("  xs_fcdict_get      : %.0f ns/key\n", t * 1e9 / BENCH_NR_DICT);
+
+    xs_new(&x, "https://www.host42");
+    t = now_sec();
+    hits = xs_fcdict_prefix(&d, &x, bench_dict_count, &sum);
+    printf("  xs_fcdict_prefix   : %.6f s for %zu keys of \"%s\"\n",
+           now_sec() - t, hits, xs_data(&x));
+    xs_free(&x);
+
+    xs_fcdict_free(&d);
+    for (i = 0; i < BENCH_NR_DICT; i++)
+        xs_free(&keys[i]);
+    free(queries);
+    free(keys);
+}
+
+#define BENCH_NR_EXPAND 20
+#define BENCH_NR_CACHE 256
+
+/* Log-like text: the same few templates with varying fields */
+static void bench_repetitive_text(char *buf, size_t len)
+{
+    static const char *const fmt[] = {
+        "%06d GET /api/v1/users/%d HTTP/1.1 200 %d\n",
+        "%06d POST /api/v1/orders HTTP/1.1 201 %d id=%d\n",
+        "%06d WARN cache miss for key session:%d (%d ms)\n",
+    };
+    size_t off = 0;
+
+    for (int i = 0; off < len; i++) {
+        char line[128];
+        int n = snprintf(line, sizeof(line), fmt[rand() % 3], i,
+                         rand() % 10000, rand() % 500);
+        memcpy(buf + off, line, off + n < len ? (size_t) n : len - off);
+        off += n;
+    }
+    buf[len] = 0;
+}
+
+static void bench_compress(void)
+{
+    static const char *const desc[] = {"random", "repetitive"};
+    static char text[TEST_MAX_STRING + 1];
+    xs copies[BENCH_NR_EXPAND], x;
+    double t;
+
+    for (int kind = 0; kind < 2; kind++) {
+        if (kind)
+            bench_repetitive_text(text, TEST_MAX_STRING);
+        else
+            init_random_string((uint8_t *) text, LARGE_STRING);
+        xs_new(&x, text);
+
+        t = now_sec();
+        bool ok = xs_compress(&x);
+        t = now_sec() - t;
+        if (!ok) {
+            printf("  %-10s: %.6f s, %.1f MB/s, incompressible, left flat\n",
+                   desc[kind], t, TEST_MAX_STRING / t / 1e6);
+            xs_free(&x);
+            continue;
+        }
+        size_t csize = ((struct xs_lz *) x.ptr)->csize;
+        printf("  %-10s: ratio %.2f, compress %.1f MB/s", desc[kind],
+               (double) TEST_MAX_STRING / csize, TEST_MAX_STRING / t / 1e6);
+
+        /* every CoW copy is expanded on its own */
+        for (int i = 0; i < BENCH_NR_EXPAND; i++)
+            xs_copy(&copies[i], &x);
+        t = now_sec();
+        for (int i = 0; i < BENCH_NR_EXPAND; i++)
+            ok &= xs_expand(&copies[i]);
+        t = now_sec() - t;
+        ok &= xs_expand(&x);
+        printf(", expand %.2f GB/s%s\n",
+               (double) BENCH_NR_EXPAND * TEST_MAX_STRING / t / 1e9,
+               !ok || memcmp(xs_data(&x), text, TEST_MAX_STRING) ? " MISMATCH"
+                                                                 : "");
+        for (int i = 0; i < BENCH_NR_EXPAND; i++)
+            xs_free(&copies[i]);
+        xs_free(&x);
+    }
+
+    /* a cache of 64 KiB entries where one in four is in use */
+    xs *cache = malloc(BENCH_NR_CACHE * sizeof(xs));
+    size_t total = 0, saved;
+    for (int i = 0; i < BENCH_NR_CACHE; i++) {
+        bench_repetitive_text(text, 65535);
+        xs_new(&cache[i], text);
+        total += ((size_t) 1 << cache[i].capacity) + 4;
+    }
+    t = now_sec();
+    saved = xs_compress_idle(cache, BENCH_NR_CACHE);
+    printf("  xs_compress_idle: %.6f s, %d x 64 KiB entries, %.1f of %.1f "
+           "MiB saved\n",
+           now_sec() - t, BENCH_NR_CACHE, saved / 1048576.0,
+           total / 1048576.0);
+    for (int i = 0; i < BENCH_NR_CACHE; i += 4)
+        xs_expand(&cache[i]);
+    saved = xs_compress_idle(cache, BENCH_NR_CACHE);
+    printf("  a quarter used, then a sweep: %.1f MiB saved", saved / 1048576.0);
+    saved = xs_compress_idle(cache, BENCH_NR_CACHE);
+    printf(", and one more: %.1f MiB\n", saved / 1048576.0);
+    for (int i = 0; i < BENCH_NR_CACHE; i++)
+        xs_free(&cache[i]);
+    free(cache);
+}
+
+#define BENCH_NR_ROWS 5000000
+#define BENCH_NR_DISTINCT 3000
+
+static void bench_column(void)
+{
+    xs *distinct = malloc(BENCH_NR_DISTINCT * sizeof(xs));
+    xs *rows = malloc(BENCH_NR_ROWS * sizeof(xs));
+    size_t *hits = malloc(BENCH_NR_ROWS * sizeof(size_t));
+    size_t i, heap = 0, n;
+    struct xs_dict_column c;
+    char buf[64];
+    double t;
+
+    /* user agents, hostnames and short codes, skewed towards a few */
+    srand(1);
+    for (i = 0; i < BENCH_NR_DISTINCT; i++) {
+        snprintf(buf, sizeof(buf),
+                 i % 3 ? "Mozilla/5.0 (build %zu; rv:%zu)"
+                       : (i % 2 ? "edge-%zu.cdn.example.net" : "C%zu"),
+                 i, i * 7 % 100);
+        xs_new(&distinct[i], buf);
+    }
+
+    t = now_sec();
+    for (i = 0; i < BENCH_NR_ROWS; i++) {
+        size_t v = rand() % BENCH_NR_DISTINCT;
+        xs_copy(&rows[i], &distinct[v * v / BENCH_NR_DISTINCT]);
+        if (xs_is_ptr(&rows[i]))
+            heap += (size_t) 1 << rows[i].capacity;
+    }
+    printf("%d rows over %d values\n", BENCH_NR_ROWS, BENCH_NR_DISTINCT);
+    printf("  xs array build   : %.6f s, %.1f MiB\n", now_sec() - t,
+           (BENCH_NR_ROWS * sizeof(xs) + heap) / 1048576.0);
+
+    xs_dict_column_init(&c);
+    t = now_sec();
+    for (i = 0; i < BENCH_NR_ROWS; i++)
+        xs_dict_column_append(&c, &rows[i]);
+    printf("  column append    : %.6f s, %.1f MiB\n", now_sec() - t,
+           (c.rows_alloc * sizeof(uint32_t) + c.values_alloc * sizeof(xs)) /
+               1048576.0);
+
+    t = now_sec();
+    for (i = 0, n = 0; i < BENCH_NR_ROWS; i++)
+        if (xs_equal(&rows[i], &distinct[42]))
+            hits[n++] = i;
+    printf("  xs_equal filter  : %.6f s, %zu rows\n", now_sec() - t, n);
+    t = now_sec();
+    n = xs_dict_column_filter_eq(&c, &distinct[42], hits);
+    printf("  code filter      : %.6f s, %zu rows\n", now_sec() - t, n);
+
+    for (i = 0; i < BENCH_NR_ROWS; i++)
+        xs_free(&rows[i]);
+    t = now_sec();
+    xs_dict_column_materialize(&c, 0, BENCH_NR_ROWS, rows);
+    printf("  materialize      : %.6f s\n", now_sec() - t);
+    for (i = 0, n = 0; i < BENCH_NR_ROWS; i++) {
+        n += !xs_equal(&rows[i], xs_dict_column_get(&c, i));
+        xs_free(&rows[i]);
+    }
+    if (n)
+        printf("  %zu rows differ\n", n);
+
+    xs_dict_column_free(&c);
+    for (i = 0; i < BENCH_NR_DISTINCT; i++)
+        xs_free(&distinct[i]);
+    free(hits);
+    free(rows);
+    free(distinct);
+}
+
+#define BENCH_NR_CODEC 20
+
+/* The way it was done before: a scalar routine into a temporary buffer,
+ * then xs_new()
+ */
+static void bench_base64_external(xs *x, const uint8_t *s, size_t n)
+{
+    char *tmp = malloc((n + 2) / 3 * 4 + 1), *o = tmp;
+    size_t i = 0;
+
+    for (; i + 3 <= n; i += 3) {
+        *o++ = xs_base64_chars[s[i] >> 2];
+        *o++ = xs_base64_chars[(s[i] & 3) << 4 | s[i + 1] >> 4];
+        *o++ = xs_base64_chars[(s[i + 1] & 15) << 2 | s[i + 2] >> 6];
+        *o++ = xs_base64_chars[s[i + 2] & 63];
+    }
+    if (i < n) {
+        *o++ = xs_base64_chars[s[i] >> 2];
+        *o++ = xs_base64_chars[(s[i] & 3) << 4 |
+                               (i + 1 < n ? s[i + 1] >> 4 : 0)];
+        *o++ = i + 1 < n ? xs_base64_chars[(s[i + 1] & 15) << 2] : '=';
+        *o++ = '=';
+    }
+    *o = 0;
+    xs_new(x, tmp);
+    free(tmp);
+}
+
+static void bench_codec(void)
+{
+    uint8_t *payload = (uint8_t *) random_string[LARGE_STRING];
+    size_t n = TEST_MAX_STRING;
+    xs text = xs_literal_empty(), bytes = xs_literal_empty();
+    bool ok = true;
+    double t;
+
+    for (size_t i = 0; i < n; i++)
+        payload[i] = rand();
+    printf("%zu-byte payload, %s\n", n,
+           xs_cpu_has_avx2() ? "AVX2" : "no AVX2: scalar");
+
+#define BENCH_CODEC(desc, call, bytes_per_run)                               \
+    do {                                                                     \
+        t = now_sec();                                                       \
+        for (int i = 0; i < BENCH_NR_CODEC; i++)                             \
+            call;                                                            \
+        t = now_sec() - t;                                                   \
+        printf("  %-24s: %.2f GB/s\n", desc,                                 \
+               (double) (bytes_per_run) * BENCH_NR_CODEC / t / 1e9);          \
+    } while (0)
+
+    BENCH_CODEC("scalar + xs_new encode", (xs_free(&text),
+                bench_base64_external(&text, payload, n)), n);
+    BENCH_CODEC("xs_base64_encode", xs_base64_encode(&text, payload, n), n);
+    BENCH_CODEC("xs_base64_decode",
+                ok &= xs_base64_decode(&bytes, xs_data(&text),
+                                       xs_size(&text)),
+                n);
+    ok &= xs_size(&bytes) == n && !memcmp(xs_data(&bytes), payload, n);
+    BENCH_CODEC("xs_hex_encode", xs_hex_encode(&text, payload, n), n);
+    BENCH_CODEC("xs_hex_decode",
+                ok &= xs_hex_decode(&bytes, xs_data(&text), xs_size(&text)),
+                n);
+    ok &= xs_size(&bytes) == n && !memcmp(xs_data(&bytes), payload, n);
+#undef BENCH_CODEC
+    if (!ok)
+        printf("  round trip FAILED\n");
+
+    xs_free(&text);
+    xs_free(&bytes);
+    init_random_string(payload, LARGE_STRING);
+}
+
+#define BENCH_NR_RECORDS 100000
+
+/* The way it was done before: one xs_concat() per source byte */
+static void bench_json_bytewise(xs *out, const xs *s)
+{
+    const uint8_t *p = (const uint8_t *) xs_data(s);
+    xs empty = xs_literal_empty(), piece;
+
+    for (size_t i = 0; i < xs_size(s); i++) {
+        char buf[8] = {0};
+        if (p[i] == '"' || p[i] == '\\')
+            buf[0] = '\\', buf[1] = p[i];
+        else if (p[i] < 0x20)
+            snprintf(buf, sizeof(buf), "\\u%04x", p[i]);
+        else
+            buf[0] = p[i];
+        xs_new(&piece, buf);
+        xs_concat(out, &empty, &piece);
+        xs_free(&piece);
+    }
+}
+
+static void bench_escape(void)
+{
+    xs *rec = malloc(BENCH_NR_RECORDS * sizeof(xs));
+    xs out = xs_literal_empty(), back = xs_literal_empty();
+    size_t bytes = 0, i;
+    bool ok = true;
+    double t;
+
+    /* user text: mostly clean, now and then a quote or a line break */
+    for (i = 0; i < BENCH_NR_RECORDS; i++) {
+        char buf[256];
+        size_t len = 32 + rand() % 200;
+        for (size_t k = 0; k < len; k++) {
+            int r = rand() % 64;
+            buf[k] = !r ? '"' : r == 1 ? '\n' : ' ' + rand() % 94 + 1;
+        }
+        buf[len] = 0;
+        xs_new(&rec[i], buf);
+        bytes += len;
+    }
+    printf("%d records, %zu bytes, %s\n", BENCH_NR_RECORDS, bytes,
+           xs_cpu_has_avx2() ? "AVX2" : "no AVX2");
+
+    t = now_sec();
+    for (i = 0; i < BENCH_NR_RECORDS; i++) {
+        xs_reset(&out, 0);
+        bench_json_bytewise(&out, &rec[i]);
+    }
+    t = now_sec() - t;
+    printf("  xs_concat per byte     : %.4f s, %.3f GB/s\n", t,
+           bytes / t / 1e9);
+
+    t = now_sec();
+    for (i = 0; i < BENCH_NR_RECORDS; i++) {
+        xs_reset(&out, 0);
+        xs_append_json_escaped(&out, &rec[i]);
+    }
+    t = now_sec() - t;
+    printf("  xs_append_json_escaped : %.4f s, %.3f GB/s\n", t,
+           bytes / t / 1e9);
+
+    t = now_sec();
+    for (i = 0; i < BENCH_NR_RECORDS; i++) {
+        xs_reset(&out, 0);
+        xs_append_json_escaped(&out, &rec[i]);
+        xs_reset(&back, 0);
+        ok &= xs_append_json_unescaped(&back, &out) &&
+              xs_equal(&back, &rec[i]);
+    }
+    t = now_sec() - t;
+    printf("  escape + unescape      : %.4f s\n", t);
+
+    t = now_sec();
+    for (i = 0; i < BENCH_NR_RECORDS; i++) {
+        xs_reset(&out, 0);
+        xs_append_csv_escaped(&out, &rec[i], ',');
+        xs_reset(&back, 0);
+        ok &= xs_append_csv_unescaped(&back, &out) &&
+              xs_equal(&back, &rec[i]);
+    }
+    t = now_sec() - t;
+    printf("  CSV escape + unescape  : %.4f s\n", t);
+    if (!ok)
+        printf("  round trip FAILED\n");
+
+    xs_free(&out);
+    xs_free(&back);
+    for (i = 0; i < BENCH_NR_RECORDS; i++)
+        xs_free(&rec[i]);
+    free(rec);
+}
+
+/* The way it was done before: find, then xs_concat() the pieces */
+static void bench_replace_concat(xs *x, const xs *needle, const xs *repl)
+{
+    xs out = xs_literal_empty(), piece, empty = xs_literal_empty();
+    const char *s = xs_data(x);
+    size_t i = 0, pos, m = xs_size(needle);
+
+    while ((pos = xs_find(x, needle, i)) != XS_NPOS) {
+        char *seg = strndup(s + i, pos - i);
+        xs_new(&piece, seg);
+        xs_concat(&out, &empty, &piece);
+        xs_concat(&out, &empty, repl);
+        xs_free(&piece);
+        free(seg);
+        i = pos + m;
+    }
+    xs_new(&piece, s + i);
+    xs_concat(&out, &empty, &piece);
+    xs_free(&piece);
+    xs_free(x);
+    *x = out;
+}
+
+static void bench_replace(void)
+{
+    char *buf = random_string[LARGE_STRING];
+    xs x, copy, needle = *xs_tmp("a"), longer = *xs_tmp("<a>"),
+                shorter = xs_literal_empty();
+    xs needles[] = {*xs_tmp("a"), *xs_tmp("b"), *xs_tmp("c")},
+       repls[] = {*xs_tmp("<a>"), *xs_tmp("<b>"), *xs_tmp("<c>")};
+    double t;
+
+    init_random_string((uint8_t *) buf, LARGE_STRING);
+    xs_new(&x, buf);
+    printf("%zu bytes, %zu matches of \"a\"\n", xs_size(&x),
+           xs_count(&x, &needle));
+
+    xs_new(&copy, buf);
+    t = now_sec();
+    bench_replace_concat(&copy, &needle, &longer);
+    printf("  find + xs_concat         : %.4f s\n", now_sec() - t);
+    size_t expect = xs_size(&copy);
+    xs_free(&copy);
+
+    xs_copy(&copy, &x);
+    t = now_sec();
+    xs_replace_all(&copy, &needle, &longer);
+    printf("  xs_replace_all, growing  : %.4f s%s\n", now_sec() - t,
+           xs_size(&copy) == expect ? "" : " MISMATCH");
+    xs_free(&copy);
+
+    xs_new(&copy, buf);
+    t = now_sec();
+    xs_replace_all(&copy, &needle, &shorter);
+    printf("  xs_replace_all, in place : %.4f s\n", now_sec() - t);
+    xs_free(&copy);
+
+    xs_copy(&copy, &x);
+    t = now_sec();
+    xs_replace_multi(&copy, needles, repls, 3);
+    printf("  xs_replace_multi, 3      : %.4f s\n", now_sec() - t);
+    xs_free(&copy);
+
+    xs_free(&x);
+}
+
+#define BENCH_NR_EDITS 20000
+
+/* Typing and deleting around a cursor wandering in the middle */
+static double bench_edit_session(xs *doc)
+{
+    size_t cursor = xs_size(doc) / 2;
+    double t = now_sec();
+
+    srand(1);
+    for (int i = 0; i < BENCH_NR_EDITS; i++) {
+        if (rand() % 8 == 0)
+            cursor += rand() % 101 - 50;
+        if (rand() % 4) {
+            xs_insert(doc, cursor, "k", 1);
+            cursor++;
+        } else if (cursor) {
+            xs_erase(doc, --cursor, 1);
+        }
+    }
+    return now_sec() - t;
+}
+
+static void bench_edit(void)
+{
+    char *buf = random_string[LARGE_STRING];
+    xs flat, gap;
+    double t;
+
+    init_random_string((uint8_t *) buf, LARGE_STRING);
+    xs_new(&flat, buf);
+    xs_new(&gap, buf);
+    printf("%zu-byte document, %d keystrokes\n", xs_size(&flat),
+           BENCH_NR_EDITS);
+
+    printf("  flat xs_insert/xs_erase : %.4f s\n", bench_edit_session(&flat));
+    xs_gap_mode(&gap);
+    printf("  gap mode                : %.4f s\n", bench_edit_session(&gap));
+    t = now_sec();
+    xs_expand(&gap);
+    printf("  xs_expand() to flatten  : %.4f s\n", now_sec() - t);
+    if (!xs_equal(&flat, &gap))
+        printf("  MISMATCH\n");
+
+    xs_free(&flat);
+    xs_free(&gap);
+}
+
+#define BENCH_HUGE_SIZE ((size_t) 256 << 20)
+
+/* Per-edit time of one-byte edits, each made on a fresh CoW copy of @x */
+static double bench_shared_edits(xs *x, int nr)
+{
+    double t = now_sec();
+
+    for (int i = 0; i < nr; i++) {
+        xs copy;
+        xs_copy(&copy, x);
+        xs_set_bytes(&copy, (size_t) rand() * 4099 % xs_size(x), "z", 1);
+        xs_free(&copy);
+    }
+    return (now_sec() - t) / nr;
+}
+
+static void bench_paged(void)
+{
+    char *buf = malloc(BENCH_HUGE_SIZE + 1);
+    xs flat, paged;
+    double t;
+
+    init_random_string((uint8_t *) random_string[LARGE_STRING], LARGE_STRING);
+    for (size_t i = 0; i < BENCH_HUGE_SIZE; i += TEST_MAX_STRING)
+        memcpy(buf + i, random_string[LARGE_STRING],
+               BENCH_HUGE_SIZE - i < TEST_MAX_STRING ? BENCH_HUGE_SIZE - i
+                                                     : TEST_MAX_STRING);
+    buf[BENCH_HUGE_SIZE] = 0;
+    xs_new(&flat, buf);
+    xs_new(&paged, buf);
+    free(buf);
+    printf("%zu MiB shared string, one-byte edits on CoW copies\n",
+           BENCH_HUGE_SIZE >> 20);
+
+    printf("  flat              : %.6f s per edit\n",
+           bench_shared_edits(&flat, 10));
+    t = now_sec();
+    xs_paged_mode(&paged);
+    printf("  xs_paged_mode     : %.4f s, once\n", now_sec() - t);
+    printf("  paged             : %.6f s per edit\n",
+           bench_shared_edits(&paged, 1000));
+
+    xs_free(&flat);
+    xs_free(&paged);
+}
+
+#define BENCH_SHM_WORKERS 4
+#define BENCH_SHM_SIZE ((size_t) 64 << 20)
+
+/* Proportional set size of this process in KiB, -1 if unknown */
+static long bench_pss_kb(void)
+{
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    char line[256];
+    long kb = -1;
+
+    if (!f)
+        return -1;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "Pss: %ld kB", &kb) == 1)
+            break;
+    fclose(f);
+    return kb;
+}
+
+/* Each worker gets the string, reads it all, and reports the time it took
+ * and how much its PSS grew
+ */
+static void bench_shm_workers(const char *desc, const char *src, bool shared)
+{
+    int fds[2];
+    double t_sum = 0;
+    long kb_sum = 0;
+
+    if (pipe(fds) < 0)
+        return;
+    for (int i = 0; i < BENCH_SHM_WORKERS; i++) {
+        if (fork())
+            continue;
+        long kb = bench_pss_kb();
+        double t = now_sec();
+        xs x, needle = *xs_tmp("@@@");
+        if (shared)
+            xs_copy(&x, xs_shm_slot(0));
+        else
+            xs_new(&x, src);
+        volatile size_t hits = xs_count(&x, &needle);
+        (void) hits;
+        double r[2] = {now_sec() - t, (double) (bench_pss_kb() - kb)};
+        if (write(fds[1], r, sizeof(r)) != sizeof(r))
+            _exit(1);
+        xs_free(&x);
+        _exit(0);
+    }
+    close(fds[1]);
+    for (int i = 0; i < BENCH_SHM_WORKERS; i++) {
+        double r[2];
+        if (read(fds[0], r, sizeof(r)) == sizeof(r)) {
+            t_sum += r[0];
+            kb_sum += r[1];
+        }
+        wait(NULL);
+    }
+    close(fds[0]);
+    printf("  %-8s: %.4f s and %6ld KiB PSS per worker\n", desc,
+           t_sum / BENCH_SHM_WORKERS, kb_sum / BENCH_SHM_WORKERS);
+}
+
+static void bench_shm(void)
+{
+    char *src = malloc(BENCH_SHM_SIZE + 1);
+    /* the buffer is the next power of 2 up, but untouched pages cost
+     * nothing
+     */
+    int fd = xs_shm_create(2 * BENCH_SHM_SIZE + ((size_t) 1 << 20));
+    xs x;
+
+    if (fd < 0) {
+        printf("memfd region: %s\n", strerror(errno));
+        free(src);
+        return;
+    }
+    init_random_string((uint8_t *) random_string[LARGE_STRING], LARGE_STRING);
+    for (size_t i = 0; i < BENCH_SHM_SIZE; i += TEST_MAX_STRING)
+        memcpy(src + i, random_string[LARGE_STRING],
+               BENCH_SHM_SIZE - i < TEST_MAX_STRING ? BENCH_SHM_SIZE - i
+                                                    : TEST_MAX_STRING);
+    src[BENCH_SHM_SIZE] = 0;
+    printf("%d workers, each needing the same %zu MiB string\n",
+           BENCH_SHM_WORKERS, BENCH_SHM_SIZE >> 20);
+
+    bench_shm_workers("reload", src, false);
+    xs_shm_new(&x, src, BENCH_SHM_SIZE);
+    xs_copy(xs_shm_slot(0), &x);
+    bench_shm_workers("shared", src, true);
+    printf("  reference count back to %d\n", xs_get_ref_count(&x));
+
+    xs_free(xs_shm_slot(0));
+    xs_free(&x);
+    close(fd);
+    free(src);
+}
+
+static const struct {
+    const char *name;
+    void (*func)(void);
+} benchmarks[] = {
+    {"map", bench_map},
+    {"intern", bench_intern},
+    {"sort", bench_sort},
+    {"batch", bench_batch},
+    {"parallel", bench_parallel},
+    {"case", bench_case},
+    {"utf8", bench_utf8},
+    {"number", bench_number},
+    {"printf", bench_printf},
+    {"new_batch", bench_new_batch},
+    {"layout", bench_layout},
+    {"io", bench_io},
+    {"read", bench_read},
+    {"archive", bench_archive},
+    {"dict", bench_dict},
+    {"compress", bench_compress},
+    {"column", bench_column},
+    {"codec", bench_codec},
+    {"escape", bench_escape},
+    {"replace", bench_replace},
+    {"edit", bench_edit},
+    {"paged", bench_paged},
+    {"shm", bench_shm},
+};
+
+#define NR_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static void run_benchmark(const char *name)
+{
+    bool all = !strcmp(name, "all");
+
+    for (size_t i = 0; i < NR_BENCHMARKS; i++) {
+        if (!all && strcmp(name, benchmarks[i].name))
+            continue;
+        printf("============== %s benchmark ==============\n",
+               benchmarks[i].name);
+        benchmarks[i].func();
+        printf("\n");
+        if (!all)
+            return;
+    }
+    if (!all)
+        printf("Unknown benchmark '%s'\n", name);
+}
+
+static void usage(char *cmd)
+{
+    printf("Usage: %s [-h] [-d] name...\n", cmd);
+    printf("\t-h         Print this information\n");
+    printf("\t-d         Disable CoW\n");
+    printf("\tname       Benchmark to run ('all' runs every one):");
+    for (size_t i = 0; i < NR_BENCHMARKS; i++)
+        printf(" %s", benchmarks[i].name);
+    printf("\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+
+    while ((c = getopt(argc, argv, "hd")) != -1) {
+        switch (c) {
+        case 'h':
+            usage(argv[0]);
+            break;
+        case 'd':
+            disable_cow = 1;
+            break;
+        default:
+            printf("Unknown option '%c'\n", c);
+            usage(argv[0]);
+            break;
+        }
+    }
+    if (optind == argc)
+        usage(argv[0]);
+
+    for (; optind < argc; optind++)
+        run_benchmark(argv[optind]);
+    return 0;
+}
+
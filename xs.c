@@ -1,33 +1,81 @@
+#include <pthread.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
-#define MAX_STR_LEN_BITS (54)
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define XS_HAVE_IO_URING
+#endif
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define MAX_STR_LEN_BITS (53)
 #define MAX_STR_LEN ((1UL << MAX_STR_LEN_BITS) - 1)
 
 #define LARGE_STRING_LEN 256
 
+/* Build with -DXS_INLINE_24 for a 24-byte xs keeping up to 23 bytes inline
+ * instead of 15, e.g. UUIDs in text form still spill but most hostnames and
+ * composite keys do not.
+ */
+#ifdef XS_INLINE_24
+#define XS_INLINE_SIZE 24
+#else
+#define XS_INLINE_SIZE 16
+#endif
+#define XS_INLINE_MAX (XS_INLINE_SIZE - 1)
+#define XS_INLINE_WORDS (XS_INLINE_SIZE / 8)
+
 typedef union {
-    /* allow strings up to 15 bytes to stay on the stack
+    /* allow strings up to XS_INLINE_MAX bytes to stay on the stack
      * use the last byte as a null terminator and to store flags
      * much like fbstring:
      * https://github.com/facebook/folly/blob/master/folly/docs/FBString.md
      */
-    char data[16];
+    char data[XS_INLINE_SIZE];
 
     struct {
-        uint8_t filler[15],
+        uint8_t filler[XS_INLINE_MAX],
             /* how many free bytes in this stack allocated string
              * same idea as fbstring
              */
+#ifdef XS_INLINE_24
+            space_left : 5,
+#else
             space_left : 4,
+#endif
             /* if it is on heap, set to 1 */
-            is_ptr : 1, is_large_string : 1, flag2 : 1, flag3 : 1;
+            is_ptr : 1, is_large_string : 1,
+            /* heap bytes owned elsewhere: never freed, copied before any
+             * change, see xs_new_batch()
+             */
+            is_borrowed : 1;
+#ifndef XS_INLINE_24
+        /* heap string known to be valid UTF-8, see xs_utf8_valid() */
+        uint8_t is_utf8 : 1;
+#endif
     };
 
     /* heap allocated */
@@ -35,14 +83,59 @@ typedef union {
         char *ptr;
         /* supports strings up to 2^MAX_STR_LEN_BITS - 1 bytes */
         size_t size : MAX_STR_LEN_BITS,
+                      /* large string held in another form, @ptr being a
+                       * struct xs_ext: see xs_expand()
+                       */
+                      is_ext : 1,
                       /* capacity is always a power of 2 (unsigned)-1 */
-                      capacity : 6;
-        /* the last 4 bits are important flags */
+                      capacity : 6,
+#ifndef XS_INLINE_24
+                      /* the last 4 bits are important flags: is_ptr,
+                       * is_large_string and is_borrowed as XS_FLAG_* bits
+                       * for constant initializers, see xs_static()
+                       */
+                      flags : 3;
+#else
+                      : 0;
+        /* here the flags are in the last byte, which has no room left for
+         * this heap-only one
+         */
+        size_t is_utf8 : 1, : 60,
+            /* the last byte's flags as in the 16-byte layout */
+            flags : 3;
+#endif
     };
 } xs;
 
+_Static_assert(sizeof(xs) == XS_INLINE_SIZE, "xs layout");
+
+#define XS_FLAG_PTR 1
+#define XS_FLAG_LARGE_STRING 2
+#define XS_FLAG_BORROWED 4
+
 static int disable_cow;
 
+/* Operations on strings of at least xs_parallel_threshold bytes are split
+ * across xs_global_pool, see xs_set_pool().
+ */
+struct xs_pool;
+static struct xs_pool *xs_global_pool;
+static size_t xs_parallel_threshold = (size_t) 1 << 20;
+
+static void xs_parallel_memcpy(char *dst, const char *src, size_t n);
+struct xs_ext;
+bool xs_expand(xs *x);
+static const xs *xs_flat(const xs *x, xs *tmp);
+static void xs_ext_free(struct xs_ext *e);
+/* The memfd region shared with other processes, see xs_shm_create() */
+static uintptr_t xs_shm_base, xs_shm_end;
+static void xs_shm_release(const xs *x);
+static bool xs_utf8_known(const xs *x);
+static size_t xs_find_parallel(const char *s,
+                               size_t n,
+                               const char *needle,
+                               size_t m);
+
 static inline bool xs_is_ptr(const xs *x)
 {
     return x->is_ptr;
@@ -53,51 +146,70 @@ static inline bool xs_is_large_string(const xs *x)
 }
 static inline size_t xs_size(const xs *x)
 {
-    return xs_is_ptr(x) ? x->size : 15 - x->space_left;
+    return xs_is_ptr(x) ? x->size : XS_INLINE_MAX - x->space_left;
 }
 static inline char *xs_data(const xs *x)
 {
     if (!xs_is_ptr(x))
         return (char *) x->data;
 
-    if (xs_is_large_string(x)) {
-        return (char *) (x->ptr + 4);
-    }
+    if (xs_is_large_string(x))
+        /* a string held in another form has no flat bytes to point at */
+        return x->is_ext ? NULL : (char *) (x->ptr + 4);
     return (char *) x->ptr;
 }
+/* The validity flag only exists for heap strings: the flag bits of a small
+ * string double as the terminator of a full one.
+ */
+static inline void xs_set_utf8(xs *x, bool valid)
+{
+    if (xs_is_ptr(x))
+        x->is_utf8 = valid;
+}
 static inline size_t xs_capacity(const xs *x)
 {
-    return xs_is_ptr(x) ? ((size_t) 1 << x->capacity) - 1 : 15;
+    return xs_is_ptr(x) ? ((size_t) 1 << x->capacity) - 1 : XS_INLINE_MAX;
 }
+/* The top bit of the count marks a buffer just expanded from another form,
+ * see xs_compress_idle()
+ */
+#define XS_REF_RECENT (1 << 30)
+#define XS_REF_MASK (XS_REF_RECENT - 1)
+
 static inline void xs_set_ref_count(const xs *x, int val)
 {
     *((int *) ((size_t) x->ptr)) = val;
 }
+/* The reference count is updated atomically: CoW copies of one buffer may be
+ * handed to different threads, e.g. by the intern table.
+ */
 static inline void xs_inc_ref_count(const xs *x)
 {
     if (xs_is_large_string(x))
-        ++(*(int *) ((size_t) x->ptr));
+        __atomic_add_fetch((int *) ((size_t) x->ptr), 1, __ATOMIC_RELAXED);
 }
 static inline int xs_dec_ref_count(const xs *x)
 {
     if (!xs_is_large_string(x))
         return 0;
-    return --(*(int *) ((size_t) x->ptr));
+    return __atomic_sub_fetch((int *) ((size_t) x->ptr), 1, __ATOMIC_ACQ_REL) &
+           XS_REF_MASK;
 }
 
 static inline int xs_get_ref_count(const xs *x)
 {
     if (!xs_is_large_string(x))
         return 0;
-    return *(int *) ((size_t) x->ptr);
+    return __atomic_load_n((int *) ((size_t) x->ptr), __ATOMIC_ACQUIRE) &
+           XS_REF_MASK;
 }
 
 #define xs_literal_empty() \
-    (xs) { .space_left = 15 }
+    (xs) { .space_left = XS_INLINE_MAX }
 
-static inline int ilog2(uint32_t n)
+static inline int ilog2(size_t n)
 {
-    return 32 - __builtin_clz(n) - 1;
+    return 64 - __builtin_clzll(n) - 1;
 }
 
 static void xs_allocate_data(xs *x, size_t len, bool reallocate)
@@ -115,17 +227,18 @@ static void xs_allocate_data(xs *x, size_t len, bool reallocate)
     x->is_large_string = 1;
 
     /* The extra 4 bytes are used to store the reference count */
-    x->ptr = reallocate ? realloc(x->ptr, (size_t)(1 << x->capacity) + 4)
-                        : malloc((size_t)(1 << x->capacity) + 4);
+    x->ptr = reallocate ? realloc(x->ptr, ((size_t) 1 << x->capacity) + 4)
+                        : malloc(((size_t) 1 << x->capacity) + 4);
 
-    xs_set_ref_count(x, 1);
+    if (x->ptr)
+        xs_set_ref_count(x, 1);
 }
 
 xs *xs_new(xs *x, const void *p)
 {
     *x = xs_literal_empty();
     size_t len = strlen(p) + 1;
-    if (len > 16) {
+    if (len > XS_INLINE_SIZE) {
         x->capacity = ilog2(len) + 1;
         x->size = len - 1;
         x->is_ptr = true;
@@ -133,7 +246,7 @@ xs *xs_new(xs *x, const void *p)
         memcpy(xs_data(x), p, len);
     } else {
         memcpy(x->data, p, len);
-        x->space_left = 15 - (len - 1);
+        x->space_left = XS_INLINE_MAX - (len - 1);
     }
     return x;
 }
@@ -148,70 +261,131 @@ xs *xs_new(xs *x, const void *p)
      }){1}),                                                        \
      xs_new(&xs_literal_empty(), x))
 
+/* A string literal as a constant xs for static storage, initialized at
+ * compile time:
+ *
+ *     static xs greeting = xs_static("hello");
+ *
+ * It borrows the literal's read-only bytes, so copies share them, freeing
+ * one only empties that handle, no reference count is ever touched and any
+ * change goes to a copy first.
+ */
+#define xs_static(s)                                     \
+    {                                                    \
+        .ptr = (char *) ("" s), .size = sizeof(s) - 1,   \
+        .capacity = 64 - __builtin_clzll(sizeof(s)),     \
+        .flags = XS_FLAG_PTR | XS_FLAG_BORROWED,         \
+    }
+
+static inline xs *xs_newempty(xs *x)
+{
+    *x = xs_literal_empty();
+    return x;
+}
+
+/* Whether the buffer of @x lies in the shared region */
+static inline bool xs_in_shm(const xs *x)
+{
+    return (uintptr_t) x->ptr - xs_shm_base < xs_shm_end - xs_shm_base;
+}
+
+/* Borrowed strings own nothing: freeing one only empties it, and the bytes
+ * it points at stay as they are.
+ */
+static inline xs *xs_free(xs *x)
+{
+    if (xs_is_ptr(x) && !x->is_borrowed && xs_dec_ref_count(x) <= 0) {
+        if (x->is_ext)
+            xs_ext_free((struct xs_ext *) x->ptr);
+        else if (xs_in_shm(x))
+            xs_shm_release(x);
+        else
+            free(x->ptr);
+    }
+    return xs_newempty(x);
+}
+
 /* grow up to specified size */
 xs *xs_grow(xs *x, size_t len)
 {
-    char buf[16];
-
+    if (!xs_expand(x))
+        return NULL;
     if (len <= xs_capacity(x))
         return x;
 
-    /* Backup first */
-    if (!xs_is_ptr(x))
-        memcpy(buf, x->data, 16);
+    xs old = *x;
+    bool large = len >= LARGE_STRING_LEN && !disable_cow;
+
+    /* An unshared heap buffer that stays medium or large is resized in
+     * place.  Small strings, buffers shared by CoW copies or in the shared
+     * region and medium strings turning large (they gain the reference count
+     * header) move to a new buffer.
+     */
+    if (xs_is_ptr(x) && !x->is_borrowed && xs_is_large_string(x) == large &&
+        xs_get_ref_count(x) <= 1 && !xs_in_shm(x)) {
+        x->capacity = ilog2(len) + 1;
+        xs_allocate_data(x, len, 1);
+        return x;
+    }
 
+    size_t size = xs_size(&old);
+    *x = (xs){.ptr = NULL};
     x->is_ptr = true;
     x->capacity = ilog2(len) + 1;
+    x->size = size;
+    xs_allocate_data(x, len, 0);
+    xs_parallel_memcpy(xs_data(x), xs_data(&old), size + 1);
 
-    if (xs_is_ptr(x)) {
-        xs_allocate_data(x, len, 1);
-    } else {
-        xs_allocate_data(x, len, 0);
-        memcpy(xs_data(x), buf, 16);
+    if (xs_is_ptr(&old)) {
+        xs_set_utf8(x, old.is_utf8);
+        xs_free(&old);
     }
     return x;
 }
 
-static inline xs *xs_newempty(xs *x)
-{
-    *x = xs_literal_empty();
-    return x;
-}
-
-static inline xs *xs_free(xs *x)
-{
-    if (xs_is_ptr(x) && xs_dec_ref_count(x) <= 0)
-        free(x->ptr);
-    return xs_newempty(x);
-}
-
 static bool xs_cow_lazy_copy(xs *x, char **data)
 {
-    if (xs_get_ref_count(x) <= 1)
+    if (!(xs_is_ptr(x) && x->is_borrowed) && xs_get_ref_count(x) <= 1)
         return false;
 
     /*
      * Lazy copy
      */
-    xs_dec_ref_count(x);
+    xs old = *x;
+    x->is_borrowed = false;
     xs_allocate_data(x, x->size, 0);
 
     if (data) {
-        memcpy(xs_data(x), *data, x->size);
+        xs_parallel_memcpy(xs_data(x), *data, x->size + 1);
 
         /* Update the newly allocated pointer */
         *data = xs_data(x);
     }
+
+    /* Drop the reference only once the copy is done: the last holder may be
+     * mutating the buffer in place as soon as it sees a count of 1.
+     */
+    xs_free(&old);
     return true;
 }
 
 xs *xs_concat(xs *string, const xs *prefix, const xs *suffix)
 {
+    xs tp, ts;
+    const xs *fp = xs_flat(prefix, &tp), *fs = xs_flat(suffix, &ts);
+
+    if (!fp || !fs || !xs_expand(string)) {
+        xs_free(&tp);
+        xs_free(&ts);
+        return NULL;
+    }
+
     size_t pres = xs_size(prefix), sufs = xs_size(suffix),
            size = xs_size(string), capacity = xs_capacity(string);
 
-    char *pre = xs_data(prefix), *suf = xs_data(suffix),
-         *data = xs_data(string);
+    char *pre = xs_data(fp), *suf = xs_data(fs), *data = xs_data(string);
+    bool utf8 = xs_utf8_known(string) && xs_utf8_known(prefix) &&
+                xs_utf8_known(suffix);
 
     xs_cow_lazy_copy(string, &data);
 
@@ -223,25 +397,59 @@ xs *xs_concat(xs *string, const xs *prefix, const xs *suffix)
         if (xs_is_ptr(string))
             string->size = size + pres + sufs;
         else
-            string->space_left = 15 - (size + pres + sufs);
+            string->space_left = XS_INLINE_MAX - (size + pres + sufs);
     } else {
         xs tmps = xs_literal_empty();
         xs_grow(&tmps, size + pres + sufs);
         char *tmpdata = xs_data(&tmps);
-        memcpy(tmpdata + pres, data, size);
+        xs_parallel_memcpy(tmpdata + pres, data, size);
         memcpy(tmpdata, pre, pres);
         memcpy(tmpdata + pres + size, suf, sufs + 1);
         xs_free(string);
         *string = tmps;
         string->size = size + pres + sufs;
     }
+    xs_set_utf8(string, utf8);
+    xs_free(&tp);
+    xs_free(&ts);
     return string;
 }
 
+/* Set the size of @x and terminate it */
+static inline void xs_set_size(xs *x, size_t size)
+{
+    if (xs_is_ptr(x))
+        x->size = size;
+    else
+        x->space_left = XS_INLINE_MAX - size;
+    xs_data(x)[size] = 0;
+}
+
+/* Room for @n more bytes at the end of @x, in a buffer of its own, or NULL
+ * if @x cannot be expanded.  The size is left alone: the caller writes and
+ * then calls xs_set_size().
+ */
+static char *xs_append_space(xs *x, size_t n)
+{
+    if (!xs_expand(x))
+        return NULL;
+
+    size_t size = xs_size(x);
+    char *data = xs_data(x);
+
+    if (size + n > xs_capacity(x))
+        xs_grow(x, size + n);
+    else
+        xs_cow_lazy_copy(x, &data);
+    return xs_data(x) + size;
+}
+
 xs *xs_trim(xs *x, const char *trimset)
 {
     if (!trimset[0])
         return x;
+    if (!xs_expand(x))
+        return NULL;
 
     char *dataptr = xs_data(x), *orig = dataptr;
 
@@ -255,13 +463,19 @@ xs *xs_trim(xs *x, const char *trimset)
 #define set_bit(byte) (mask[(uint8_t) byte / 8] |= 1 << (uint8_t) byte % 8)
 
     size_t i, slen = xs_size(x), trimlen = strlen(trimset);
+    bool ascii = true;
 
-    for (i = 0; i < trimlen; i++)
+    for (i = 0; i < trimlen; i++) {
         set_bit(trimset[i]);
+        ascii &= !(trimset[i] & 0x80);
+    }
+    /* ASCII bytes are never part of a multibyte sequence */
+    if (!ascii)
+        xs_set_utf8(x, false);
     for (i = 0; i < slen; i++)
         if (!check_bit(dataptr[i]))
             break;
-    for (; slen > 0; slen--)
+    for (; slen > i; slen--)
         if (!check_bit(dataptr[slen - 1]))
             break;
     dataptr += i;
@@ -269,7 +483,7 @@ xs *xs_trim(xs *x, const char *trimset)
 
     /* reserved space as a buffer on the heap.
      * Do not reallocate immediately. Instead, reuse it as possible.
-     * Do not shrink to in place if < 16 bytes.
+     * Do not shrink to in place if it would fit inline.
      */
     memmove(orig, dataptr, slen);
     /* do not dirty memory unless it is needed */
@@ -279,7 +493,7 @@ xs *xs_trim(xs *x, const char *trimset)
     if (xs_is_ptr(x))
         x->size = slen;
     else
-        x->space_left = 15 - slen;
+        x->space_left = XS_INLINE_MAX - slen;
     return x;
 #undef check_bit
 #undef set_bit
@@ -293,7 +507,7 @@ void xs_copy(xs *dest, xs *src)
      * src string from stack: No need to invoke memcpy() since the data
      * has been copied from the statement '*dest = *src'
      */
-    if (!xs_is_ptr(src))
+    if (!xs_is_ptr(src) || src->is_borrowed)
         return;
 
     if (xs_is_large_string(src)) {
@@ -302,156 +516,8132 @@ void xs_copy(xs *dest, xs *src)
     } else {
         /* Medium string */
         dest->ptr = malloc((size_t) 1 << src->capacity);
-        memcpy(dest->ptr, src->ptr, src->size);
+        memcpy(dest->ptr, src->ptr, src->size + 1);
     }
 }
 
-#define NR_TESTS 10000
-#define TEST_MAX_STRING (4 * 1024 * 1024 - 1)
+/* Build @n strings at once from the @lens[i] bytes at @ptrs[i], with no
+ * strlen().  Short strings stay inline and large ones get their own
+ * reference-counted buffer as usual, while all medium strings are packed into
+ * a single allocation they borrow: they are copied before any change and
+ * xs_free() leaves the slab alone.  Returns that slab, to be passed to
+ * free() once none of the strings refers to it any more, or NULL if there is
+ * none.  If it cannot be allocated, every string is left empty and NULL is
+ * returned with errno set to ENOMEM.
+ */
+void *xs_new_batch(xs *out,
+                   const char *const *ptrs,
+                   const size_t *lens,
+                   size_t n)
+{
+    size_t i, total = 0;
 
-#define CONCAT_STRING_IDX_START 0
-#define CONCAT_STRING_IDX_END 99
-#define CONCAT_STRING_TIMES \
-    (CONCAT_STRING_IDX_END - CONCAT_STRING_IDX_START + 1)
+    for (i = 0; i < n; i++) {
+        if (lens[i] > XS_INLINE_MAX &&
+            (lens[i] < LARGE_STRING_LEN || disable_cow))
+            total += lens[i] + 1;
+    }
 
-#define TRIM_STRING_IDX_START 100
-#define TRIM_STRING_IDX_END 199
-#define TRIM_STRING_TIMES (TRIM_STRING_IDX_END - TRIM_STRING_IDX_START + 1)
+    char *slab = total ? malloc(total) : NULL, *p = slab;
 
-enum {
-    SMALL_STRING,
-    MEDIUM_STRING,
-    LARGE_STRING,
+    if (total && !slab) {
+        for (i = 0; i < n; i++)
+            out[i] = xs_literal_empty();
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        xs *x = &out[i];
+        size_t len = lens[i];
 
-    NR_STRING_TYPE
-};
+        *x = xs_literal_empty();
+        if (len <= XS_INLINE_MAX) {
+            memcpy(x->data, ptrs[i], len);
+            x->data[len] = 0;
+            x->space_left = XS_INLINE_MAX - len;
+            continue;
+        }
 
-static const char charset[] = "abcdefghijklmnopqrstuvwxyz0123456789";
-static const char str_type_desc[NR_STRING_TYPE][8] = {"Small", "Medium",
-                                                      "Large"};
-static char random_string[NR_STRING_TYPE][TEST_MAX_STRING];
-static xs backup_string[NR_TESTS];
+        x->is_ptr = true;
+        x->capacity = ilog2(len) + 1;
+        x->size = len;
+        if (len >= LARGE_STRING_LEN && !disable_cow) {
+            xs_allocate_data(x, len, 0);
+        } else {
+            x->ptr = p;
+            x->is_borrowed = true;
+            p += len + 1;
+        }
+        memcpy(xs_data(x), ptrs[i], len);
+        xs_data(x)[len] = 0;
+    }
+    return slab;
+}
 
-static void init_random_string(uint8_t *buf, uint32_t type)
+static inline bool xs_cpu_has_avx2(void)
 {
-    size_t length_array[] = {15, 255, TEST_MAX_STRING};
-    size_t len = length_array[type];
-    size_t n;
-
-    /* Bookmark for trimming string. */
-    buf[0] = '@';
-    for (n = 1; n < len - 1; n++)
-        buf[n] = charset[rand() % (sizeof charset - 1)];
+#if defined(__x86_64__) || defined(__i386__)
+    static int has_avx2 = -1;
+    if (has_avx2 < 0)
+        has_avx2 = __builtin_cpu_supports("avx2");
+    return has_avx2;
+#else
+    return false;
+#endif
+}
 
-    /* Bookmark for trimming string. */
-    buf[n] = '#';
-    buf[n + 1] = 0;
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint32_t xs_ne_mask32(const char *a, const char *b)
+    __attribute__((target("avx2")));
+static inline uint32_t xs_ne_mask32(const char *a, const char *b)
+{
+    __m256i va = _mm256_loadu_si256((const __m256i *) a);
+    __m256i vb = _mm256_loadu_si256((const __m256i *) b);
+    return ~(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
 }
 
-static void run_concat_test(xs *orig_string, xs *backup_string)
+/* n >= 32: the last block overlaps the previous one instead of falling back
+ * to a byte loop.
+ */
+__attribute__((target("avx2"))) static size_t xs_mismatch_avx2(const char *a,
+                                                               const char *b,
+                                                               size_t n)
 {
-    int j;
+    size_t i = 0;
+    uint32_t ne;
 
-    xs prefix = *xs_tmp("((("), suffix = *xs_tmp(")))");
+    for (; i + 32 <= n; i += 32) {
+        if ((ne = xs_ne_mask32(a + i, b + i)))
+            return i + __builtin_ctz(ne);
+    }
+    if (i < n && (ne = xs_ne_mask32(a + n - 32, b + n - 32)))
+        return n - 32 + __builtin_ctz(ne);
+    return n;
+}
+#endif
 
-    printf("concatenate copied string for %d sets, ", CONCAT_STRING_TIMES);
-    for (j = CONCAT_STRING_IDX_START; j <= CONCAT_STRING_IDX_END; j++)
-        xs_concat(backup_string + j, &prefix, &suffix);
+#ifdef __SSE2__
+static inline uint32_t xs_ne_mask16(const char *a, const char *b)
+{
+    __m128i va = _mm_loadu_si128((const __m128i *) a);
+    __m128i vb = _mm_loadu_si128((const __m128i *) b);
+    return ~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xffff;
+}
+#endif
 
-    for (j = CONCAT_STRING_IDX_START; j <= CONCAT_STRING_IDX_END; j++) {
-        if (xs_is_large_string(backup_string + j) &&
-            xs_get_ref_count(backup_string + j) != 1) {
-            printf("[Error]: backup_string[%d] ref. count != 1\n", j);
+/* index of the first byte where @a and @b differ, or @n if they do not */
+static size_t xs_mismatch(const char *a, const char *b, size_t n)
+{
+    size_t i = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (n >= 32 && xs_cpu_has_avx2())
+        return xs_mismatch_avx2(a, b, n);
+#endif
+#ifdef __SSE2__
+    if (n >= 16) {
+        uint32_t ne;
+        for (; i + 16 <= n; i += 16) {
+            if ((ne = xs_ne_mask16(a + i, b + i)))
+                return i + __builtin_ctz(ne);
         }
+        if (i < n && (ne = xs_ne_mask16(a + n - 16, b + n - 16)))
+            return n - 16 + __builtin_ctz(ne);
+        return n;
     }
-    printf("ref. count: %d\n", xs_get_ref_count(orig_string));
+#endif
+    for (; i + 8 <= n; i += 8) {
+        uint64_t wa, wb;
+        memcpy(&wa, a + i, 8);
+        memcpy(&wb, b + i, 8);
+        if (wa != wb)
+            return i + __builtin_ctzll(wa ^ wb) / 8;
+    }
+    for (; i < n; i++)
+        if (a[i] != b[i])
+            break;
+    return i;
 }
 
-static void run_trim_test(xs *orig_string, xs *backup_string)
+/* Load the inline bytes of a small string as little-endian words with
+ * everything past its first @n bytes cleared.  xs_trim() leaves stale bytes
+ * behind the terminator, so the tail must not take part in comparisons.
+ */
+static inline void xs_small_words(const xs *x,
+                                  size_t n,
+                                  uint64_t w[XS_INLINE_WORDS])
 {
-    int j;
+    memcpy(w, x->data, XS_INLINE_SIZE);
+    for (int i = 0; i < XS_INLINE_WORDS; i++, n = n > 8 ? n - 8 : 0)
+        w[i] &= n >= 8 ? ~0ULL : (1ULL << (n * 8)) - 1;
+}
 
-    printf("trim copied string for another %d sets, ", TRIM_STRING_TIMES);
-    for (j = TRIM_STRING_IDX_START; j <= TRIM_STRING_IDX_END; j++)
-        xs_trim(backup_string + j, "@#");
+/* Length-aware equality: works on binary data with embedded NULs.  Strings
+ * held in another form that cannot be expanded compare unequal.
+ */
+bool xs_equal(const xs *a, const xs *b)
+{
+    size_t size = xs_size(a);
 
-    for (j = TRIM_STRING_IDX_START; j <= TRIM_STRING_IDX_END; j++) {
-        if (xs_is_large_string(backup_string + j) &&
-            xs_get_ref_count(backup_string + j) != 1) {
-            printf("[Error]: backup_string[%d] ref. count != 1\n", j);
+    if (size != xs_size(b))
+        return false;
+
+    if (!xs_is_ptr(a) && !xs_is_ptr(b)) {
+        uint64_t wa[XS_INLINE_WORDS], wb[XS_INLINE_WORDS], diff = 0;
+        xs_small_words(a, size, wa);
+        xs_small_words(b, size, wb);
+        for (int i = 0; i < XS_INLINE_WORDS; i++)
+            diff |= wa[i] ^ wb[i];
+        return !diff;
+    }
+
+    /* CoW copies of the same buffer */
+    if (xs_is_ptr(a) && xs_is_ptr(b) && a->ptr == b->ptr)
+        return true;
+
+    xs ta, tb;
+    const xs *fa = xs_flat(a, &ta), *fb = xs_flat(b, &tb);
+    bool equal =
+        fa && fb && xs_mismatch(xs_data(fa), xs_data(fb), size) == size;
+    xs_free(&ta);
+    xs_free(&tb);
+    return equal;
+}
+
+/* Lexicographic order of the unsigned bytes, shorter prefix first.
+ * Returns <0, 0 or >0 like memcmp(); strings held in another form that
+ * cannot be expanded are ordered by size only.
+ */
+int xs_cmp(const xs *a, const xs *b)
+{
+    size_t sa = xs_size(a), sb = xs_size(b), n = sa < sb ? sa : sb;
+
+    if (!xs_is_ptr(a) && !xs_is_ptr(b)) {
+        uint64_t wa[XS_INLINE_WORDS], wb[XS_INLINE_WORDS];
+        xs_small_words(a, n, wa);
+        xs_small_words(b, n, wb);
+        /* byte-swapped words compare in memory order */
+        for (int i = 0; i < XS_INLINE_WORDS; i++) {
+            if (wa[i] != wb[i])
+                return __builtin_bswap64(wa[i]) < __builtin_bswap64(wb[i])
+                           ? -1
+                           : 1;
         }
+    } else if (!(xs_is_ptr(a) && xs_is_ptr(b) && a->ptr == b->ptr)) {
+        xs ta, tb;
+        const xs *fa = xs_flat(a, &ta), *fb = xs_flat(b, &tb);
+        int r = 0;
+        if (fa && fb) {
+            const uint8_t *da = (const uint8_t *) xs_data(fa),
+                          *db = (const uint8_t *) xs_data(fb);
+            size_t i = xs_mismatch((const char *) da, (const char *) db, n);
+            if (i < n)
+                r = da[i] < db[i] ? -1 : 1;
+        }
+        xs_free(&ta);
+        xs_free(&tb);
+        if (r)
+            return r;
     }
-    printf("ref. count: %d\n", xs_get_ref_count(orig_string));
+    return sa < sb ? -1 : sa > sb;
 }
 
-static void run_string_strategy_test(void)
+/*
+ * xs_sort: multikey quicksort (Bentley & Sedgewick) on 8-byte chunks.
+ *
+ * Every item caches the next 8 bytes of its string as a big-endian word, so
+ * partitioning compares integers and never dereferences xs_data().  The key
+ * is refreshed only when a run of equal words descends to the next depth.
+ * Items carry the xs by value, hence the bytes of small strings are read
+ * from the item itself with no pointer chasing at all.
+ */
+struct xs_sort_item {
+    uint64_t word;
+    /* how many bytes of the string are in word, at most 8 */
+    uint8_t len;
+    xs str;
+};
+
+#define XS_SORT_INSERTION 16
+
+static inline void xs_sort_key(struct xs_sort_item *it, size_t depth)
 {
-    xs string;
-    int i, j;
+    size_t size = xs_size(&it->str), len = size - depth;
+    uint64_t w = 0;
 
-    srand((unsigned int) (time(NULL)));
+    if (len > 8)
+        len = 8;
+    memcpy(&w, xs_data(&it->str) + depth, len);
+    it->word = __builtin_bswap64(w);
+    it->len = len;
+}
 
-    for (i = SMALL_STRING; i < NR_STRING_TYPE; i++) {
-        init_random_string(random_string[i], i);
+static inline int xs_sort_key_cmp(const struct xs_sort_item *a,
+                                  const struct xs_sort_item *b)
+{
+    if (a->word != b->word)
+        return a->word < b->word ? -1 : 1;
+    return (a->len > b->len) - (a->len < b->len);
+}
 
-        string = *xs_tmp(random_string[i]);
+/* xs_cmp() for strings known to share their first @depth bytes */
+static int xs_cmp_from(const xs *a, const xs *b, size_t depth)
+{
+    size_t sa = xs_size(a), sb = xs_size(b), n = (sa < sb ? sa : sb) - depth;
+    const uint8_t *da = (const uint8_t *) xs_data(a) + depth,
+                  *db = (const uint8_t *) xs_data(b) + depth;
+    size_t i = xs_mismatch((const char *) da, (const char *) db, n);
 
-        printf("-------------- %s string --------------\n", str_type_desc[i]);
-        printf("copy string %d times, ", NR_TESTS);
+    if (i < n)
+        return da[i] < db[i] ? -1 : 1;
+    return sa < sb ? -1 : sa > sb;
+}
 
-        for (j = 0; j < NR_TESTS; j++)
-            xs_copy(&backup_string[j], &string);
-        printf("ref. count: %d\n", xs_get_ref_count(&string));
+static inline void xs_sort_swap(struct xs_sort_item *a, struct xs_sort_item *b)
+{
+    struct xs_sort_item t = *a;
+    *a = *b;
+    *b = t;
+}
 
-        run_concat_test(&string, backup_string);
-        run_trim_test(&string, backup_string);
-        printf("------------------------------------------\n\n");
+/* Sort @n items whose first @depth bytes are equal and whose keys are set */
+static void xs_mkqs(struct xs_sort_item *items, size_t n, size_t depth)
+{
+    while (n > XS_SORT_INSERTION) {
+        struct xs_sort_item *a = &items[0], *b = &items[n / 2],
+                            *c = &items[n - 1], *m;
 
-        xs_free(&string);
-        for (j = 0; j < NR_TESTS; j++)
-            xs_free(&backup_string[j]);
+        /* median of three */
+        if (xs_sort_key_cmp(a, b) < 0)
+            m = xs_sort_key_cmp(b, c) < 0 ? b
+                                           : xs_sort_key_cmp(a, c) < 0 ? c : a;
+        else
+            m = xs_sort_key_cmp(a, c) < 0 ? a
+                                           : xs_sort_key_cmp(b, c) < 0 ? c : b;
+        xs_sort_swap(&items[0], m);
+
+        /* Dijkstra 3-way partition: [0, lt) < pivot == [lt, i) < [gt, n) */
+        size_t lt = 0, i = 1, gt = n;
+        while (i < gt) {
+            int r = xs_sort_key_cmp(&items[i], &items[lt]);
+            if (r < 0)
+                xs_sort_swap(&items[lt++], &items[i++]);
+            else if (r > 0)
+                xs_sort_swap(&items[i], &items[--gt]);
+            else
+                i++;
+        }
+
+        xs_mkqs(items, lt, depth);
+
+        /* a full word in common: the equal run continues 8 bytes deeper */
+        if (items[lt].len == 8 && gt - lt > 1) {
+            for (i = lt; i < gt; i++)
+                xs_sort_key(&items[i], depth + 8);
+            xs_mkqs(items + lt, gt - lt, depth + 8);
+        }
+
+        items += gt;
+        n -= gt;
+    }
+
+    for (size_t i = 1; i < n; i++) {
+        struct xs_sort_item t = items[i];
+        size_t j = i;
+        for (; j > 0 && xs_cmp_from(&items[j - 1].str, &t.str, depth) > 0;
+             j--)
+            items[j] = items[j - 1];
+        items[j] = t;
     }
 }
 
-static void func_test(void)
+/* Sort @arr in xs_cmp() order; returns false, leaving @arr in its order, if
+ * it is out of memory.  Strings held in another form are expanded.
+ */
+bool xs_sort(xs *arr, size_t n)
 {
-    xs string = *xs_tmp("\n foobarbar \n\n\n");
-    xs_trim(&string, "\n ");
-    printf("[%s] : %2zu\n", xs_data(&string), xs_size(&string));
+    struct xs_sort_item *items;
 
-    xs prefix = *xs_tmp("((("), suffix = *xs_tmp(")))");
-    xs_concat(&string, &prefix, &suffix);
-    printf("[%s] : %2zu\n", xs_data(&string), xs_size(&string));
+    /* the keys are read in place */
+    for (size_t i = 0; i < n; i++)
+        if (!xs_expand(&arr[i]))
+            return false;
+    items = malloc(n * sizeof(*items));
+    if (!items && n)
+        return false;
+    /* the strings are moved, not copied: no reference count traffic */
+    for (size_t i = 0; i < n; i++) {
+        items[i].str = arr[i];
+        xs_sort_key(&items[i], 0);
+    }
+    xs_mkqs(items, n, 0);
+    for (size_t i = 0; i < n; i++)
+        arr[i] = items[i].str;
+    free(items);
+    return true;
 }
 
-static void usage(char *cmd)
+#define XS_NPOS ((size_t) -1)
+
+/* Substring search filtering candidates on the first and the last byte of
+ * the needle, a block at a time, see "SIMD-friendly algorithms for substring
+ * searching" by Wojciech Mula: http://0x80.pl/articles/simd-strfind.html
+ */
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) static size_t
+xs_find_avx2(const char *s, size_t last, const char *needle, size_t m)
 {
-    printf("Usage: %s [-h] [-d] \n", cmd);
-    printf("\t-h         Print this information\n");
-    printf("\t-d         Disable CoW\n");
-    exit(0);
+    const __m256i first = _mm256_set1_epi8(needle[0]),
+                  tail = _mm256_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+
+    for (; i + 32 <= last + 1; i += 32) {
+        __m256i bf = _mm256_loadu_si256((const __m256i *) (s + i));
+        __m256i bl = _mm256_loadu_si256((const __m256i *) (s + i + m - 1));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(first, bf), _mm256_cmpeq_epi8(tail, bl)));
+
+        for (; mask; mask &= mask - 1) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (!memcmp(s + pos + 1, needle + 1, m - 2))
+                return pos;
+        }
+    }
+    for (; i <= last; i++) {
+        if (s[i] == needle[0] && s[i + m - 1] == needle[m - 1] &&
+            !memcmp(s + i + 1, needle + 1, m - 2))
+            return i;
+    }
+    return XS_NPOS;
 }
+#endif
 
-int main(int argc, char *argv[])
+static size_t xs_find_bytes(const char *s, size_t n, const char *needle,
+                            size_t m)
 {
-    int c;
+    if (!m)
+        return 0;
+    if (m > n)
+        return XS_NPOS;
+    if (m == 1) {
+        const char *p = memchr(s, needle[0], n);
+        return p ? (size_t) (p - s) : XS_NPOS;
+    }
 
-    while ((c = getopt(argc, argv, "hd")) != -1) {
-        switch (c) {
-        case 'h':
-            usage(argv[0]);
-            break;
-        case 'd':
-            disable_cow = 1;
-            break;
-        default:
-            printf("Unknown option '%c'\n", c);
-            usage(argv[0]);
-            break;
+    /* candidate positions are [0, last] */
+    size_t i = 0, last = n - m;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (last >= 64 && xs_cpu_has_avx2())
+        return xs_find_avx2(s, last, needle, m);
+#endif
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]),
+                  tail = _mm_set1_epi8(needle[m - 1]);
+
+    for (; i + 16 <= last + 1; i += 16) {
+        __m128i bf = _mm_loadu_si128((const __m128i *) (s + i));
+        __m128i bl = _mm_loadu_si128((const __m128i *) (s + i + m - 1));
+        uint32_t mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(first, bf), _mm_cmpeq_epi8(tail, bl)));
+
+        for (; mask; mask &= mask - 1) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (!memcmp(s + pos + 1, needle + 1, m - 2))
+                return pos;
         }
     }
+#endif
+    for (; i <= last; i++) {
+        if (s[i] == needle[0] && s[i + m - 1] == needle[m - 1] &&
+            !memcmp(s + i + 1, needle + 1, m - 2))
+            return i;
+    }
+    return XS_NPOS;
+}
 
-    func_test();
-    run_string_strategy_test();
-    return 0;
+/* Offset of the first @needle in @x at or after @from, XS_NPOS if none or
+ * out of memory
+ */
+size_t xs_find(const xs *x, const xs *needle, size_t from)
+{
+    size_t size = xs_size(x), pos = XS_NPOS;
+
+    if (from > size)
+        return XS_NPOS;
+
+    xs tx, tn;
+    const xs *fx = xs_flat(x, &tx), *fn = xs_flat(needle, &tn);
+    if (fx && fn)
+        pos = (size - from >= xs_parallel_threshold ? xs_find_parallel
+                                                     : xs_find_bytes)(
+            xs_data(fx) + from, size - from, xs_data(fn), xs_size(fn));
+    xs_free(&tx);
+    xs_free(&tn);
+    return pos == XS_NPOS ? XS_NPOS : pos + from;
+}
+
+/*
+ * ASCII case kernels.  A byte c is in the 26 letters starting at @from ('A'
+ * or 'a') when (uint8_t) (c - from) < 26; flipping bit 0x20 converts it.
+ * The vector forms bias the difference by 128 to use a signed comparison.
+ */
+#define XS_CASE_LIMIT (-128 + 26)
+
+/* ASCII lower case of @c */
+static inline uint8_t xs_fold(char c)
+{
+    return c | ((uint8_t) (c - 'A') < 26) << 5;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline __m256i xs_case_mask32(__m256i v, char from)
+    __attribute__((target("avx2")));
+static inline __m256i xs_case_mask32(__m256i v, char from)
+{
+    __m256i t = _mm256_add_epi8(v, _mm256_set1_epi8((char) (128 - from)));
+    return _mm256_cmpgt_epi8(_mm256_set1_epi8(XS_CASE_LIMIT), t);
+}
+
+static inline __m256i xs_fold32(__m256i v) __attribute__((target("avx2")));
+static inline __m256i xs_fold32(__m256i v)
+{
+    return _mm256_or_si256(
+        v, _mm256_and_si256(xs_case_mask32(v, 'A'), _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2"))) static size_t xs_case_scan_avx2(const char *s,
+                                                                size_t n,
+                                                                char from)
+{
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+        uint32_t mask = _mm256_movemask_epi8(xs_case_mask32(v, from));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    for (; i < n; i++)
+        if ((uint8_t) (s[i] - from) < 26)
+            break;
+    return i;
+}
+
+__attribute__((target("avx2"))) static void xs_case_flip_avx2(char *s,
+                                                              size_t n,
+                                                              char from)
+{
+    const __m256i bit = _mm256_set1_epi8(0x20);
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+        v = _mm256_xor_si256(v, _mm256_and_si256(xs_case_mask32(v, from), bit));
+        _mm256_storeu_si256((__m256i *) (s + i), v);
+    }
+    for (; i < n; i++)
+        if ((uint8_t) (s[i] - from) < 26)
+            s[i] ^= 0x20;
+}
+
+__attribute__((target("avx2"))) static size_t
+xs_casemismatch_avx2(const char *a, const char *b, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i va = xs_fold32(_mm256_loadu_si256((const __m256i *) (a + i)));
+        __m256i vb = xs_fold32(_mm256_loadu_si256((const __m256i *) (b + i)));
+        uint32_t ne = ~(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+        if (ne)
+            return i + __builtin_ctz(ne);
+    }
+    for (; i < n; i++)
+        if (xs_fold(a[i]) != xs_fold(b[i]))
+            break;
+    return i;
+}
+
+/* xs_find_avx2() on case-folded blocks */
+__attribute__((target("avx2"))) static size_t
+xs_casefind_avx2(const char *s, size_t last, const char *needle, size_t m)
+{
+    const uint8_t first = xs_fold(needle[0]), tail = xs_fold(needle[m - 1]);
+    const __m256i vf = _mm256_set1_epi8(first), vl = _mm256_set1_epi8(tail);
+    size_t i = 0;
+
+#define xs_casefind_verify(pos) \
+    (m <= 2 ||                  \
+     xs_casemismatch_avx2(s + (pos) + 1, needle + 1, m - 2) == m - 2)
+
+    for (; i + 32 <= last + 1; i += 32) {
+        __m256i bf = xs_fold32(_mm256_loadu_si256((const __m256i *) (s + i)));
+        __m256i bl = xs_fold32(
+            _mm256_loadu_si256((const __m256i *) (s + i + m - 1)));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(vf, bf), _mm256_cmpeq_epi8(vl, bl)));
+
+        for (; mask; mask &= mask - 1) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (xs_casefind_verify(pos))
+                return pos;
+        }
+    }
+    for (; i <= last; i++) {
+        if (xs_fold(s[i]) == first && xs_fold(s[i + m - 1]) == tail &&
+            xs_casefind_verify(i))
+            return i;
+    }
+    return XS_NPOS;
+#undef xs_casefind_verify
+}
+#endif
+
+#ifdef __SSE2__
+static inline __m128i xs_case_mask16(__m128i v, char from)
+{
+    __m128i t = _mm_add_epi8(v, _mm_set1_epi8((char) (128 - from)));
+    return _mm_cmplt_epi8(t, _mm_set1_epi8(XS_CASE_LIMIT));
+}
+
+static inline __m128i xs_fold16(__m128i v)
+{
+    return _mm_or_si128(
+        v, _mm_and_si128(xs_case_mask16(v, 'A'), _mm_set1_epi8(0x20)));
+}
+#endif
+
+/* index of the first byte that is a letter of the case of @from, or @n */
+static size_t xs_case_scan(const char *s, size_t n, char from)
+{
+    size_t i = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (n >= 32 && xs_cpu_has_avx2())
+        return xs_case_scan_avx2(s, n, from);
+#endif
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+        uint32_t mask = _mm_movemask_epi8(xs_case_mask16(v, from));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i < n; i++)
+        if ((uint8_t) (s[i] - from) < 26)
+            break;
+    return i;
+}
+
+/* convert the letters of the case of @from to the other case */
+static void xs_case_flip(char *s, size_t n, char from)
+{
+    size_t i = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (n >= 32 && xs_cpu_has_avx2()) {
+        xs_case_flip_avx2(s, n, from);
+        return;
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i bit = _mm_set1_epi8(0x20);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+        v = _mm_xor_si128(v, _mm_and_si128(xs_case_mask16(v, from), bit));
+        _mm_storeu_si128((__m128i *) (s + i), v);
+    }
+#endif
+    for (; i < n; i++)
+        if ((uint8_t) (s[i] - from) < 26)
+            s[i] ^= 0x20;
+}
+
+/* xs_mismatch() ignoring ASCII case */
+static size_t xs_casemismatch(const char *a, const char *b, size_t n)
+{
+    size_t i = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (n >= 32 && xs_cpu_has_avx2())
+        return xs_casemismatch_avx2(a, b, n);
+#endif
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = xs_fold16(_mm_loadu_si128((const __m128i *) (a + i)));
+        __m128i vb = xs_fold16(_mm_loadu_si128((const __m128i *) (b + i)));
+        uint32_t ne = ~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xffff;
+        if (ne)
+            return i + __builtin_ctz(ne);
+    }
+#endif
+    for (; i < n; i++)
+        if (xs_fold(a[i]) != xs_fold(b[i]))
+            break;
+    return i;
+}
+
+/* xs_cmp() ignoring ASCII case: letters compare as lower case */
+int xs_casecmp(const xs *a, const xs *b)
+{
+    size_t sa = xs_size(a), sb = xs_size(b), n = sa < sb ? sa : sb;
+
+    if (!(xs_is_ptr(a) && xs_is_ptr(b) && a->ptr == b->ptr)) {
+        xs ta, tb;
+        const xs *fa = xs_flat(a, &ta), *fb = xs_flat(b, &tb);
+        int r = 0;
+        if (fa && fb) {
+            const char *da = xs_data(fa), *db = xs_data(fb);
+            size_t i = xs_casemismatch(da, db, n);
+            if (i < n)
+                r = xs_fold(da[i]) < xs_fold(db[i]) ? -1 : 1;
+        }
+        xs_free(&ta);
+        xs_free(&tb);
+        if (r)
+            return r;
+    }
+    return sa < sb ? -1 : sa > sb;
+}
+
+/* xs_find_bytes() ignoring ASCII case */
+static size_t xs_casefind_bytes(const char *s,
+                                size_t n,
+                                const char *needle,
+                                size_t m)
+{
+    if (!m)
+        return 0;
+    if (m > n)
+        return XS_NPOS;
+
+    size_t i = 0, last = n - m;
+    uint8_t first = xs_fold(needle[0]), tail = xs_fold(needle[m - 1]);
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (last >= 64 && xs_cpu_has_avx2())
+        return xs_casefind_avx2(s, last, needle, m);
+#endif
+
+#define xs_casefind_verify(pos) \
+    (m <= 2 || xs_casemismatch(s + (pos) + 1, needle + 1, m - 2) == m - 2)
+
+#ifdef __SSE2__
+    const __m128i vf = _mm_set1_epi8(first), vl = _mm_set1_epi8(tail);
+
+    for (; i + 16 <= last + 1; i += 16) {
+        __m128i bf = xs_fold16(_mm_loadu_si128((const __m128i *) (s + i)));
+        __m128i bl =
+            xs_fold16(_mm_loadu_si128((const __m128i *) (s + i + m - 1)));
+        uint32_t mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(vf, bf), _mm_cmpeq_epi8(vl, bl)));
+
+        for (; mask; mask &= mask - 1) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (xs_casefind_verify(pos))
+                return pos;
+        }
+    }
+#endif
+    for (; i <= last; i++) {
+        if (xs_fold(s[i]) == first && xs_fold(s[i + m - 1]) == tail &&
+            xs_casefind_verify(i))
+            return i;
+    }
+    return XS_NPOS;
+#undef xs_casefind_verify
+}
+
+/* xs_find() ignoring ASCII case */
+size_t xs_casefind(const xs *x, const xs *needle, size_t from)
+{
+    size_t size = xs_size(x), pos = XS_NPOS;
+
+    if (from > size)
+        return XS_NPOS;
+
+    xs tx, tn;
+    const xs *fx = xs_flat(x, &tx), *fn = xs_flat(needle, &tn);
+    if (fx && fn)
+        pos = xs_casefind_bytes(xs_data(fx) + from, size - from, xs_data(fn),
+                                xs_size(fn));
+    xs_free(&tx);
+    xs_free(&tn);
+    return pos == XS_NPOS ? XS_NPOS : pos + from;
+}
+
+/*
+ * UTF-8 validation with the lookup algorithm of simdjson: "Validating UTF-8
+ * In Less Than One Instruction Per Byte" by John Keiser and Daniel Lemire,
+ * https://arxiv.org/abs/2010.03090
+ *
+ * Three 16-entry tables indexed by the high and low nibbles of the previous
+ * byte and the high nibble of the current one flag every invalid 2-byte
+ * pattern; the lengths of 3- and 4-byte sequences are checked separately.
+ */
+#define XS_UTF8_TOO_SHORT (1 << 0)
+#define XS_UTF8_TOO_LONG (1 << 1)
+#define XS_UTF8_OVERLONG_3 (1 << 2)
+#define XS_UTF8_TOO_LARGE (1 << 3)
+#define XS_UTF8_SURROGATE (1 << 4)
+#define XS_UTF8_OVERLONG_2 (1 << 5)
+#define XS_UTF8_TOO_LARGE_1000 (1 << 6)
+#define XS_UTF8_OVERLONG_4 (1 << 6)
+#define XS_UTF8_TWO_CONTS (1 << 7)
+#define XS_UTF8_CARRY \
+    (XS_UTF8_TOO_SHORT | XS_UTF8_TOO_LONG | XS_UTF8_TWO_CONTS)
+
+/* scalar check of Table 3-7 of the Unicode Standard */
+static bool xs_utf8_validate_scalar(const uint8_t *s, size_t n)
+{
+    size_t i = 0;
+
+    while (i < n) {
+        uint8_t c = s[i];
+        size_t len;
+        uint8_t lo = 0x80, hi = 0xbf;
+
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+        if (c >= 0xc2 && c <= 0xdf) {
+            len = 2;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            len = 3;
+            if (c == 0xe0)
+                lo = 0xa0;
+            else if (c == 0xed)
+                hi = 0x9f;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            len = 4;
+            if (c == 0xf0)
+                lo = 0x90;
+            else if (c == 0xf4)
+                hi = 0x8f;
+        } else {
+            return false;
+        }
+
+        if (n - i < len || s[i + 1] < lo || s[i + 1] > hi)
+            return false;
+        for (size_t k = 2; k < len; k++)
+            if ((s[i + k] & 0xc0) != 0x80)
+                return false;
+        i += len;
+    }
+    return true;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define XS_UTF8_TABLE(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+
+/* the 32 bytes ending @n bytes before @input, taken from @prev and @input */
+#define xs_utf8_prev(input, prev, n) \
+    _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prev, input, 0x21), 16 - (n))
+
+__attribute__((target("avx2"))) static bool xs_utf8_validate_avx2(
+    const uint8_t *s,
+    size_t n)
+{
+    const __m256i byte_1_high = XS_UTF8_TABLE(
+        /* 0_______ ________ <ASCII in byte 1> */
+        XS_UTF8_TOO_LONG, XS_UTF8_TOO_LONG, XS_UTF8_TOO_LONG, XS_UTF8_TOO_LONG,
+        XS_UTF8_TOO_LONG, XS_UTF8_TOO_LONG, XS_UTF8_TOO_LONG, XS_UTF8_TOO_LONG,
+        /* 10______ ________ <continuation in byte 1> */
+        XS_UTF8_TWO_CONTS, XS_UTF8_TWO_CONTS, XS_UTF8_TWO_CONTS,
+        XS_UTF8_TWO_CONTS,
+        /* 1100____ ________ <two byte lead in byte 1> */
+        XS_UTF8_TOO_SHORT | XS_UTF8_OVERLONG_2,
+        /* 1101____ ________ <two byte lead in byte 1> */
+        XS_UTF8_TOO_SHORT,
+        /* 1110____ ________ <three byte lead in byte 1> */
+        XS_UTF8_TOO_SHORT | XS_UTF8_OVERLONG_3 | XS_UTF8_SURROGATE,
+        /* 1111____ ________ <four+ byte lead in byte 1> */
+        XS_UTF8_TOO_SHORT | XS_UTF8_TOO_LARGE | XS_UTF8_TOO_LARGE_1000 |
+            XS_UTF8_OVERLONG_4);
+    const __m256i byte_1_low = XS_UTF8_TABLE(
+        /* ____0000 ________ */
+        XS_UTF8_CARRY | XS_UTF8_OVERLONG_3 | XS_UTF8_OVERLONG_2 |
+            XS_UTF8_OVERLONG_4,
+        /* ____0001 ________ */
+        XS_UTF8_CARRY | XS_UTF8_OVERLONG_2,
+        /* ____001_ ________ */
+        XS_UTF8_CARRY, XS_UTF8_CARRY,
+        /* ____0100 ________ */
+        XS_UTF8_CARRY | XS_UTF8_TOO_LARGE,
+        /* ____0101 ________ */
+        XS_UTF8_CARRY | XS_UTF8_TOO_LARGE | XS_UTF8_TOO_LARGE_1000,
+        /* ____011_ ________ */
+        XS_UTF8_CARRY | XS_UTF8_TOO_LARGE | XS_UTF8_TOO_LARGE_1000,
+        XS_UTF8_CARRY | XS_UTF8_TOO_LARGE | XS_UTF8_TOO_LARGE_1000,
+        /* ____1___ ________ */
+        XS_UTF8_CARRY | XS_UTF8_TOO_LARGE | XS_UTF8_TOO_LARGE_1000,
+        XS_UTF8_CARRY | XS_UTF8_TOO_LARGE | XS_UTF8_TOO_LARGE_1000,
+        XS_UTF8_CARRY | XS_UTF8_TOO_LARGE | XS_UTF8_TOO_LARGE_1000,
+        XS_UTF8_CARRY | XS_UTF8_TOO_LARGE | XS_UTF8_TOO_LARGE_1000,
+        XS_UTF8_CARRY | XS_UTF8_TOO_LARGE | XS_UTF8_TOO_LARGE_1000,
+        /* ____1101 ________ */
+        XS_UTF8_CARRY | XS_UTF8_TOO_LARGE | XS_UTF8_TOO_LARGE_1000 |
+            XS_UTF8_SURROGATE,
+        XS_UTF8_CARRY | XS_UTF8_TOO_LARGE | XS_UTF8_TOO_LARGE_1000,
+        XS_UTF8_CARRY | XS_UTF8_TOO_LARGE | XS_UTF8_TOO_LARGE_1000);
+    const __m256i byte_2_high = XS_UTF8_TABLE(
+        /* ________ 0_______ <ASCII in byte 2> */
+        XS_UTF8_TOO_SHORT, XS_UTF8_TOO_SHORT, XS_UTF8_TOO_SHORT,
+        XS_UTF8_TOO_SHORT, XS_UTF8_TOO_SHORT, XS_UTF8_TOO_SHORT,
+        XS_UTF8_TOO_SHORT, XS_UTF8_TOO_SHORT,
+        /* ________ 1000____ */
+        XS_UTF8_TOO_LONG | XS_UTF8_OVERLONG_2 | XS_UTF8_TWO_CONTS |
+            XS_UTF8_OVERLONG_3 | XS_UTF8_TOO_LARGE_1000 | XS_UTF8_OVERLONG_4,
+        /* ________ 1001____ */
+        XS_UTF8_TOO_LONG | XS_UTF8_OVERLONG_2 | XS_UTF8_TWO_CONTS |
+            XS_UTF8_OVERLONG_3 | XS_UTF8_TOO_LARGE,
+        /* ________ 101_____ */
+        XS_UTF8_TOO_LONG | XS_UTF8_OVERLONG_2 | XS_UTF8_TWO_CONTS |
+            XS_UTF8_SURROGATE | XS_UTF8_TOO_LARGE,
+        XS_UTF8_TOO_LONG | XS_UTF8_OVERLONG_2 | XS_UTF8_TWO_CONTS |
+            XS_UTF8_SURROGATE | XS_UTF8_TOO_LARGE,
+        /* ________ 11______ */
+        XS_UTF8_TOO_SHORT, XS_UTF8_TOO_SHORT, XS_UTF8_TOO_SHORT,
+        XS_UTF8_TOO_SHORT);
+    /* a lead byte in one of the last 3 positions needs the next block */
+    const __m256i max_value = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0xf0 - 1, 0xe0 - 1,
+        0xc0 - 1);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i error = _mm256_setzero_si256(), prev = _mm256_setzero_si256(),
+            incomplete = _mm256_setzero_si256();
+    uint8_t tail[32];
+
+    for (size_t i = 0; i < n; i += 32) {
+        __m256i input;
+
+        if (n - i >= 32) {
+            input = _mm256_loadu_si256((const __m256i *) (s + i));
+        } else {
+            /* zero padding is ASCII: a truncated sequence is TOO_SHORT */
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, s + i, n - i);
+            input = _mm256_loadu_si256((const __m256i *) tail);
+        }
+
+        if (!_mm256_movemask_epi8(input)) {
+            /* all ASCII: only a sequence left open by the last block fails */
+            error = _mm256_or_si256(error, incomplete);
+        } else {
+            __m256i prev1 = xs_utf8_prev(input, prev, 1);
+            __m256i sc = _mm256_and_si256(
+                _mm256_and_si256(
+                    _mm256_shuffle_epi8(
+                        byte_1_high,
+                        _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+                    _mm256_shuffle_epi8(byte_1_low,
+                                        _mm256_and_si256(prev1, nibble))),
+                _mm256_shuffle_epi8(
+                    byte_2_high,
+                    _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+            __m256i prev2 = xs_utf8_prev(input, prev, 2);
+            __m256i prev3 = xs_utf8_prev(input, prev, 3);
+            /* 2nd or 3rd continuation: 3 or 4 byte lead 2 or 3 bytes back */
+            __m256i must23 = _mm256_and_si256(
+                _mm256_or_si256(
+                    _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xe0 - 0x80)),
+                    _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xf0 - 0x80))),
+                _mm256_set1_epi8((char) 0x80));
+            error = _mm256_or_si256(error, _mm256_xor_si256(must23, sc));
+        }
+        incomplete = _mm256_subs_epu8(input, max_value);
+        prev = input;
+    }
+    error = _mm256_or_si256(error, incomplete);
+    return _mm256_testz_si256(error, error);
+}
+#undef xs_utf8_prev
+#undef XS_UTF8_TABLE
+#endif
+
+static bool xs_utf8_validate(const char *s, size_t n)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (n >= 32 && xs_cpu_has_avx2())
+        return xs_utf8_validate_avx2((const uint8_t *) s, n);
+#endif
+    return xs_utf8_validate_scalar((const uint8_t *) s, n);
+}
+
+/* valid per the cached flag, or checked right away for small strings */
+static bool xs_utf8_known(const xs *x)
+{
+    if (xs_is_ptr(x))
+        return x->is_utf8;
+    return xs_utf8_validate(x->data, xs_size(x));
+}
+
+/* Check @x is valid UTF-8; a positive answer is cached in heap strings */
+bool xs_utf8_valid(xs *x)
+{
+    if (xs_utf8_known(x))
+        return true;
+    if (!xs_is_ptr(x) || !xs_expand(x) ||
+        !xs_utf8_validate(xs_data(x), xs_size(x)))
+        return false;
+    x->is_utf8 = true;
+    return true;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) static size_t
+xs_utf8_count_avx2(const char *s, size_t n, size_t *done)
+{
+    const __m256i cont = _mm256_set1_epi8(-65);
+    size_t count = 0, i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+        count += __builtin_popcount(
+            _mm256_movemask_epi8(_mm256_cmpgt_epi8(v, cont)));
+    }
+    *done = i;
+    return count;
+}
+#endif
+
+/* Number of code points, XS_NPOS if @x is not valid UTF-8 or cannot be
+ * expanded
+ */
+size_t xs_utf8_length(xs *x)
+{
+    size_t n = xs_size(x), count = 0, i = 0;
+
+    if (!xs_expand(x) || !xs_utf8_valid(x))
+        return XS_NPOS;
+    const char *s = xs_data(x);
+
+    /* every byte but the continuation bytes 10xxxxxx starts a code point */
+#if defined(__x86_64__) || defined(__i386__)
+    if (n >= 32 && xs_cpu_has_avx2())
+        count = xs_utf8_count_avx2(s, n, &i);
+#endif
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+        count += __builtin_popcount(
+            _mm_movemask_epi8(_mm_cmpgt_epi8(v, _mm_set1_epi8(-65))));
+    }
+#endif
+    for (; i < n; i++)
+        count += (int8_t) s[i] > -65;
+    return count;
+}
+
+/*
+ * Numbers: formatting appends straight into the string's own capacity, no
+ * temporary buffer and no format string to parse.
+ */
+static const char xs_digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233"
+    "34353637383940414243444546474849505152535455565758596061626364656667"
+    "6869707172737475767778798081828384858687888990919293949596979899";
+
+static inline int xs_u64_len(uint64_t v)
+{
+    int len = 1;
+
+    for (;;) {
+        if (v < 10)
+            return len;
+        if (v < 100)
+            return len + 1;
+        if (v < 1000)
+            return len + 2;
+        if (v < 10000)
+            return len + 3;
+        v /= 10000;
+        len += 4;
+    }
+}
+
+/* Write the @len digits of @v ending right before @end */
+static inline void xs_u64_write(char *end, uint64_t v)
+{
+    while (v >= 100) {
+        end -= 2;
+        memcpy(end, xs_digit_pairs + (v % 100) * 2, 2);
+        v /= 100;
+    }
+    if (v >= 10) {
+        end -= 2;
+        memcpy(end, xs_digit_pairs + v * 2, 2);
+    } else {
+        *--end = '0' + v;
+    }
+}
+
+/* Digits keep a valid UTF-8 string valid, so these leave is_utf8 alone */
+static xs *xs_append_digits(xs *x, bool neg, uint64_t v)
+{
+    size_t size = xs_size(x);
+    int len = xs_u64_len(v) + neg;
+    char *p = xs_append_space(x, len);
+
+    if (!p)
+        return NULL;
+    if (neg)
+        *p = '-';
+    xs_u64_write(p + len, v);
+    xs_set_size(x, size + len);
+    return x;
+}
+
+xs *xs_append_uint(xs *x, uint64_t v)
+{
+    return xs_append_digits(x, false, v);
+}
+
+xs *xs_append_int(xs *x, int64_t v)
+{
+    return xs_append_digits(x, v < 0, v < 0 ? -(uint64_t) v : (uint64_t) v);
+}
+
+/*
+ * Shortest round-trip double to decimal conversion, after Ulf Adams, "Ryu:
+ * fast float-to-string conversion" (PLDI 2018).  The 128-bit tables of powers
+ * of 5 and their inverses are computed once on first use instead of being
+ * spelled out in the source.
+ */
+#define XS_POW5_INV_BITCOUNT 125
+#define XS_POW5_BITCOUNT 125
+#define XS_POW5_INV_TABLE_SIZE 342
+#define XS_POW5_TABLE_SIZE 326
+#define XS_BIG_LIMBS 28
+
+typedef unsigned __int128 xs_u128;
+
+static xs_u128 xs_pow5_split[XS_POW5_TABLE_SIZE];
+static xs_u128 xs_pow5_inv_split[XS_POW5_INV_TABLE_SIZE];
+static pthread_once_t xs_ryu_once = PTHREAD_ONCE_INIT;
+
+static int xs_big_bitlen(const uint32_t *a)
+{
+    for (int i = XS_BIG_LIMBS - 1; i >= 0; i--) {
+        if (a[i])
+            return i * 32 + 32 - __builtin_clz(a[i]);
+    }
+    return 0;
+}
+
+static inline int xs_big_bit(const uint32_t *a, int bit)
+{
+    return bit >= 0 && (a[bit / 32] >> (bit % 32)) & 1;
+}
+
+static bool xs_big_ge(const uint32_t *a, const uint32_t *b)
+{
+    for (int i = XS_BIG_LIMBS - 1; i >= 0; i--) {
+        if (a[i] != b[i])
+            return a[i] > b[i];
+    }
+    return true;
+}
+
+static void xs_big_sub(uint32_t *a, const uint32_t *b)
+{
+    uint64_t borrow = 0;
+
+    for (int i = 0; i < XS_BIG_LIMBS; i++) {
+        uint64_t d = (uint64_t) a[i] - b[i] - borrow;
+        a[i] = d;
+        borrow = d >> 63;
+    }
+}
+
+static void xs_big_shl1(uint32_t *a)
+{
+    for (int i = XS_BIG_LIMBS - 1; i > 0; i--)
+        a[i] = a[i] << 1 | a[i - 1] >> 31;
+    a[0] <<= 1;
+}
+
+static void xs_big_mul5(uint32_t *a)
+{
+    uint64_t carry = 0;
+
+    for (int i = 0; i < XS_BIG_LIMBS; i++) {
+        uint64_t v = (uint64_t) a[i] * 5 + carry;
+        a[i] = v;
+        carry = v >> 32;
+    }
+}
+
+/* The top @bits bits of @a, zero-filled below its lowest bit */
+static xs_u128 xs_big_top(const uint32_t *a, int bits)
+{
+    int len = xs_big_bitlen(a);
+    xs_u128 v = 0;
+
+    for (int b = len - 1; b >= len - bits; b--)
+        v = v << 1 | xs_big_bit(a, b);
+    return v;
+}
+
+/* floor(2^(bitlen(a) - 1 + bits) / a), by long division starting from the
+ * leading bit; the quotient must fit in 128 bits
+ */
+static xs_u128 xs_big_recip(const uint32_t *a, int bits)
+{
+    uint32_t r[XS_BIG_LIMBS] = {0};
+    int len = xs_big_bitlen(a);
+    xs_u128 q = 0;
+
+    r[(len - 1) / 32] = 1U << ((len - 1) % 32);
+    for (int b = 0;; b++) {
+        if (xs_big_ge(r, a)) {
+            xs_big_sub(r, a);
+            q |= 1;
+        }
+        if (b == bits)
+            return q;
+        q <<= 1;
+        xs_big_shl1(r);
+    }
+}
+
+static void xs_ryu_init(void)
+{
+    uint32_t pow5[XS_BIG_LIMBS] = {1};
+
+    for (int i = 0; i < XS_POW5_INV_TABLE_SIZE; i++, xs_big_mul5(pow5)) {
+        if (i < XS_POW5_TABLE_SIZE)
+            xs_pow5_split[i] = xs_big_top(pow5, XS_POW5_BITCOUNT);
+        xs_pow5_inv_split[i] = xs_big_recip(pow5, XS_POW5_INV_BITCOUNT) + 1;
+    }
+}
+
+/* ceil(log2(5^e)) for 1 <= e <= 3528 */
+static inline int32_t xs_pow5bits(int32_t e)
+{
+    return (int32_t) (((uint32_t) e * 1217359) >> 19) + 1;
+}
+
+/* floor(log10(2^e)) and floor(log10(5^e)) for 0 <= e <= 1650 */
+static inline uint32_t xs_log10_pow2(int32_t e)
+{
+    return ((uint32_t) e * 78913) >> 18;
+}
+
+static inline uint32_t xs_log10_pow5(int32_t e)
+{
+    return ((uint32_t) e * 732923) >> 20;
+}
+
+static inline bool xs_multiple_of_pow5(uint64_t v, uint32_t p)
+{
+    uint32_t count = 0;
+
+    for (; v % 5 == 0; v /= 5)
+        count++;
+    return count >= p;
+}
+
+static inline bool xs_multiple_of_pow2(uint64_t v, uint32_t p)
+{
+    return (v & ((1ULL << p) - 1)) == 0;
+}
+
+static inline uint64_t xs_mul_shift64(uint64_t m, xs_u128 mul, int32_t j)
+{
+    xs_u128 b0 = (xs_u128) m * (uint64_t) mul;
+    xs_u128 b2 = (xs_u128) m * (uint64_t) (mul >> 64);
+    return (uint64_t) (((b0 >> 64) + b2) >> (j - 64));
+}
+
+/* Shortest decimal @*digits * 10^@*exp that reads back as the finite,
+ * nonzero double with the given raw mantissa and exponent fields.
+ */
+static void xs_d2d(uint64_t ieee_mantissa,
+                   uint32_t ieee_exponent,
+                   uint64_t *digits,
+                   int32_t *exp)
+{
+    int32_t e2;
+    uint64_t m2;
+
+    if (ieee_exponent == 0) {
+        e2 = 1 - 1023 - 52 - 2;
+        m2 = ieee_mantissa;
+    } else {
+        e2 = (int32_t) ieee_exponent - 1023 - 52 - 2;
+        m2 = (1ULL << 52) | ieee_mantissa;
+    }
+    bool accept_bounds = (m2 & 1) == 0;
+
+    /* the interval of decimals that round to this double is (vm, vp) */
+    uint64_t mv = 4 * m2;
+    uint32_t mm_shift = ieee_mantissa != 0 || ieee_exponent <= 1;
+    uint64_t vr, vp, vm;
+    int32_t e10;
+    bool vm_trailing_zeros = false, vr_trailing_zeros = false;
+
+    if (e2 >= 0) {
+        uint32_t q = xs_log10_pow2(e2) - (e2 > 3);
+        int32_t k = XS_POW5_INV_BITCOUNT + xs_pow5bits(q) - 1;
+        int32_t i = -e2 + (int32_t) q + k;
+        xs_u128 mul = xs_pow5_inv_split[q];
+
+        e10 = q;
+        vr = xs_mul_shift64(4 * m2, mul, i);
+        vp = xs_mul_shift64(4 * m2 + 2, mul, i);
+        vm = xs_mul_shift64(4 * m2 - 1 - mm_shift, mul, i);
+        if (q <= 21) {
+            if (mv % 5 == 0)
+                vr_trailing_zeros = xs_multiple_of_pow5(mv, q);
+            else if (accept_bounds)
+                vm_trailing_zeros = xs_multiple_of_pow5(mv - 1 - mm_shift, q);
+            else
+                vp -= xs_multiple_of_pow5(mv + 2, q);
+        }
+    } else {
+        uint32_t q = xs_log10_pow5(-e2) - (-e2 > 1);
+        int32_t i = -e2 - (int32_t) q;
+        int32_t k = xs_pow5bits(i) - XS_POW5_BITCOUNT;
+        int32_t j = (int32_t) q - k;
+        xs_u128 mul = xs_pow5_split[i];
+
+        e10 = (int32_t) q + e2;
+        vr = xs_mul_shift64(4 * m2, mul, j);
+        vp = xs_mul_shift64(4 * m2 + 2, mul, j);
+        vm = xs_mul_shift64(4 * m2 - 1 - mm_shift, mul, j);
+        if (q <= 1) {
+            /* mv has at least q trailing 0 bits, hence q trailing decimal
+             * zeros once multiplied by 5^i
+             */
+            vr_trailing_zeros = true;
+            if (accept_bounds)
+                vm_trailing_zeros = mm_shift == 1;
+            else
+                vp--;
+        } else if (q < 63) {
+            vr_trailing_zeros = xs_multiple_of_pow2(mv, q);
+        }
+    }
+
+    /* drop digits while the interval still holds a shorter decimal */
+    int32_t removed = 0;
+    uint8_t last_removed = 0;
+    uint64_t output;
+
+    if (vm_trailing_zeros || vr_trailing_zeros) {
+        /* rare: the exact value may end in zeros, track them for ties */
+        for (; vp / 10 > vm / 10; removed++) {
+            vm_trailing_zeros &= vm % 10 == 0;
+            vr_trailing_zeros &= last_removed == 0;
+            last_removed = vr % 10;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+        }
+        if (vm_trailing_zeros) {
+            for (; vm % 10 == 0; removed++) {
+                vr_trailing_zeros &= last_removed == 0;
+                last_removed = vr % 10;
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+            }
+        }
+        /* exactly halfway: round to even */
+        if (vr_trailing_zeros && last_removed == 5 && vr % 2 == 0)
+            last_removed = 4;
+        output = vr + ((vr == vm && (!accept_bounds || !vm_trailing_zeros)) ||
+                       last_removed >= 5);
+    } else {
+        bool round_up = false;
+
+        if (vp / 100 > vm / 100) {
+            round_up = vr % 100 >= 50;
+            vr /= 100;
+            vp /= 100;
+            vm /= 100;
+            removed += 2;
+        }
+        for (; vp / 10 > vm / 10; removed++) {
+            round_up = vr % 10 >= 5;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+        }
+        output = vr + (vr == vm || round_up);
+    }
+
+    *digits = output;
+    *exp = e10 + removed;
+}
+
+/* Longest output: "-" 17 digits "e-" 3 exponent digits, or a fixed "-0." with
+ * 5 zeros and 17 digits
+ */
+#define XS_DOUBLE_MAX_LEN 26
+
+/* Append the shortest decimal that reads back as @v, laid out like
+ * JavaScript's Number.prototype.toString(): plain notation for magnitudes in
+ * [1e-6, 1e21), "1.5e+300" style otherwise.  NaN and infinities append "nan",
+ * "inf" and "-inf".
+ */
+xs *xs_append_double(xs *x, double v)
+{
+    uint64_t bits, digits;
+    int32_t exp;
+    size_t size = xs_size(x);
+    char *p = xs_append_space(x, XS_DOUBLE_MAX_LEN), *s = p;
+
+    if (!p)
+        return NULL;
+    memcpy(&bits, &v, sizeof(bits));
+    bool neg = bits >> 63;
+    uint32_t ieee_exponent = (bits >> 52) & 0x7ff;
+    uint64_t ieee_mantissa = bits & ((1ULL << 52) - 1);
+
+    if (ieee_exponent == 0x7ff) {
+        if (ieee_mantissa) {
+            memcpy(s, "nan", 3);
+            s += 3;
+        } else {
+            memcpy(s, "-inf" + !neg, 4 - !neg);
+            s += 4 - !neg;
+        }
+        xs_set_size(x, size + (s - p));
+        return x;
+    }
+
+    if (neg)
+        *s++ = '-';
+    if (!ieee_exponent && !ieee_mantissa) {
+        *s++ = '0';
+        xs_set_size(x, size + (s - p));
+        return x;
+    }
+
+    pthread_once(&xs_ryu_once, xs_ryu_init);
+    xs_d2d(ieee_mantissa, ieee_exponent, &digits, &exp);
+
+    /* the value is 0.DIGITS * 10^point */
+    int len = xs_u64_len(digits), point = len + exp;
+
+    if (point > 21 || point <= -6) {
+        /* d.ddde+NN: write the digits one place right, then pull the first
+         * one in front of the dot
+         */
+        xs_u64_write(s + 1 + len, digits);
+        s[0] = s[1];
+        if (len > 1) {
+            s[1] = '.';
+            s += len + 1;
+        } else {
+            s++;
+        }
+        int e = point - 1;
+        *s++ = 'e';
+        *s++ = e < 0 ? '-' : '+';
+        e = e < 0 ? -e : e;
+        xs_u64_write(s + xs_u64_len(e), e);
+        s += xs_u64_len(e);
+    } else if (point <= 0) {
+        /* 0.000ddd */
+        memcpy(s, "0.00000", 2 - point);
+        s += 2 - point;
+        xs_u64_write(s + len, digits);
+        s += len;
+    } else if (point >= len) {
+        /* ddd000 */
+        xs_u64_write(s + len, digits);
+        memset(s + len, '0', point - len);
+        s += point;
+    } else {
+        /* dd.ddd */
+        xs_u64_write(s + 1 + len, digits);
+        memmove(s, s + 1, point);
+        s[point] = '.';
+        s += len + 1;
+    }
+    xs_set_size(x, size + (s - p));
+    return x;
+}
+
+/* The @n bytes at @s as an int64_t, see xs_to_int64() */
+static bool xs_parse_int64(const char *s, size_t n, int64_t *out)
+{
+    const char *end = s + n;
+    bool neg = false;
+    uint64_t v = 0, limit;
+
+    if (s < end && (*s == '-' || *s == '+'))
+        neg = *s++ == '-';
+    if (s == end)
+        return false;
+
+    limit = neg ? (uint64_t) INT64_MAX + 1 : INT64_MAX;
+    for (; s < end; s++) {
+        unsigned d = (unsigned char) *s - '0';
+        if (d > 9 || v > (limit - d) / 10)
+            return false;
+        v = v * 10 + d;
+    }
+    *out = neg ? (int64_t) -v : (int64_t) v;
+    return true;
+}
+
+/* Parse the whole of @x as a decimal integer with an optional sign.  Returns
+ * false, leaving @out alone, on anything else, on overflow or out of memory.
+ */
+bool xs_to_int64(const xs *x, int64_t *out)
+{
+    xs tmp;
+    const xs *f = xs_flat(x, &tmp);
+    bool ok = f && xs_parse_int64(xs_data(f), xs_size(f), out);
+
+    xs_free(&tmp);
+    return ok;
+}
+
+static const double xs_pow10_exact[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+/*
+ * Decimal to double after Daniel Lemire, "Number Parsing at a Gigabyte per
+ * Second" (2021), building on Michael Eisel's algorithm: one or two 64x64-bit
+ * products against a truncated 128-bit 10^q give the correctly rounded
+ * result, or tell us the rare inputs that need the slow path.
+ */
+#define XS_POW10_MIN (-342)
+#define XS_POW10_MAX 308
+
+static xs_u128 xs_pow10_128[XS_POW10_MAX - XS_POW10_MIN + 1];
+static pthread_once_t xs_lemire_once = PTHREAD_ONCE_INIT;
+
+/* 10^q normalised to [2^127, 2^128), i.e. 5^q with the binary part dropped */
+static void xs_lemire_init(void)
+{
+    uint32_t pow5[XS_BIG_LIMBS] = {1};
+
+    for (int q = 0; q <= -XS_POW10_MIN; q++, xs_big_mul5(pow5)) {
+        if (q <= XS_POW10_MAX)
+            xs_pow10_128[q - XS_POW10_MIN] = xs_big_top(pow5, 128);
+        if (q > 0)
+            xs_pow10_128[-q - XS_POW10_MIN] =
+                xs_big_recip(pow5, 128) + (q <= 27);
+    }
+}
+
+/* @w * 10^@q for 0 < @w < 10^19, false when the slow path must decide */
+static bool xs_lemire(uint64_t w, int32_t q, bool neg, double *out)
+{
+    if (q < XS_POW10_MIN || q > XS_POW10_MAX)
+        return false;
+
+    pthread_once(&xs_lemire_once, xs_lemire_init);
+    xs_u128 pow10 = xs_pow10_128[q - XS_POW10_MIN];
+    int lz = __builtin_clzll(w);
+    int64_t exponent = ((((int64_t) 152170 + 65536) * q) >> 16) + 1024 + 63;
+
+    w <<= lz;
+    xs_u128 product = (xs_u128) w * (uint64_t) (pow10 >> 64);
+    uint64_t upper = product >> 64, lower = product;
+
+    /* the truncated bits could carry into the ones we keep */
+    if ((upper & 0x1ff) == 0x1ff && lower + w < lower) {
+        xs_u128 second = (xs_u128) w * (uint64_t) pow10;
+        uint64_t middle = lower + (uint64_t) (second >> 64);
+
+        if (middle < lower)
+            upper++;
+        if (middle + 1 == 0 && (upper & 0x1ff) == 0x1ff &&
+            (uint64_t) second + w < (uint64_t) second)
+            return false;
+        lower = middle;
+    }
+
+    uint64_t upperbit = upper >> 63;
+    uint64_t mantissa = upper >> (upperbit + 9);
+    lz += 1 ^ upperbit;
+
+    /* possibly exactly halfway between two doubles */
+    if (lower == 0 && (upper & 0x1ff) == 0 && (mantissa & 3) == 1)
+        return false;
+
+    mantissa += mantissa & 1;
+    mantissa >>= 1;
+    if (mantissa >= (1ULL << 53)) {
+        mantissa = 1ULL << 52;
+        lz--;
+    }
+    mantissa &= ~(1ULL << 52);
+
+    /* subnormals and overflow take the slow path */
+    uint64_t real_exponent = exponent - lz;
+    if (real_exponent < 1 || real_exponent > 2046)
+        return false;
+
+    mantissa |= real_exponent << 52 | (uint64_t) neg << 63;
+    memcpy(out, &mantissa, sizeof(*out));
+    return true;
+}
+
+/* The @n bytes at @start, followed by a NUL, as a double.  Plain decimals
+ * whose digits fit in 2^53 and whose exponent is within +-22 are converted
+ * with a single exactly rounded multiplication or division (Clinger's fast
+ * path), other decimals of up to 19 digits with xs_lemire().  Everything
+ * else, including "inf", "nan", hex floats and subnormals, goes through
+ * strtod().
+ */
+static bool xs_parse_double(const char *start, size_t n, double *out)
+{
+    const char *s = start, *end = s + n;
+    bool neg = false;
+    uint64_t m = 0;
+    int digits = 0, exp = 0, seen = 0;
+
+    if (s < end && (*s == '-' || *s == '+'))
+        neg = *s++ == '-';
+    for (; s < end && (unsigned) (*s - '0') <= 9; s++, seen++) {
+        if (m || *s != '0')
+            digits++;
+        m = m * 10 + (*s - '0');
+    }
+    if (s < end && *s == '.') {
+        for (s++; s < end && (unsigned) (*s - '0') <= 9; s++, seen++) {
+            if (m || *s != '0')
+                digits++;
+            m = m * 10 + (*s - '0');
+            exp--;
+        }
+    }
+    if (seen && s < end && (*s == 'e' || *s == 'E')) {
+        const char *e = s + 1;
+        bool eneg = false;
+        int ev = 0;
+
+        if (e < end && (*e == '-' || *e == '+'))
+            eneg = *e++ == '-';
+        if (e < end && (unsigned) (*e - '0') <= 9) {
+            for (; e < end && (unsigned) (*e - '0') <= 9 && ev < 10000; e++)
+                ev = ev * 10 + (*e - '0');
+            exp += eneg ? -ev : ev;
+            s = e;
+        }
+    }
+
+    if (seen && s == end && digits <= 19) {
+        if (m <= (1ULL << 53) && exp >= -22 && exp <= 22) {
+            double d = (double) m;
+            d = exp < 0 ? d / xs_pow10_exact[-exp] : d * xs_pow10_exact[exp];
+            *out = neg ? -d : d;
+            return true;
+        }
+        if (!m) {
+            *out = neg ? -0.0 : 0.0;
+            return true;
+        }
+        if (xs_lemire(m, exp, neg, out))
+            return true;
+    }
+
+    /* strtod() skips leading blanks, which would not be the whole string */
+    char *stop;
+    if (start == end || isspace((unsigned char) *start))
+        return false;
+    double d = strtod(start, &stop);
+    if (stop != end)
+        return false;
+    *out = d;
+    return true;
+}
+
+/* Parse the whole of @x as a double, see xs_parse_double().  Returns false,
+ * leaving @out alone, on anything else or out of memory.
+ */
+bool xs_to_double(const xs *x, double *out)
+{
+    xs tmp;
+    const xs *f = xs_flat(x, &tmp);
+    bool ok = f && xs_parse_double(xs_data(f), xs_size(f), out);
+
+    xs_free(&tmp);
+    return ok;
+}
+
+/*
+ * printf-style formatting into an xs.  Output goes straight into the spare
+ * capacity.  Output that outgrows it carries on in a stack buffer, after which
+ * the string grows once to the exact size and takes the bytes over; only a
+ * format too long for both runs a second time.
+ */
+#define XS_PRINTF_SPILL 512
+
+struct xs_sink {
+    char *data;              /* where output position @start is stored */
+    size_t start, pos, end;  /* positions up to @end are backed by @data */
+    char *spill;             /* unused spill buffer, if any */
+    bool nomem;              /* a %S argument could not be expanded */
+};
+
+/* Whether @n more bytes fit, moving over to the spill buffer if needed */
+static bool xs_sink_room(struct xs_sink *out, size_t n)
+{
+    if (out->pos + n <= out->end)
+        return true;
+    if (!out->spill || out->pos + n - out->start >= XS_PRINTF_SPILL)
+        return false;
+
+    memcpy(out->spill, out->data, out->pos - out->start);
+    out->data = out->spill;
+    out->end = out->start + XS_PRINTF_SPILL - 1;
+    out->spill = NULL;
+    return true;
+}
+
+static inline void xs_sink_put(struct xs_sink *out, const char *s, size_t n)
+{
+    if (xs_sink_room(out, n))
+        memcpy(out->data + out->pos - out->start, s, n);
+    out->pos += n;
+}
+
+static inline void xs_sink_pad(struct xs_sink *out, size_t n)
+{
+    if (xs_sink_room(out, n))
+        memset(out->data + out->pos - out->start, ' ', n);
+    out->pos += n;
+}
+
+/* One conversion through vsnprintf(), which may write its terminator at
+ * position @end: the byte the final size is terminated with anyway.
+ */
+static void xs_sink_printf(struct xs_sink *out, const char *spec, ...)
+{
+    size_t room = out->pos <= out->end ? out->end - out->pos + 1 : 0;
+    va_list ap;
+
+    va_start(ap, spec);
+    int n = vsnprintf(room ? out->data + out->pos - out->start : NULL, room,
+                      spec, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+
+    /* cut short: retry in the spill buffer when it has just come into use */
+    if ((size_t) n >= room && out->spill && xs_sink_room(out, n)) {
+        va_start(ap, spec);
+        vsnprintf(out->data + out->pos - out->start, n + 1, spec, ap);
+        va_end(ap);
+    }
+    out->pos += n;
+}
+
+static inline void xs_sink_uint(struct xs_sink *out, bool neg, uint64_t v)
+{
+    char buf[21];
+    int len = xs_u64_len(v) + neg;
+
+    buf[0] = '-';
+    xs_u64_write(buf + len, v);
+    xs_sink_put(out, buf, len);
+}
+
+static inline const char *xs_format_num(const char *s, int *v)
+{
+    for (*v = 0; (unsigned) (*s - '0') <= 9; s++) {
+        if (*v < 100000000)
+            *v = *v * 10 + *s - '0';
+    }
+    return s;
+}
+
+/* Length modifiers: 'H' and 'q' stand for "hh" and "ll" */
+static long long xs_format_int(char len, va_list *ap)
+{
+    switch (len) {
+    case 'H':
+        return (signed char) va_arg(*ap, int);
+    case 'h':
+        return (short) va_arg(*ap, int);
+    case 'l':
+        return va_arg(*ap, long);
+    case 'q':
+        return va_arg(*ap, long long);
+    case 'j':
+        return va_arg(*ap, intmax_t);
+    case 'z':
+    case 't':
+        return va_arg(*ap, ptrdiff_t);
+    default:
+        return va_arg(*ap, int);
+    }
+}
+
+static unsigned long long xs_format_uint(char len, va_list *ap)
+{
+    switch (len) {
+    case 'H':
+        return (unsigned char) va_arg(*ap, unsigned);
+    case 'h':
+        return (unsigned short) va_arg(*ap, unsigned);
+    case 'l':
+        return va_arg(*ap, unsigned long);
+    case 'q':
+        return va_arg(*ap, unsigned long long);
+    case 'j':
+        return va_arg(*ap, uintmax_t);
+    case 'z':
+    case 't':
+        return va_arg(*ap, size_t);
+    default:
+        return va_arg(*ap, unsigned);
+    }
+}
+
+/* Format @fmt into @out, returning the size the complete output needs.  The
+ * arguments are fetched here, one conversion at a time, so each is handed to
+ * vsnprintf() with a spec rebuilt around its actual type.
+ */
+static size_t xs_format(struct xs_sink *sink, const char *fmt, va_list ap)
+{
+    struct xs_sink out = *sink;
+    va_list args;
+
+    va_copy(args, ap);
+    while (*fmt) {
+        const char *pct = strchr(fmt, '%');
+        if (!pct) {
+            xs_sink_put(&out, fmt, strlen(fmt));
+            break;
+        }
+        xs_sink_put(&out, fmt, pct - fmt);
+        fmt = pct + 1;
+
+        /* flags, width and precision, with '*' resolved */
+        char spec[48], *p = spec;
+        bool left = false;
+        int width = -1, prec = -1;
+
+        *p++ = '%';
+        for (; *fmt && strchr("-+ #0'", *fmt); fmt++) {
+            left |= *fmt == '-';
+            if (p < spec + 8)
+                *p++ = *fmt;
+        }
+        if (*fmt == '*') {
+            width = va_arg(args, int);
+            fmt++;
+            if (width < 0) {
+                left = true;
+                *p++ = '-';
+                width = width < -100000000 ? 100000000 : -width;
+            }
+        } else if ((unsigned) (*fmt - '0') <= 9) {
+            fmt = xs_format_num(fmt, &width);
+        }
+        if (*fmt == '.') {
+            if (*++fmt == '*') {
+                prec = va_arg(args, int);
+                prec = prec < 0 ? -1 : prec;
+                fmt++;
+            } else {
+                fmt = xs_format_num(fmt, &prec);
+            }
+        }
+        bool plain = p == spec + 1 && width < 0 && prec < 0;
+        if (width >= 0)
+            p += snprintf(p, 12, "%d", width);
+        if (prec >= 0)
+            p += snprintf(p, 13, ".%d", prec);
+
+        char len = 0, conv;
+        if (*fmt == 'h' || *fmt == 'l') {
+            len = *fmt++;
+            if (*fmt == len) {
+                len = len == 'h' ? 'H' : 'q';
+                fmt++;
+            }
+        } else if (*fmt && strchr("jztL", *fmt)) {
+            len = *fmt++;
+        }
+        conv = *fmt;
+        if (!conv)
+            break;
+        fmt++;
+
+        switch (conv) {
+        case 'S': {
+            xs tmp;
+            const xs *s = xs_flat(va_arg(args, const xs *), &tmp);
+            if (!s) {
+                out.nomem = true;
+                break;
+            }
+            size_t n = xs_size(s), pad;
+            if (prec >= 0 && (size_t) prec < n)
+                n = prec;
+            pad = width > 0 && (size_t) width > n ? width - n : 0;
+            if (!left)
+                xs_sink_pad(&out, pad);
+            xs_sink_put(&out, xs_data(s), n);
+            if (left)
+                xs_sink_pad(&out, pad);
+            xs_free(&tmp);
+            break;
+        }
+        case 'd':
+        case 'i': {
+            long long v = xs_format_int(len, &args);
+            if (plain) {
+                uint64_t u = v < 0 ? -(uint64_t) v : (uint64_t) v;
+                xs_sink_uint(&out, v < 0, u);
+            } else {
+                memcpy(p, "ll?", 4);
+                p[2] = conv;
+                xs_sink_printf(&out, spec, v);
+            }
+            break;
+        }
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X': {
+            unsigned long long v = xs_format_uint(len, &args);
+            if (plain && conv == 'u') {
+                xs_sink_uint(&out, false, v);
+            } else {
+                memcpy(p, "ll?", 4);
+                p[2] = conv;
+                xs_sink_printf(&out, spec, v);
+            }
+            break;
+        }
+        case 's': {
+            const char *s = va_arg(args, const char *);
+            if (plain && s) {
+                xs_sink_put(&out, s, strlen(s));
+            } else {
+                memcpy(p, "s", 2);
+                xs_sink_printf(&out, spec, s);
+            }
+            break;
+        }
+        case 'c':
+            memcpy(p, "c", 2);
+            xs_sink_printf(&out, spec, va_arg(args, int));
+            break;
+        case 'p':
+            memcpy(p, "p", 2);
+            xs_sink_printf(&out, spec, va_arg(args, void *));
+            break;
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            if (len == 'L') {
+                *p++ = 'L';
+                *p++ = conv;
+                *p = 0;
+                xs_sink_printf(&out, spec, va_arg(args, long double));
+            } else {
+                *p++ = conv;
+                *p = 0;
+                xs_sink_printf(&out, spec, va_arg(args, double));
+            }
+            break;
+        case '%':
+            xs_sink_put(&out, "%", 1);
+            break;
+        default:
+            /* unknown conversions, %n included, are copied as they are */
+            xs_sink_put(&out, pct, fmt - pct);
+            break;
+        }
+    }
+    va_end(args);
+    *sink = out;
+    return out.pos;
+}
+
+/* Format into @x like vsnprintf(), replacing its contents, or appending to
+ * them with @append.  On top of the C conversions, %S takes a pointer to an
+ * xs and copies its bytes, honouring width, precision and '-', without a
+ * strlen(); it may be @x itself.  %n is not supported.  Returns NULL if it
+ * is out of memory: an append leaves @x as it was, a replacement may leave
+ * it empty.
+ */
+xs *xs_vprintf(xs *x, bool append, const char *fmt, va_list ap)
+{
+    size_t base, size;
+    va_list aq;
+
+    /* A %S argument may be @x or share its buffer, which replacing would
+     * empty before it is read: build the result aside then.  Appending
+     * only writes past what is read.
+     */
+    if (!append && strchr(fmt, 'S')) {
+        xs tmp = xs_literal_empty();
+        if (!xs_vprintf(&tmp, true, fmt, ap)) {
+            xs_free(&tmp);
+            return NULL;
+        }
+        xs_free(x);
+        *x = tmp;
+        return x;
+    }
+
+    if (!append && xs_get_ref_count(x) > 1)
+        xs_free(x);
+    base = append ? xs_size(x) : 0;
+    if (!xs_append_space(x, 0))
+        return NULL;
+    xs_set_size(x, base);
+
+    char spill[XS_PRINTF_SPILL];
+    struct xs_sink out = {xs_data(x) + base, base, base, xs_capacity(x), spill};
+
+    va_copy(aq, ap);
+    size = xs_format(&out, fmt, ap);
+    if (!out.nomem && size > xs_capacity(x)) {
+        if (!xs_grow(x, size)) {
+            va_end(aq);
+            xs_set_size(x, base);
+            return NULL;
+        }
+        if (out.data == spill && size <= out.end) {
+            memcpy(xs_data(x) + base, spill, size - base);
+        } else {
+            out = (struct xs_sink){xs_data(x) + base, base, base, size, NULL};
+            xs_format(&out, fmt, aq);
+        }
+    }
+    va_end(aq);
+    if (out.nomem) {
+        xs_set_size(x, base);
+        return NULL;
+    }
+
+    xs_set_size(x, size);
+    xs_set_utf8(x, false);
+    return x;
+}
+
+xs *xs_printf(xs *x, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    x = xs_vprintf(x, false, fmt, ap);
+    va_end(ap);
+    return x;
+}
+
+xs *xs_printf_append(xs *x, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    x = xs_vprintf(x, true, fmt, ap);
+    va_end(ap);
+    return x;
+}
+
+/* 64-bit hash over the string contents, processing 8 bytes per step.
+ * Strings with the same bytes hash alike whether they are stored inline or
+ * on the heap.  The final mix is the MurmurHash3 fmix64 finalizer.
+ */
+static inline uint64_t xs_hash_bytes(const void *p, size_t len)
+{
+    const uint8_t *s = p;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (len * 0xff51afd7ed558ccdULL), k;
+
+    for (; len >= 8; s += 8, len -= 8) {
+        memcpy(&k, s, 8);
+        k *= 0x87c37b91114253d5ULL;
+        k ^= k >> 31;
+        h = (h ^ k) * 0x4cf5ad432745937fULL;
+    }
+    if (len) {
+        k = 0;
+        memcpy(&k, s, len);
+        k *= 0x87c37b91114253d5ULL;
+        k ^= k >> 31;
+        h = (h ^ k) * 0x4cf5ad432745937fULL;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Hash of @x, or 0 if it is held in another form and cannot be expanded */
+static inline uint64_t xs_hash(const xs *x)
+{
+    xs tmp;
+    const xs *f = xs_flat(x, &tmp);
+    uint64_t h = f ? xs_hash_bytes(xs_data(f), xs_size(f)) : 0;
+
+    xs_free(&tmp);
+    return h;
+}
+
+/*
+ * xs_map: open-addressing hash map keyed by xs, in the spirit of SwissTable:
+ * https://abseil.io/about/design/swisstables
+ *
+ * Every slot stores the xs itself, so keys of up to XS_INLINE_MAX bytes live
+ * inline in the table without any extra allocation.  Longer keys are taken
+ * with xs_copy(), i.e. large strings are only referenced (CoW).
+ *
+ * A separate array keeps one control byte per slot: EMPTY, DELETED, or the
+ * low 7 bits of the hash (H2).  Lookups scan a group of 16 control bytes at
+ * once and only touch the slots whose H2 matches.
+ */
+#define XS_MAP_GROUP 16
+#define XS_MAP_EMPTY ((int8_t) -128)
+#define XS_MAP_DELETED ((int8_t) -2)
+
+typedef struct {
+    xs key;
+    void *value;
+} xs_map_slot;
+
+typedef struct {
+    int8_t *ctrl;
+    xs_map_slot *slots;
+    /* capacity is 0 or a power of 2 and a multiple of XS_MAP_GROUP */
+    size_t capacity, size, growth_left;
+} xs_map;
+
+/* bitmask of the bytes in the group equal to @v */
+static inline uint32_t xs_map_match(const int8_t *group, int8_t v)
+{
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128((const __m128i *) group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(v)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < XS_MAP_GROUP; i++)
+        mask |= (uint32_t) (group[i] == v) << i;
+    return mask;
+#endif
+}
+
+/* bitmask of the EMPTY or DELETED bytes in the group: both are negative */
+static inline uint32_t xs_map_match_free(const int8_t *group)
+{
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) group));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < XS_MAP_GROUP; i++)
+        mask |= (uint32_t) (group[i] < 0) << i;
+    return mask;
+#endif
+}
+
+void xs_map_init(xs_map *m)
+{
+    *m = (xs_map){0};
+}
+
+void xs_map_free(xs_map *m)
+{
+    for (size_t i = 0; i < m->capacity; i++)
+        if (m->ctrl[i] >= 0)
+            xs_free(&m->slots[i].key);
+    free(m->ctrl);
+    free(m->slots);
+    xs_map_init(m);
+}
+
+static xs_map_slot *xs_map_lookup(const xs_map *m, const xs *key, uint64_t h)
+{
+    if (!m->capacity)
+        return NULL;
+
+    size_t mask = m->capacity / XS_MAP_GROUP - 1, g = (h >> 7) & mask;
+    int8_t h2 = h & 0x7f;
+
+    /* triangular probing visits every group exactly once */
+    for (size_t probe = 1;; g = (g + probe++) & mask) {
+        const int8_t *group = m->ctrl + g * XS_MAP_GROUP;
+        uint32_t bits = xs_map_match(group, h2);
+
+        for (; bits; bits &= bits - 1) {
+            xs_map_slot *slot =
+                &m->slots[g * XS_MAP_GROUP + __builtin_ctz(bits)];
+            if (xs_equal(&slot->key, key))
+                return slot;
+        }
+        if (xs_map_match(group, XS_MAP_EMPTY))
+            return NULL;
+    }
+}
+
+/* index of the first EMPTY or DELETED slot on the probe sequence of @h */
+static size_t xs_map_find_free(const xs_map *m, uint64_t h)
+{
+    size_t mask = m->capacity / XS_MAP_GROUP - 1, g = (h >> 7) & mask;
+
+    for (size_t probe = 1;; g = (g + probe++) & mask) {
+        uint32_t bits = xs_map_match_free(m->ctrl + g * XS_MAP_GROUP);
+        if (bits)
+            return g * XS_MAP_GROUP + __builtin_ctz(bits);
+    }
+}
+
+/* Move the keys to a table of @capacity slots; returns false, leaving @m as
+ * it was, if it is out of memory
+ */
+static bool xs_map_rehash(xs_map *m, size_t capacity)
+{
+    xs_map old = *m;
+    int8_t *ctrl = malloc(capacity);
+    xs_map_slot *slots = malloc(capacity * sizeof(xs_map_slot));
+
+    if (!ctrl || !slots) {
+        free(ctrl);
+        free(slots);
+        return false;
+    }
+    m->ctrl = ctrl;
+    m->slots = slots;
+    m->capacity = capacity;
+    m->growth_left = capacity / 8 * 7 - m->size;
+    memset(m->ctrl, XS_MAP_EMPTY, capacity);
+
+    /* keys are moved, not copied: no reference count traffic */
+    for (size_t i = 0; i < old.capacity; i++) {
+        if (old.ctrl[i] < 0)
+            continue;
+        uint64_t h = xs_hash(&old.slots[i].key);
+        size_t idx = xs_map_find_free(m, h);
+        m->ctrl[idx] = h & 0x7f;
+        m->slots[idx] = old.slots[i];
+    }
+    free(old.ctrl);
+    free(old.slots);
+    return true;
+}
+
+/* Returns the value slot of @key, or NULL if it is not in the map */
+void **xs_map_find(const xs_map *m, const xs *key)
+{
+    xs tmp;
+    const xs *flat = xs_flat(key, &tmp);
+    xs_map_slot *slot = flat ? xs_map_lookup(m, flat, xs_hash(flat)) : NULL;
+
+    xs_free(&tmp);
+    return slot ? &slot->value : NULL;
+}
+
+/* add @key, known to be absent, whose hash is @h; NULL if it is out of
+ * memory
+ */
+static xs_map_slot *xs_map_add(xs_map *m, const xs *key, uint64_t h)
+{
+    if (!m->growth_left) {
+        /* grow when more than half full, otherwise just drop tombstones */
+        size_t capacity = m->capacity;
+        if (m->size >= capacity / 2)
+            capacity = capacity ? capacity * 2 : XS_MAP_GROUP;
+        if (!xs_map_rehash(m, capacity))
+            return NULL;
+    }
+
+    size_t idx = xs_map_find_free(m, h);
+    if (m->ctrl[idx] == XS_MAP_EMPTY)
+        m->growth_left--;
+    m->ctrl[idx] = h & 0x7f;
+    xs_copy(&m->slots[idx].key, (xs *) key);
+    m->size++;
+    return &m->slots[idx];
+}
+
+/* Insert or update. Returns 1 if @key was not in the map before, 0 if it
+ * was, and -1, leaving @m as it was, if it is out of memory.  The map keeps
+ * a flat copy of a key held in another form.
+ */
+int xs_map_insert(xs_map *m, const xs *key, void *value)
+{
+    xs tmp;
+    const xs *flat = xs_flat(key, &tmp);
+
+    if (!flat)
+        return -1;
+
+    uint64_t h = xs_hash(flat);
+    xs_map_slot *slot = xs_map_lookup(m, flat, h);
+    bool added = !slot;
+
+    if (added)
+        slot = xs_map_add(m, flat, h);
+    xs_free(&tmp);
+    if (!slot)
+        return -1;
+    slot->value = value;
+    return added;
+}
+
+bool xs_map_erase(xs_map *m, const xs *key)
+{
+    xs tmp;
+    const xs *flat = xs_flat(key, &tmp);
+    xs_map_slot *slot = flat ? xs_map_lookup(m, flat, xs_hash(flat)) : NULL;
+
+    xs_free(&tmp);
+    if (!slot)
+        return false;
+
+    size_t idx = slot - m->slots;
+    int8_t *group = m->ctrl + idx / XS_MAP_GROUP * XS_MAP_GROUP;
+
+    /* A group that still has an EMPTY slot ends every probe sequence that
+     * reaches it, so the slot can become EMPTY instead of a tombstone.
+     */
+    if (xs_map_match(group, XS_MAP_EMPTY)) {
+        m->ctrl[idx] = XS_MAP_EMPTY;
+        m->growth_left++;
+    } else {
+        m->ctrl[idx] = XS_MAP_DELETED;
+    }
+    xs_free(&slot->key);
+    m->size--;
+    return true;
+}
+
+/*
+ * Global intern table: xs_intern() replaces a large string by the canonical
+ * CoW copy of its contents, so every interned duplicate costs a reference
+ * count instead of a buffer.  The table is split into shards, each guarded
+ * by its own lock and selected by the top bits of the hash.
+ *
+ * Only large strings are interned: small strings have no buffer to share and
+ * medium strings carry no reference count.
+ */
+#define XS_INTERN_SHARD_BITS 6
+#define XS_INTERN_SHARDS (1 << XS_INTERN_SHARD_BITS)
+
+struct xs_intern_stats {
+    size_t lookups, hits;
+    /* distinct strings held by the table and the bytes of their buffers */
+    size_t strings, bytes;
+    /* buffers released because a duplicate was replaced by the canonical */
+    size_t bytes_saved;
+};
+
+static struct xs_intern_shard {
+    pthread_mutex_t lock;
+    xs_map map;
+    struct xs_intern_stats stats;
+} xs_intern_shards[XS_INTERN_SHARDS];
+
+static pthread_once_t xs_intern_once = PTHREAD_ONCE_INIT;
+
+static void xs_intern_init(void)
+{
+    for (int i = 0; i < XS_INTERN_SHARDS; i++) {
+        pthread_mutex_init(&xs_intern_shards[i].lock, NULL);
+        xs_map_init(&xs_intern_shards[i].map);
+    }
+}
+
+/* bytes allocated for the buffer of a large string */
+static inline size_t xs_alloc_size(const xs *x)
+{
+    return ((size_t) 1 << x->capacity) + 4;
+}
+
+xs *xs_intern(xs *x)
+{
+    if (!xs_is_ptr(x) || !xs_is_large_string(x) || !xs_expand(x))
+        return x;
+
+    pthread_once(&xs_intern_once, xs_intern_init);
+
+    uint64_t h = xs_hash(x);
+    struct xs_intern_shard *shard =
+        &xs_intern_shards[h >> (64 - XS_INTERN_SHARD_BITS)];
+
+    pthread_mutex_lock(&shard->lock);
+    shard->stats.lookups++;
+
+    xs_map_slot *slot = xs_map_lookup(&shard->map, x, h);
+    if (!slot) {
+        /* the table keeps a reference: x becomes the canonical copy; out
+         * of memory, x is just left as it is
+         */
+        if (xs_map_add(&shard->map, x, h)) {
+            shard->stats.strings++;
+            shard->stats.bytes += xs_alloc_size(x);
+        }
+    } else if (slot->key.ptr != x->ptr) {
+        shard->stats.hits++;
+        if (xs_get_ref_count(x) == 1)
+            shard->stats.bytes_saved += xs_alloc_size(x);
+        xs_free(x);
+        xs_copy(x, &slot->key);
+    } else {
+        shard->stats.hits++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return x;
+}
+
+/* Drop the interned strings nobody but the table refers to anymore */
+void xs_intern_purge(void)
+{
+    pthread_once(&xs_intern_once, xs_intern_init);
+
+    for (int i = 0; i < XS_INTERN_SHARDS; i++) {
+        struct xs_intern_shard *shard = &xs_intern_shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        for (size_t j = 0; j < shard->map.capacity; j++) {
+            xs *key = &shard->map.slots[j].key;
+            if (shard->map.ctrl[j] < 0 || xs_get_ref_count(key) != 1)
+                continue;
+            shard->stats.strings--;
+            shard->stats.bytes -= xs_alloc_size(key);
+            xs_map_erase(&shard->map, key);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+struct xs_intern_stats xs_intern_get_stats(void)
+{
+    struct xs_intern_stats total = {0};
+
+    pthread_once(&xs_intern_once, xs_intern_init);
+
+    for (int i = 0; i < XS_INTERN_SHARDS; i++) {
+        struct xs_intern_shard *shard = &xs_intern_shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        total.lookups += shard->stats.lookups;
+        total.hits += shard->stats.hits;
+        total.strings += shard->stats.strings;
+        total.bytes += shard->stats.bytes;
+        total.bytes_saved += shard->stats.bytes_saved;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return total;
+}
+
+/*
+ * A small work-stealing thread pool.
+ *
+ * Each worker owns a deque of tasks: it pops its own from the bottom and
+ * steals from the top of the others when it runs dry.  Threads that are not
+ * workers push to deque 0.  A thread waiting for a task group runs queued
+ * tasks meanwhile, so tasks may submit and wait for subtasks themselves, and
+ * a pool created for one thread simply runs everything in the caller.
+ */
+struct xs_task_group {
+    size_t pending;
+};
+
+struct xs_task {
+    void (*fn)(void *arg);
+    void *arg;
+    struct xs_task_group *group;
+};
+
+struct xs_deque {
+    pthread_mutex_t lock;
+    struct xs_task *tasks;
+    /* tasks[head % capacity] is the top, tasks[(tail - 1) % capacity] the
+     * bottom */
+    size_t head, tail, capacity;
+};
+
+struct xs_pool {
+    int nr_threads;
+    pthread_t *threads;
+    struct xs_deque *deques;
+    size_t next_deque, queued;
+    bool stop;
+    /* signalled when tasks are queued or a task group completes */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* the pool the current thread works for, NULL for non-workers, and the
+ * index of its deque there
+ */
+static __thread struct xs_pool *xs_pool_owner;
+static __thread int xs_pool_self;
+
+/* Deque of the current thread in @pool: a worker of another pool, running
+ * a task that uses this one, is an outsider here and gets deque 0
+ */
+static inline int xs_pool_index(const struct xs_pool *pool)
+{
+    return xs_pool_owner == pool ? xs_pool_self : 0;
+}
+
+static void xs_deque_push(struct xs_deque *dq, const struct xs_task *task)
+{
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail - dq->head == dq->capacity) {
+        size_t capacity = dq->capacity ? dq->capacity * 2 : 64;
+        struct xs_task *tasks = malloc(capacity * sizeof(*tasks));
+        for (size_t i = dq->head; i < dq->tail; i++)
+            tasks[i - dq->head] = dq->tasks[i % dq->capacity];
+        free(dq->tasks);
+        dq->tasks = tasks;
+        dq->tail -= dq->head;
+        dq->head = 0;
+        dq->capacity = capacity;
+    }
+    dq->tasks[dq->tail++ % dq->capacity] = *task;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+static bool xs_deque_pop(struct xs_deque *dq, struct xs_task *task, bool steal)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head != dq->tail) {
+        *task = steal ? dq->tasks[dq->head++ % dq->capacity]
+                      : dq->tasks[--dq->tail % dq->capacity];
+        found = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static bool xs_pool_next_task(struct xs_pool *pool, struct xs_task *task)
+{
+    int self = xs_pool_index(pool);
+
+    if (xs_deque_pop(&pool->deques[self], task, false))
+        goto found;
+    for (int i = 1; i < pool->nr_threads; i++) {
+        if (xs_deque_pop(&pool->deques[(self + i) % pool->nr_threads], task,
+                         true))
+            goto found;
+    }
+    return false;
+
+found:
+    __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+static void xs_pool_run_task(struct xs_pool *pool, struct xs_task *task)
+{
+    task->fn(task->arg);
+    if (!__atomic_sub_fetch(&task->group->pending, 1, __ATOMIC_ACQ_REL)) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+struct xs_pool_worker {
+    struct xs_pool *pool;
+    int id;
+};
+
+static void *xs_pool_worker(void *data)
+{
+    struct xs_pool_worker *w = data;
+    struct xs_pool *pool = w->pool;
+    struct xs_task task;
+
+    xs_pool_owner = pool;
+    xs_pool_self = w->id;
+    free(w);
+
+    for (;;) {
+        if (xs_pool_next_task(pool, &task)) {
+            xs_pool_run_task(pool, &task);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->stop && !__atomic_load_n(&pool->queued, __ATOMIC_RELAXED))
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        bool stop = pool->stop;
+        pthread_mutex_unlock(&pool->lock);
+        if (stop)
+            return NULL;
+    }
+}
+
+/* Stop the workers of @pool, the first @nr_started of its threads, and
+ * free it
+ */
+static void xs_pool_free(struct xs_pool *pool, int nr_started)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 1; i < nr_started; i++)
+        pthread_join(pool->threads[i], NULL);
+    for (int i = 0; i < pool->nr_threads; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+}
+
+/* @nr_threads counts the caller: nr_threads - 1 workers are started.
+ * Returns NULL if they cannot all be had.
+ */
+struct xs_pool *xs_pool_create(int nr_threads)
+{
+    struct xs_pool *pool = calloc(1, sizeof(*pool));
+
+    if (!pool)
+        return NULL;
+    if (nr_threads < 1)
+        nr_threads = 1;
+    pool->nr_threads = nr_threads;
+    pool->threads = calloc(nr_threads, sizeof(pthread_t));
+    pool->deques = calloc(nr_threads, sizeof(struct xs_deque));
+    if (!pool->threads || !pool->deques) {
+        free(pool->threads);
+        free(pool->deques);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    for (int i = 0; i < nr_threads; i++)
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    for (int i = 1; i < nr_threads; i++) {
+        struct xs_pool_worker *w = malloc(sizeof(*w));
+        if (!w) {
+            xs_pool_free(pool, i);
+            return NULL;
+        }
+        w->pool = pool;
+        w->id = i;
+        if (pthread_create(&pool->threads[i], NULL, xs_pool_worker, w)) {
+            free(w);
+            xs_pool_free(pool, i);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+void xs_pool_destroy(struct xs_pool *pool)
+{
+    xs_pool_free(pool, pool->nr_threads);
+}
+
+void xs_pool_submit(struct xs_pool *pool,
+                    struct xs_task_group *group,
+                    void (*fn)(void *),
+                    void *arg)
+{
+    struct xs_task task = {fn, arg, group};
+
+    __atomic_add_fetch(&group->pending, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+    xs_deque_push(&pool->deques[xs_pool_index(pool)], &task);
+
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Wait for every task of @group, running queued tasks meanwhile */
+void xs_pool_wait(struct xs_pool *pool, struct xs_task_group *group)
+{
+    struct xs_task task;
+
+    while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE)) {
+        if (xs_pool_next_task(pool, &task)) {
+            xs_pool_run_task(pool, &task);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) &&
+               !__atomic_load_n(&pool->queued, __ATOMIC_RELAXED))
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/*
+ * Batch operations over arrays of xs, split in chunks across a pool.  Each
+ * element belongs to one chunk only; elements sharing a CoW buffer are safe
+ * to mutate concurrently since the reference count is atomic and
+ * xs_cow_lazy_copy() releases the old buffer only after copying it.
+ * A NULL pool runs the batch in the calling thread.
+ */
+#define XS_BATCH_MIN_CHUNK 256
+
+struct xs_batch {
+    void (*fn)(struct xs_batch *b, size_t begin, size_t end);
+    xs *arr;
+    const void *arg1, *arg2;
+    void *out;
+    /* set by xs_batch_run(): chunk i covers [i * chunk, (i + 1) * chunk) */
+    size_t chunk, nr_chunks;
+};
+
+struct xs_batch_chunk {
+    struct xs_batch *batch;
+    size_t begin, end;
+};
+
+static void xs_batch_chunk_run(void *arg)
+{
+    struct xs_batch_chunk *c = arg;
+    c->batch->fn(c->batch, c->begin, c->end);
+}
+
+static void xs_batch_run(struct xs_pool *pool,
+                         struct xs_batch *b,
+                         size_t n,
+                         size_t min_chunk)
+{
+    struct xs_batch_chunk *chunks = NULL;
+    size_t nr_chunks = 0, chunk = n;
+
+    if (pool && pool->nr_threads > 1 && n > min_chunk) {
+        /* a few chunks per thread leave room for stealing */
+        nr_chunks = pool->nr_threads * 4;
+        chunk = n / nr_chunks + 1;
+        if (chunk < min_chunk)
+            chunk = min_chunk;
+        nr_chunks = (n + chunk - 1) / chunk;
+        chunks = malloc(nr_chunks * sizeof(*chunks));
+    }
+    /* out of memory, the batch is run as one chunk too */
+    if (!chunks) {
+        b->chunk = n;
+        b->nr_chunks = 1;
+        b->fn(b, 0, n);
+        return;
+    }
+    b->chunk = chunk;
+    b->nr_chunks = nr_chunks;
+
+    struct xs_task_group group = {0};
+
+    for (size_t i = 0; i < nr_chunks; i++) {
+        chunks[i].batch = b;
+        chunks[i].begin = i * chunk;
+        chunks[i].end = i * chunk + chunk < n ? i * chunk + chunk : n;
+        xs_pool_submit(pool, &group, xs_batch_chunk_run, &chunks[i]);
+    }
+    xs_pool_wait(pool, &group);
+    free(chunks);
+}
+
+static void xs_batch_trim_fn(struct xs_batch *b, size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; i++)
+        xs_trim(&b->arr[i], b->arg1);
+}
+
+void xs_batch_trim(struct xs_pool *pool, xs *arr, size_t n, const char *trimset)
+{
+    struct xs_batch b = {.fn = xs_batch_trim_fn, .arr = arr, .arg1 = trimset};
+    xs_batch_run(pool, &b, n, XS_BATCH_MIN_CHUNK);
+}
+
+static void xs_batch_concat_fn(struct xs_batch *b, size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; i++)
+        xs_concat(&b->arr[i], b->arg1, b->arg2);
+}
+
+void xs_batch_concat(struct xs_pool *pool,
+                     xs *arr,
+                     size_t n,
+                     const xs *prefix,
+                     const xs *suffix)
+{
+    struct xs_batch b = {
+        .fn = xs_batch_concat_fn, .arr = arr, .arg1 = prefix, .arg2 = suffix};
+    xs_batch_run(pool, &b, n, XS_BATCH_MIN_CHUNK);
+}
+
+static void xs_batch_hash_fn(struct xs_batch *b, size_t begin, size_t end)
+{
+    uint64_t *out = b->out;
+    for (size_t i = begin; i < end; i++)
+        out[i] = xs_hash(&b->arr[i]);
+}
+
+/* out[i] = xs_hash(&arr[i]) */
+void xs_batch_hash(struct xs_pool *pool, xs *arr, size_t n, uint64_t *out)
+{
+    struct xs_batch b = {.fn = xs_batch_hash_fn, .arr = arr, .out = out};
+    xs_batch_run(pool, &b, n, XS_BATCH_MIN_CHUNK);
+}
+
+static void xs_batch_find_fn(struct xs_batch *b, size_t begin, size_t end)
+{
+    size_t *out = b->out;
+    for (size_t i = begin; i < end; i++)
+        out[i] = xs_find(&b->arr[i], b->arg1, 0);
+}
+
+/* out[i] = xs_find(&arr[i], needle, 0) */
+void xs_batch_find(struct xs_pool *pool,
+                   xs *arr,
+                   size_t n,
+                   const xs *needle,
+                   size_t *out)
+{
+    struct xs_batch b = {
+        .fn = xs_batch_find_fn, .arr = arr, .arg1 = needle, .out = out};
+    xs_batch_run(pool, &b, n, XS_BATCH_MIN_CHUNK);
+}
+
+/*
+ * Parallel processing of a single huge string: copies, searches and case
+ * transforms of xs_parallel_threshold bytes or more are split in chunks
+ * across xs_global_pool.
+ */
+#define XS_PARALLEL_MIN_CHUNK (64 * 1024)
+
+/* Use @pool for strings of at least @threshold bytes; NULL turns it off */
+void xs_set_pool(struct xs_pool *pool, size_t threshold)
+{
+    xs_global_pool = pool;
+    xs_parallel_threshold = threshold;
+}
+
+static inline bool xs_parallel(size_t n)
+{
+    return xs_global_pool && xs_global_pool->nr_threads > 1 &&
+           n >= xs_parallel_threshold;
+}
+
+static void xs_memcpy_fn(struct xs_batch *b, size_t begin, size_t end)
+{
+    memcpy((char *) b->out + begin, (const char *) b->arg1 + begin,
+           end - begin);
+}
+
+static void xs_parallel_memcpy(char *dst, const char *src, size_t n)
+{
+    if (!xs_parallel(n)) {
+        memcpy(dst, src, n);
+        return;
+    }
+
+    struct xs_batch b = {.fn = xs_memcpy_fn, .arg1 = src, .out = dst};
+    xs_batch_run(xs_global_pool, &b, n, XS_PARALLEL_MIN_CHUNK);
+}
+
+/* Chunks are ranges of candidate positions, i.e. [0, n - m]; a chunk scans
+ * m - 1 bytes past its end so that matches crossing the boundary are found.
+ */
+struct xs_search {
+    const char *s, *needle;
+    size_t n, m;
+    /* per chunk: first match or match count, end of the last match */
+    size_t *pos, *last_end;
+};
+
+static void xs_find_fn(struct xs_batch *b, size_t begin, size_t end)
+{
+    const struct xs_search *q = b->arg1;
+    size_t pos = xs_find_bytes(q->s + begin, end - begin + q->m - 1,
+                               q->needle, q->m);
+
+    q->pos[begin / b->chunk] = pos == XS_NPOS ? XS_NPOS : begin + pos;
+}
+
+static size_t xs_find_parallel(const char *s,
+                               size_t n,
+                               const char *needle,
+                               size_t m)
+{
+    if (!xs_parallel(n) || !m || m > n)
+        return xs_find_bytes(s, n, needle, m);
+
+    size_t nr = n - m + 1, max_chunks = nr / XS_PARALLEL_MIN_CHUNK + 1;
+    struct xs_search q = {s, needle, n, m, malloc(max_chunks * sizeof(size_t)),
+                          NULL};
+    struct xs_batch b = {.fn = xs_find_fn, .arg1 = &q};
+    size_t pos = XS_NPOS;
+
+    if (!q.pos)
+        return xs_find_bytes(s, n, needle, m);
+    xs_batch_run(xs_global_pool, &b, nr, XS_PARALLEL_MIN_CHUNK);
+    for (size_t i = 0; i < b.nr_chunks && pos == XS_NPOS; i++)
+        pos = q.pos[i];
+    free(q.pos);
+    return pos;
+}
+
+/* Non-overlapping matches starting in [begin, end), scanning from @from */
+static size_t xs_count_range(const struct xs_search *q,
+                             size_t from,
+                             size_t end,
+                             size_t *last_end)
+{
+    size_t count = 0, pos;
+
+    while (from < end &&
+           (pos = xs_find_bytes(q->s + from, end - from + q->m - 1, q->needle,
+                                q->m)) != XS_NPOS) {
+        count++;
+        from += pos + q->m;
+        *last_end = from;
+    }
+    return count;
+}
+
+static void xs_count_fn(struct xs_batch *b, size_t begin, size_t end)
+{
+    const struct xs_search *q = b->arg1;
+    size_t i = begin / b->chunk;
+
+    q->last_end[i] = 0;
+    q->pos[i] = xs_count_range(q, begin, end, &q->last_end[i]);
+}
+
+static size_t xs_count_flat(const xs *x, const xs *needle)
+{
+    struct xs_search q = {xs_data(x), xs_data(needle), xs_size(x),
+                          xs_size(needle), NULL, NULL};
+    size_t count = 0, last_end = 0, nr = q.n - q.m + 1;
+
+    if (!q.m || q.m > q.n)
+        return 0;
+    if (!xs_parallel(q.n))
+        return xs_count_range(&q, 0, nr, &last_end);
+
+    size_t max_chunks = nr / XS_PARALLEL_MIN_CHUNK + 1;
+    struct xs_batch b = {.fn = xs_count_fn, .arg1 = &q};
+
+    q.pos = malloc(max_chunks * sizeof(size_t));
+    q.last_end = malloc(max_chunks * sizeof(size_t));
+    if (!q.pos || !q.last_end) {
+        free(q.pos);
+        free(q.last_end);
+        return xs_count_range(&q, 0, nr, &last_end);
+    }
+    xs_batch_run(xs_global_pool, &b, nr, XS_PARALLEL_MIN_CHUNK);
+
+    /* Each chunk counted from its own start.  When the last match of the
+     * previous chunk runs into it, which only a self-overlapping needle can
+     * do, recount the chunk from where that match ends.
+     */
+    for (size_t i = 0; i < b.nr_chunks; i++) {
+        size_t begin = i * b.chunk, end = begin + b.chunk < nr ? begin + b.chunk
+                                                               : nr;
+        if (last_end > begin) {
+            q.last_end[i] = last_end;
+            q.pos[i] = xs_count_range(&q, last_end, end, &q.last_end[i]);
+        }
+        count += q.pos[i];
+        if (q.last_end[i] > last_end)
+            last_end = q.last_end[i];
+    }
+    free(q.pos);
+    free(q.last_end);
+    return count;
+}
+
+/* Number of non-overlapping occurrences of @needle, 0 for an empty one or
+ * out of memory
+ */
+size_t xs_count(const xs *x, const xs *needle)
+{
+    xs tx, tn;
+    const xs *fx = xs_flat(x, &tx), *fn = xs_flat(needle, &tn);
+    size_t count = fx && fn ? xs_count_flat(fx, fn) : 0;
+
+    xs_free(&tx);
+    xs_free(&tn);
+    return count;
+}
+
+static void xs_case_fn(struct xs_batch *b, size_t begin, size_t end)
+{
+    /* 'A' for lower case, 'a' for upper case */
+    xs_case_flip((char *) b->out + begin, end - begin, *(const char *) b->arg1);
+}
+
+static xs *xs_case_transform(xs *x, char from)
+{
+    if (!xs_expand(x))
+        return NULL;
+
+    char *data = xs_data(x);
+    size_t size = xs_size(x), first = xs_case_scan(data, size, from);
+    struct xs_batch b = {.fn = xs_case_fn, .arg1 = &from};
+
+    /* already in the target case: leave a shared buffer shared */
+    if (first == size)
+        return x;
+
+    xs_cow_lazy_copy(x, &data);
+    b.out = data + first;
+    size -= first;
+    if (xs_parallel(size))
+        xs_batch_run(xs_global_pool, &b, size, XS_PARALLEL_MIN_CHUNK);
+    else
+        b.fn(&b, 0, size);
+    return x;
+}
+
+/* ASCII case conversion in place; other bytes are left alone */
+xs *xs_tolower(xs *x)
+{
+    return xs_case_transform(x, 'A');
+}
+
+xs *xs_toupper(xs *x)
+{
+    return xs_case_transform(x, 'a');
+}
+
+/* Parallel xs_sort(): partitions larger than this become tasks of their own */
+#define XS_SORT_TASK_MIN 16384
+
+struct xs_sort_task {
+    struct xs_pool *pool;
+    struct xs_task_group *group;
+    struct xs_sort_item *items;
+    size_t n, depth;
+    /* the keys are still to be computed for depth */
+    bool rekey;
+};
+
+static void xs_mkqs_task(void *arg);
+
+static void xs_mkqs_spawn(const struct xs_sort_task *parent,
+                          struct xs_sort_item *items,
+                          size_t n,
+                          size_t depth,
+                          bool rekey)
+{
+    struct xs_sort_task *t = n < XS_SORT_TASK_MIN ? NULL : malloc(sizeof(*t));
+
+    /* small partitions, and any a task cannot be had for, are sorted here */
+    if (!t) {
+        if (rekey && n > 1) {
+            for (size_t i = 0; i < n; i++)
+                xs_sort_key(&items[i], depth);
+        }
+        if (!rekey || n > 1)
+            xs_mkqs(items, n, depth);
+        return;
+    }
+
+    *t = *parent;
+    t->items = items;
+    t->n = n;
+    t->depth = depth;
+    t->rekey = rekey;
+    xs_pool_submit(t->pool, t->group, xs_mkqs_task, t);
+}
+
+/* One partitioning step of xs_mkqs(), forking the three ranges */
+static void xs_mkqs_task(void *arg)
+{
+    struct xs_sort_task *t = arg;
+    struct xs_sort_item *items = t->items;
+    size_t n = t->n, lt = 0, i = 1, gt = n;
+
+    if (t->rekey) {
+        for (i = 0; i < n; i++)
+            xs_sort_key(&items[i], t->depth);
+        i = 1;
+    }
+
+    xs_sort_swap(&items[0], &items[n / 2]);
+    while (i < gt) {
+        int r = xs_sort_key_cmp(&items[i], &items[lt]);
+        if (r < 0)
+            xs_sort_swap(&items[lt++], &items[i++]);
+        else if (r > 0)
+            xs_sort_swap(&items[i], &items[--gt]);
+        else
+            i++;
+    }
+
+    xs_mkqs_spawn(t, items, lt, t->depth, false);
+    if (items[lt].len == 8)
+        xs_mkqs_spawn(t, items + lt, gt - lt, t->depth + 8, true);
+    xs_mkqs_spawn(t, items + gt, n - gt, t->depth, false);
+    free(t);
+}
+
+/* xs_sort() forking the large partitions to @pool; returns false, leaving
+ * @arr in its order, if it is out of memory
+ */
+bool xs_batch_sort(struct xs_pool *pool, xs *arr, size_t n)
+{
+    if (!pool || pool->nr_threads == 1 || n < XS_SORT_TASK_MIN)
+        return xs_sort(arr, n);
+
+    for (size_t i = 0; i < n; i++)
+        if (!xs_expand(&arr[i]))
+            return false;
+
+    struct xs_sort_item *items = malloc(n * sizeof(*items));
+    struct xs_task_group group = {0};
+    struct xs_sort_task root = {pool, &group, items, n, 0, true};
+
+    if (!items)
+        return false;
+    for (size_t i = 0; i < n; i++)
+        items[i].str = arr[i];
+    xs_mkqs_spawn(&root, items, n, 0, true);
+    xs_pool_wait(pool, &group);
+    for (size_t i = 0; i < n; i++)
+        arr[i] = items[i].str;
+    free(items);
+    return true;
+}
+
+/*
+ * Bulk output.  xs_writev() hands the strings to writev() in place, up to
+ * XS_IOV_MAX at a time, without gathering them into one buffer first.
+ */
+#define XS_IOV_MAX 1024
+
+/* Write @iov but its first @skip bytes, resuming after short writes.  The
+ * array is consumed on the way.  Returns 0 or -errno.
+ */
+static int xs_write_iov(int fd, struct iovec *iov, int n, size_t skip)
+{
+    for (;;) {
+        /* drop what is already out */
+        while (n > 0 && skip >= iov->iov_len) {
+            skip -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (!n)
+            return 0;
+        iov->iov_base = (char *) iov->iov_base + skip;
+        iov->iov_len -= skip;
+
+        ssize_t done = writev(fd, iov, n);
+        if (done < 0 && errno != EINTR)
+            return -errno;
+        skip = done < 0 ? 0 : done;
+    }
+}
+
+/* Write the contents of @n strings to @fd back to back.  Returns the number
+ * of bytes written, or -1 with errno set, in which case an unknown part of
+ * the output went out.
+ */
+ssize_t xs_writev(int fd, const xs *arr, size_t n)
+{
+    struct iovec iov[XS_IOV_MAX];
+    size_t total = 0;
+
+    for (size_t i = 0; i < n;) {
+        xs tmp = xs_literal_empty();
+        int nr = 0;
+        for (; i < n && nr < XS_IOV_MAX; i++) {
+            size_t size = xs_size(&arr[i]);
+            if (!size)
+                continue;
+            /* a string in another form ends its batch, from a flat copy */
+            const xs *x = xs_flat(&arr[i], &tmp);
+            if (!x) {
+                errno = ENOMEM;
+                return -1;
+            }
+            iov[nr].iov_base = xs_data(x);
+            iov[nr++].iov_len = size;
+            total += size;
+            if (x == &tmp) {
+                i++;
+                break;
+            }
+        }
+
+        int err = xs_write_iov(fd, iov, nr, 0);
+        xs_free(&tmp);
+        if (err) {
+            errno = -err;
+            return -1;
+        }
+    }
+    return total;
+}
+
+#ifdef XS_HAVE_IO_URING
+/*
+ * Minimal io_uring plumbing on the raw system calls: one submission and one
+ * completion ring, no SQ polling.
+ */
+struct xs_uring {
+    int fd;
+    unsigned entries, sqe_tail;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+};
+
+static void xs_uring_exit(struct xs_uring *r)
+{
+    if (r->sqes && r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+    if (r->cq_ring && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_size);
+    if (r->sq_ring && r->sq_ring != MAP_FAILED)
+        munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+}
+
+/* Returns 0 or -errno; the rings must support reading and writing at the
+ * current file position (Linux 5.6)
+ */
+static int xs_uring_init(struct xs_uring *r, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return -errno;
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        close(r->fd);
+        return -ENOSYS;
+    }
+
+    r->entries = p.sq_entries;
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size)
+            r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED)
+        goto fail;
+    r->cq_ring = r->sq_ring;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        r->cq_ring =
+            mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED)
+            goto fail;
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                   IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto fail;
+
+    r->sq_head = (unsigned *) ((char *) r->sq_ring + p.sq_off.head);
+    r->sq_tail = (unsigned *) ((char *) r->sq_ring + p.sq_off.tail);
+    r->sq_mask = (unsigned *) ((char *) r->sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) ((char *) r->sq_ring + p.sq_off.array);
+    r->cq_head = (unsigned *) ((char *) r->cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned *) ((char *) r->cq_ring + p.cq_off.tail);
+    r->cq_mask = (unsigned *) ((char *) r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((char *) r->cq_ring + p.cq_off.cqes);
+    r->sqe_tail = *r->sq_tail;
+    return 0;
+
+fail:
+    xs_uring_exit(r);
+    return -ENOMEM;
+}
+
+/* A cleared SQE, submitted with the next xs_uring_enter(); the caller makes
+ * sure no more than @entries are in flight
+ */
+static struct io_uring_sqe *xs_uring_sqe(struct xs_uring *r)
+{
+    unsigned idx = r->sqe_tail++ & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    return sqe;
+}
+
+/* Submit the new SQEs and wait for @wait_nr completions */
+static int xs_uring_enter(struct xs_uring *r, unsigned wait_nr)
+{
+    unsigned submit = r->sqe_tail - *r->sq_tail;
+    int ret;
+
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    do {
+        ret = syscall(__NR_io_uring_enter, r->fd, submit, wait_nr,
+                      wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret < 0 ? -errno : 0;
+}
+
+static bool xs_uring_cqe(struct xs_uring *r, struct io_uring_cqe *cqe)
+{
+    unsigned head = *r->cq_head;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return false;
+    *cqe = r->cqes[head & *r->cq_mask];
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+#endif
+
+/*
+ * xs_writer: asynchronous bulk output.  Strings are gathered into batches of
+ * up to XS_IOV_MAX and each batch becomes one IORING_OP_WRITEV.  Queued
+ * batches go out together as a linked chain, so they reach the file, pipe or
+ * socket in order, while the caller fills the next ones.
+ *
+ * Large strings are pinned by a reference until their batch completes and
+ * small ones are copied into the batch, so the caller may change or free
+ * those right away.  Medium strings, and borrowed ones such as xs_static()
+ * constants, archive strings or xs_new_batch() strings, are written from
+ * where they are: their bytes must stay as they are, and the mapping or slab
+ * they borrow must stay alive, until xs_writer_flush() returns.  Without
+ * io_uring each batch is written with writev() once full.
+ */
+#define XS_WRITER_DEPTH 8
+
+struct xs_write_batch {
+    struct iovec iov[XS_IOV_MAX];
+    xs pin[XS_IOV_MAX];
+    int nr, res;
+    size_t bytes;
+};
+
+struct xs_writer {
+    int fd, error;
+    struct xs_write_batch *batches;
+    /* batches [head, head + inflight) are submitted, the next @queued wait
+     * for that chain to finish and the one after them is being filled
+     */
+    unsigned head, inflight, queued, completed;
+    /* system calls made, for the curious */
+    size_t syscalls;
+#ifdef XS_HAVE_IO_URING
+    bool uring;
+    struct xs_uring ring;
+#endif
+};
+
+static inline struct xs_write_batch *xs_writer_batch(struct xs_writer *w,
+                                                     unsigned i)
+{
+    return &w->batches[(w->head + i) % XS_WRITER_DEPTH];
+}
+
+/* Finish @b without io_uring, @done bytes being out already, and unpin it */
+static void xs_writer_finish(struct xs_writer *w,
+                             struct xs_write_batch *b,
+                             size_t done)
+{
+    if (!w->error && done < b->bytes) {
+        w->error = -xs_write_iov(w->fd, b->iov, b->nr, done);
+        w->syscalls++;
+    }
+    for (int i = 0; i < b->nr; i++)
+        xs_free(&b->pin[i]);
+    b->nr = 0;
+    b->bytes = 0;
+}
+
+#ifdef XS_HAVE_IO_URING
+/* Collect the chain in flight, if complete or when asked to @wait for it */
+static void xs_writer_reap(struct xs_writer *w, bool wait)
+{
+    struct io_uring_cqe cqe;
+
+    while (w->completed < w->inflight) {
+        if (xs_uring_cqe(&w->ring, &cqe)) {
+            w->batches[cqe.user_data].res = cqe.res;
+            w->completed++;
+        } else if (!wait) {
+            return;
+        } else {
+            xs_uring_enter(&w->ring, 1);
+            w->syscalls++;
+        }
+    }
+
+    /* a short write cancels the rest of the chain: complete it in order */
+    for (unsigned i = 0; i < w->inflight; i++) {
+        struct xs_write_batch *b = xs_writer_batch(w, i);
+        if (b->res < 0 && b->res != -ECANCELED && b->res != -EAGAIN &&
+            b->res != -EINTR && !w->error)
+            w->error = -b->res;
+        xs_writer_finish(w, b, b->res < 0 ? 0 : b->res);
+    }
+    w->head = (w->head + w->inflight) % XS_WRITER_DEPTH;
+    w->inflight = 0;
+    w->completed = 0;
+}
+
+/* Send the queued batches as one chain; nothing may be in flight */
+static void xs_writer_submit(struct xs_writer *w)
+{
+    for (unsigned i = 0; i < w->queued; i++) {
+        struct xs_write_batch *b = xs_writer_batch(w, i);
+        struct io_uring_sqe *sqe = xs_uring_sqe(&w->ring);
+
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = w->fd;
+        sqe->addr = (uintptr_t) b->iov;
+        sqe->len = b->nr;
+        sqe->off = (uint64_t) -1;
+        sqe->user_data = b - w->batches;
+        if (i + 1 < w->queued)
+            sqe->flags = IOSQE_IO_LINK;
+        b->res = -ECANCELED;
+    }
+    w->inflight = w->queued;
+    w->queued = 0;
+    w->syscalls++;
+    if (xs_uring_enter(&w->ring, 0)) {
+        /* nothing went out: write it all the slow way */
+        w->completed = w->inflight;
+        w->uring = false;
+        xs_writer_reap(w, false);
+    }
+}
+#endif
+
+/* Write the queued batches one by one, or after an error just unpin them;
+ * nothing may be in flight
+ */
+static void xs_writer_finish_queued(struct xs_writer *w)
+{
+    for (; w->queued; w->queued--) {
+        xs_writer_finish(w, xs_writer_batch(w, 0), 0);
+        w->head = (w->head + 1) % XS_WRITER_DEPTH;
+    }
+}
+
+/* The batch being filled is complete */
+static void xs_writer_push(struct xs_writer *w)
+{
+    w->queued++;
+#ifdef XS_HAVE_IO_URING
+    if (w->uring) {
+        xs_writer_reap(w, false);
+        /* keep a free batch to fill */
+        if (w->inflight + w->queued == XS_WRITER_DEPTH)
+            xs_writer_reap(w, true);
+        if (!w->error) {
+            if (!w->inflight)
+                xs_writer_submit(w);
+            return;
+        }
+        /* nothing more goes out, but the kernel may still be using the
+         * chain in flight: collect it before its strings are let go
+         */
+        xs_writer_reap(w, true);
+    }
+#endif
+    xs_writer_finish_queued(w);
+}
+
+/* Returns NULL when out of memory */
+struct xs_writer *xs_writer_create(int fd)
+{
+    struct xs_writer *w = calloc(1, sizeof(*w));
+
+    if (!w)
+        return NULL;
+    w->fd = fd;
+    w->batches = calloc(XS_WRITER_DEPTH, sizeof(*w->batches));
+    if (!w->batches) {
+        free(w);
+        return NULL;
+    }
+#ifdef XS_HAVE_IO_URING
+    w->uring = !xs_uring_init(&w->ring, XS_WRITER_DEPTH);
+#endif
+    return w;
+}
+
+/* Queue the contents of @n strings.  Returns 0, or the errno value of the
+ * first failed write, after which nothing more is written, or ENOMEM if a
+ * string held in another form cannot be expanded.
+ */
+int xs_writer_add(struct xs_writer *w, const xs *arr, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        struct xs_write_batch *b = xs_writer_batch(w, w->inflight + w->queued);
+        size_t size = xs_size(&arr[i]);
+
+        if (!size)
+            continue;
+        const xs *x = &arr[i];
+        b->pin[b->nr] = xs_literal_empty();
+        if (!xs_is_ptr(x) || (xs_is_large_string(x) && !x->is_borrowed)) {
+            xs_copy(&b->pin[b->nr], (xs *) x);
+            x = &b->pin[b->nr];
+            /* a string in another form is written from a flat copy */
+            if (!xs_expand(&b->pin[b->nr])) {
+                xs_free(&b->pin[b->nr]);
+                return ENOMEM;
+            }
+        }
+        b->iov[b->nr].iov_base = xs_data(x);
+        b->iov[b->nr].iov_len = size;
+        b->bytes += size;
+        if (++b->nr == XS_IOV_MAX)
+            xs_writer_push(w);
+    }
+    return w->error;
+}
+
+/* Wait until everything queued is written; returns like xs_writer_add() */
+int xs_writer_flush(struct xs_writer *w)
+{
+    if (xs_writer_batch(w, w->inflight + w->queued)->nr)
+        xs_writer_push(w);
+#ifdef XS_HAVE_IO_URING
+    while (w->inflight || w->queued) {
+        if (w->inflight)
+            xs_writer_reap(w, true);
+        if (w->queued && !w->error)
+            xs_writer_submit(w);
+        else
+            xs_writer_finish_queued(w);
+    }
+#endif
+    return w->error;
+}
+
+/* Flush and free @w; returns like xs_writer_add() */
+int xs_writer_destroy(struct xs_writer *w)
+{
+    int err = xs_writer_flush(w);
+
+#ifdef XS_HAVE_IO_URING
+    if (w->uring)
+        xs_uring_exit(&w->ring);
+#endif
+    free(w->batches);
+    free(w);
+    return err;
+}
+
+/*
+ * Bulk input.  Files are read whole, straight into a buffer sized once from
+ * fstat() with xs_grow(), so anything of LARGE_STRING_LEN or more comes back
+ * as a reference-counted large string like any other.
+ */
+#define XS_READ_CHUNK (1 << 30)
+
+/* Read the rest of @fd into @x, up to @size bytes in all; files that do not
+ * know their size (procfs, pipes) say 0 and are read until EOF.  Returns 0
+ * or an errno value.
+ */
+static int xs_read_fd(xs *x, int fd, size_t size)
+{
+    size_t done = xs_size(x);
+
+    while (!size || done < size) {
+        size_t room = size ? size - done : done + 4096;
+        char *p = xs_append_space(x, room);
+        if (!p)
+            return ENOMEM;
+
+        ssize_t ret = read(fd, p, room < XS_READ_CHUNK ? room : XS_READ_CHUNK);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return ret < 0 ? errno : 0;
+        done += ret;
+        xs_set_size(x, done);
+    }
+    return 0;
+}
+
+/* Open @path and size @x for it, dropping what @x held; returns the
+ * descriptor or -errno, leaving @x as it was, or empty if it is out of
+ * memory
+ */
+static int xs_open_sized(xs *x, const char *path, size_t *size)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -errno;
+    if (fstat(fd, &st) < 0) {
+        int err = errno;
+        close(fd);
+        return -err;
+    }
+    *size = S_ISREG(st.st_mode) ? (size_t) st.st_size : 0;
+    xs_free(x);
+    if (!xs_grow(x, *size)) {
+        close(fd);
+        return -ENOMEM;
+    }
+    return fd;
+}
+
+/* Replace @x with the contents of the file at @path; @x must hold a string
+ * already, which is freed.  Returns 0 or an errno value, leaving @x empty.
+ */
+int xs_read_file(xs *x, const char *path)
+{
+    size_t size;
+    int fd = xs_open_sized(x, path, &size), err;
+
+    if (fd < 0) {
+        xs_free(x);
+        return -fd;
+    }
+    err = xs_read_fd(x, fd, size);
+    close(fd);
+    if (err)
+        xs_free(x);
+    return err;
+}
+
+#ifdef XS_HAVE_IO_URING
+#define XS_READER_DEPTH 64
+
+struct xs_read_req {
+    size_t idx, size, done;
+    int fd;
+};
+
+/* Queue the next piece of @req */
+static void xs_read_submit(struct xs_uring *r,
+                           xs *out,
+                           struct xs_read_req *req,
+                           unsigned slot)
+{
+    struct io_uring_sqe *sqe = xs_uring_sqe(r);
+    size_t len = req->size - req->done;
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = req->fd;
+    sqe->addr = (uintptr_t) (xs_data(&out[req->idx]) + req->done);
+    sqe->len = len < XS_READ_CHUNK ? len : XS_READ_CHUNK;
+    sqe->off = req->done;
+    sqe->user_data = slot;
+}
+
+/* xs_read_files() on a ring: up to XS_READER_DEPTH files are open and being
+ * read at a time, each with one request in flight
+ */
+static size_t xs_read_files_uring(struct xs_uring *r,
+                                  xs *out,
+                                  const char *const *paths,
+                                  size_t n,
+                                  int *err)
+{
+    struct xs_read_req reqs[XS_READER_DEPTH];
+    unsigned free_slots[XS_READER_DEPTH], nr_free = 0;
+    size_t next = 0, inflight = 0, ok = 0;
+
+    for (unsigned i = 0; i < XS_READER_DEPTH && i < r->entries; i++)
+        free_slots[nr_free++] = i;
+
+    while (next < n || inflight) {
+        for (; next < n && nr_free; next++) {
+            struct xs_read_req *req = &reqs[free_slots[nr_free - 1]];
+            int fd = xs_open_sized(&out[next], paths[next], &req->size), e;
+
+            if (fd < 0) {
+                xs_free(&out[next]);
+                e = -fd;
+            } else if (!req->size) {
+                /* nothing to read ahead of: do it here */
+                e = xs_read_fd(&out[next], fd, 0);
+                close(fd);
+                if (e)
+                    xs_free(&out[next]);
+            } else {
+                req->idx = next;
+                req->done = 0;
+                req->fd = fd;
+                xs_read_submit(r, out, req, free_slots[--nr_free]);
+                inflight++;
+                continue;
+            }
+            if (err)
+                err[next] = e;
+            ok += !e;
+        }
+
+        /* all done without the ring: there is no completion to wait for */
+        if (!inflight || xs_uring_enter(r, 1))
+            continue;
+
+        struct io_uring_cqe cqe;
+        while (xs_uring_cqe(r, &cqe)) {
+            struct xs_read_req *req = &reqs[cqe.user_data];
+            xs *x = &out[req->idx];
+            int e = 0;
+
+            if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+                xs_read_submit(r, out, req, cqe.user_data);
+                continue;
+            }
+            if (cqe.res < 0) {
+                e = -cqe.res;
+            } else if (cqe.res > 0) {
+                req->done += cqe.res;
+                if (req->done < req->size) {
+                    xs_read_submit(r, out, req, cqe.user_data);
+                    continue;
+                }
+            }
+            /* at the size fstat() gave, or short of it if the file shrank */
+            close(req->fd);
+            if (e)
+                xs_free(x);
+            else
+                xs_set_size(x, req->done);
+            if (err)
+                err[req->idx] = e;
+            ok += !e;
+            free_slots[nr_free++] = cqe.user_data;
+            inflight--;
+        }
+    }
+    return ok;
+}
+#endif
+
+/* Read the files at @paths[0..n) into @out, concurrently through io_uring
+ * when available; like xs_read_file(), the strings in @out are replaced and
+ * must have been initialized.  Returns how many were read; the others are left empty
+ * and, if @err is not NULL, @err[i] is 0 or the errno value for each file.
+ */
+size_t xs_read_files(xs *out, const char *const *paths, size_t n, int *err)
+{
+    size_t ok = 0;
+
+#ifdef XS_HAVE_IO_URING
+    struct xs_uring ring;
+
+    if (n > 1 && !xs_uring_init(&ring, XS_READER_DEPTH)) {
+        ok = xs_read_files_uring(&ring, out, paths, n, err);
+        xs_uring_exit(&ring);
+        return ok;
+    }
+#endif
+    for (size_t i = 0; i < n; i++) {
+        int e = xs_read_file(&out[i], paths[i]);
+        if (err)
+            err[i] = e;
+        ok += !e;
+    }
+    return ok;
+}
+
+/*
+ * On-disk string arrays.  The file is a header, an index of n + 1 offsets
+ * and a blob holding the strings back to back, each followed by a NUL:
+ * string i spans [offsets[i], offsets[i + 1] - 1) of the blob.  The loader
+ * maps the file and hands out strings borrowing the mapping, so nothing is
+ * read or copied before it is used; changing one copies it first, as for
+ * any borrowed string.  Numbers are in host byte order.
+ */
+#define XS_ARCHIVE_MAGIC "xsarchv1"
+
+struct xs_archive_header {
+    char magic[8];
+    uint64_t n, blob_size;
+};
+
+struct xs_archive {
+    void *map;
+    size_t map_size, n, blob_size;
+    const uint64_t *offsets;
+    const char *blob;
+};
+
+static int xs_write_all(int fd, const void *p, size_t len)
+{
+    struct iovec iov = {.iov_base = (void *) p, .iov_len = len};
+    return xs_write_iov(fd, &iov, 1, 0);
+}
+
+/* Write @n strings to a new file at @path; returns 0 or an errno value */
+int xs_save(const char *path, const xs *arr, size_t n)
+{
+    struct xs_archive_header h = {.magic = XS_ARCHIVE_MAGIC, .n = n};
+    uint64_t *offsets = malloc((n + 1) * sizeof(*offsets));
+    struct iovec iov[XS_IOV_MAX];
+    int fd, err = 0;
+
+    if (!offsets)
+        return ENOMEM;
+    offsets[0] = 0;
+    for (size_t i = 0; i < n; i++)
+        offsets[i + 1] = offsets[i] + xs_size(&arr[i]) + 1;
+    h.blob_size = offsets[n];
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        free(offsets);
+        return errno;
+    }
+    err = -xs_write_all(fd, &h, sizeof(h));
+    if (!err)
+        err = -xs_write_all(fd, offsets, (n + 1) * sizeof(*offsets));
+
+    /* the NUL each string ends with goes along; a string in another form
+     * ends its batch, written from a flat copy
+     */
+    for (size_t i = 0; i < n && !err;) {
+        xs tmp = xs_literal_empty();
+        int nr = 0;
+        while (i < n && nr < XS_IOV_MAX) {
+            const xs *x = xs_flat(&arr[i++], &tmp);
+            if (!x) {
+                err = ENOMEM;
+                break;
+            }
+            iov[nr].iov_base = xs_data(x);
+            iov[nr++].iov_len = xs_size(x) + 1;
+            if (x == &tmp)
+                break;
+        }
+        if (!err)
+            err = -xs_write_iov(fd, iov, nr, 0);
+        xs_free(&tmp);
+    }
+    if (close(fd) < 0 && !err)
+        err = errno;
+    free(offsets);
+    return err;
+}
+
+/* Map the file at @path; returns 0, an errno value, or EINVAL if it is not
+ * an intact archive
+ */
+int xs_archive_open(struct xs_archive *a, const char *path)
+{
+    struct xs_archive_header h;
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC), err = EINVAL;
+
+    memset(a, 0, sizeof(*a));
+    if (fd < 0)
+        return errno;
+    if (fstat(fd, &st) < 0 || pread(fd, &h, sizeof(h), 0) != sizeof(h))
+        goto out;
+    if (memcmp(h.magic, XS_ARCHIVE_MAGIC, sizeof(h.magic)) ||
+        h.n >= (SIZE_MAX - sizeof(h)) / sizeof(uint64_t) - 1)
+        goto out;
+    /* no sum of header fields: a huge one would wrap around */
+    uint64_t offset = sizeof(h) + (h.n + 1) * sizeof(uint64_t);
+    if (offset > (uint64_t) st.st_size ||
+        h.blob_size != (uint64_t) st.st_size - offset)
+        goto out;
+
+    a->map_size = st.st_size;
+    a->map = mmap(NULL, a->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (a->map == MAP_FAILED) {
+        err = errno;
+        a->map = NULL;
+        goto out;
+    }
+    a->n = h.n;
+    a->blob_size = h.blob_size;
+    a->offsets = (const uint64_t *) ((char *) a->map + sizeof(h));
+    a->blob = (const char *) (a->offsets + h.n + 1);
+    err = 0;
+out:
+    close(fd);
+    return err;
+}
+
+/* Unmap @a; no string taken from it may be used any more */
+void xs_archive_close(struct xs_archive *a)
+{
+    if (a->map)
+        munmap(a->map, a->map_size);
+    memset(a, 0, sizeof(*a));
+}
+
+/* String @i of @a, copied inline if short and borrowed from the mapping
+ * otherwise.  Nothing is checked up front, so that opening costs the same
+ * for any size: a string whose index entry or NUL is damaged comes out
+ * empty.
+ */
+xs *xs_archive_get(const struct xs_archive *a, size_t i, xs *x)
+{
+    uint64_t start = a->offsets[i], end = a->offsets[i + 1];
+    const char *p = a->blob + start;
+    size_t len = end - start - 1;
+
+    *x = xs_literal_empty();
+    if (end <= start || end > a->blob_size || p[len])
+        return x;
+    if (len <= XS_INLINE_MAX) {
+        memcpy(x->data, p, len + 1);
+        x->space_left = XS_INLINE_MAX - len;
+        return x;
+    }
+    x->is_ptr = true;
+    x->is_borrowed = true;
+    x->capacity = ilog2(len) + 1;
+    x->size = len;
+    x->ptr = (char *) p;
+    return x;
+}
+
+/* All strings of @a at once, into @out[0..a->n) */
+void xs_archive_load(const struct xs_archive *a, xs *out)
+{
+    for (size_t i = 0; i < a->n; i++)
+        xs_archive_get(a, i, &out[i]);
+}
+
+/*
+ * Front-coded dictionary: an immutable, sorted set of strings stored in
+ * buckets of XS_FCDICT_BUCKET.  The first key of a bucket is kept whole
+ * (length, bytes); every other one as the length of the prefix it shares
+ * with the key before it, then the length and bytes of the rest.  Lengths
+ * are LEB128 varints.  Sorted URLs or paths shrink to a fraction of their
+ * size, and a lookup is a binary search over the bucket heads followed by
+ * a scan of one bucket.
+ */
+#define XS_FCDICT_BUCKET 16
+
+struct xs_fcdict {
+    uint8_t *data;
+    size_t *buckets; /* offset of each bucket in @data */
+    size_t n, nr_buckets, size;
+};
+
+static inline uint8_t *xs_varint_put(uint8_t *p, size_t v)
+{
+    for (; v >= 0x80; v >>= 7)
+        *p++ = v | 0x80;
+    *p++ = v;
+    return p;
+}
+
+static inline const uint8_t *xs_varint_get(const uint8_t *p, size_t *v)
+{
+    size_t r = 0;
+
+    for (int shift = 0;; shift += 7) {
+        r |= (size_t) (*p & 0x7f) << shift;
+        if (!(*p++ & 0x80))
+            break;
+    }
+    *v = r;
+    return p;
+}
+
+/* Build @d from @n strings sorted by xs_cmp().  Returns 0, ENOMEM, or EINVAL
+ * if they are out of order.
+ */
+int xs_fcdict_build(struct xs_fcdict *d, const xs *sorted, size_t n)
+{
+    size_t bound = 0;
+
+    memset(d, 0, sizeof(*d));
+    for (size_t i = 0; i < n; i++)
+        bound += xs_size(&sorted[i]) + 20;
+    d->n = n;
+    d->nr_buckets = (n + XS_FCDICT_BUCKET - 1) / XS_FCDICT_BUCKET;
+    d->data = malloc(bound ? bound : 1);
+    d->buckets = malloc((d->nr_buckets + 1) * sizeof(*d->buckets));
+    if (!d->data || !d->buckets) {
+        free(d->data);
+        free(d->buckets);
+        memset(d, 0, sizeof(*d));
+        return ENOMEM;
+    }
+
+    uint8_t *p = d->data;
+    /* flat copies of keys in another form, the previous one kept */
+    xs tmp[2] = {xs_literal_empty(), xs_literal_empty()};
+    const xs *prev = NULL;
+    int err = 0;
+    for (size_t i = 0; i < n; i++) {
+        xs_free(&tmp[i & 1]);
+        const xs *x = xs_flat(&sorted[i], &tmp[i & 1]);
+        size_t len = xs_size(&sorted[i]), lcp = 0;
+
+        if (!x || (prev && xs_cmp(prev, x) > 0)) {
+            err = x ? EINVAL : ENOMEM;
+            break;
+        }
+        if (i % XS_FCDICT_BUCKET == 0) {
+            d->buckets[i / XS_FCDICT_BUCKET] = p - d->data;
+        } else {
+            size_t plen = xs_size(prev);
+            lcp = xs_mismatch(xs_data(prev), xs_data(x),
+                              plen < len ? plen : len);
+            p = xs_varint_put(p, lcp);
+        }
+        p = xs_varint_put(p, len - lcp);
+        memcpy(p, xs_data(x) + lcp, len - lcp);
+        p += len - lcp;
+        prev = x;
+    }
+    xs_free(&tmp[0]);
+    xs_free(&tmp[1]);
+    if (err) {
+        free(d->data);
+        free(d->buckets);
+        memset(d, 0, sizeof(*d));
+        return err;
+    }
+    d->size = p - d->data;
+    d->buckets[d->nr_buckets] = d->size;
+
+    uint8_t *shrunk = realloc(d->data, d->size ? d->size : 1);
+    if (shrunk)
+        d->data = shrunk;
+    return 0;
+}
+
+void xs_fcdict_free(struct xs_fcdict *d)
+{
+    free(d->data);
+    free(d->buckets);
+    memset(d, 0, sizeof(*d));
+}
+
+/* Bytes held by @d */
+size_t xs_fcdict_memory(const struct xs_fcdict *d)
+{
+    return sizeof(*d) + d->size + (d->nr_buckets + 1) * sizeof(*d->buckets);
+}
+
+/* memcmp() order, then the shorter first, as xs_cmp() */
+static int xs_fcdict_cmp(const uint8_t *a, size_t alen, const char *b,
+                         size_t blen)
+{
+    size_t n = alen < blen ? alen : blen;
+    size_t i = xs_mismatch((const char *) a, b, n);
+
+    if (i < n)
+        return (int) a[i] - (int) (uint8_t) b[i];
+    return (alen > blen) - (alen < blen);
+}
+
+static int xs_fcdict_head_cmp(const struct xs_fcdict *d,
+                              size_t b,
+                              const char *key,
+                              size_t klen)
+{
+    size_t len;
+    const uint8_t *p = xs_varint_get(d->data + d->buckets[b], &len);
+
+    return xs_fcdict_cmp(p, len, key, klen);
+}
+
+/* Ordinal of the first key not less than @key[0..klen); *@found tells
+ * whether it is equal.  Keys are compared as they are decoded, without
+ * rebuilding them: after the bucket head, only how far each one agrees with
+ * @key matters.
+ */
+static size_t xs_fcdict_lower_bound(const struct xs_fcdict *d,
+                                    const char *key,
+                                    size_t klen,
+                                    bool *found)
+{
+    size_t lo = 0, hi = d->nr_buckets, len, lcp;
+    const uint8_t *p;
+
+    *found = false;
+    /* last bucket whose head is below @key */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (xs_fcdict_head_cmp(d, mid, key, klen) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (!lo) {
+        *found = d->n && !xs_fcdict_head_cmp(d, 0, key, klen);
+        return 0;
+    }
+
+    size_t b = lo - 1, i = b * XS_FCDICT_BUCKET, matched;
+    const uint8_t *end = d->data + d->buckets[b + 1];
+
+    p = xs_varint_get(d->data + d->buckets[b], &len);
+    matched = xs_mismatch((const char *) p, key, len < klen ? len : klen);
+    p += len;
+
+    /* invariant: key i is below @key and shares @matched bytes with it */
+    for (i++; p < end; i++) {
+        p = xs_varint_get(p, &lcp);
+        p = xs_varint_get(p, &len);
+        if (lcp > matched) {
+            /* diverges from @key where key i - 1 did: still below */
+            p += len;
+            continue;
+        }
+        if (lcp < matched)
+            return i; /* above where key i - 1 matched @key */
+
+        size_t rest = klen - matched, n = len < rest ? len : rest;
+        size_t c = xs_mismatch((const char *) p, key + matched, n);
+        if (c == n) {
+            if (len == rest) {
+                *found = true;
+                return i;
+            }
+            if (len > rest)
+                return i; /* @key is a prefix of it */
+        } else if (p[c] > (uint8_t) key[matched + c]) {
+            return i;
+        }
+        matched += c;
+        p += len;
+    }
+    /* the head of the next bucket, if any, is not below @key */
+    *found = lo < d->nr_buckets && !xs_fcdict_head_cmp(d, lo, key, klen);
+    return i;
+}
+
+/* Find @key; returns whether it is there and, if so, its ordinal */
+bool xs_fcdict_find(const struct xs_fcdict *d, const xs *key, size_t *ordinal)
+{
+    xs tmp;
+    const xs *flat = xs_flat(key, &tmp);
+    bool found = false;
+    size_t i = 0;
+
+    if (flat)
+        i = xs_fcdict_lower_bound(d, xs_data(flat), xs_size(flat), &found);
+    xs_free(&tmp);
+    if (found && ordinal)
+        *ordinal = i;
+    return found;
+}
+
+/* Rebuild the keys in @x, from the head of the bucket holding @from on, and
+ * hand @fn each one from @from on while it returns true
+ */
+static void xs_fcdict_walk(const struct xs_fcdict *d,
+                           size_t from,
+                           xs *x,
+                           bool (*fn)(const xs *key, size_t i, void *arg),
+                           void *arg)
+{
+    const uint8_t *p = NULL;
+    size_t lcp = 0, len;
+
+    for (size_t i = from - from % XS_FCDICT_BUCKET; i < d->n; i++) {
+        if (i % XS_FCDICT_BUCKET == 0) {
+            p = d->data + d->buckets[i / XS_FCDICT_BUCKET];
+            lcp = 0;
+        } else {
+            p = xs_varint_get(p, &lcp);
+        }
+        p = xs_varint_get(p, &len);
+        xs_set_size(x, lcp);
+        memcpy(xs_append_space(x, len), p, len);
+        xs_set_size(x, lcp + len);
+        p += len;
+        if (i >= from && !fn(x, i, arg))
+            return;
+    }
+}
+
+static bool xs_fcdict_stop(const xs *key, size_t i, void *arg)
+{
+    (void) key, (void) i, (void) arg;
+    return false;
+}
+
+/* Key @i, built afresh in @x; @i must be below @d->n */
+xs *xs_fcdict_get(const struct xs_fcdict *d, size_t i, xs *x)
+{
+    xs_newempty(x);
+    xs_fcdict_walk(d, i, x, xs_fcdict_stop, NULL);
+    return x;
+}
+
+struct xs_fcdict_prefix_walk {
+    const char *prefix;
+    size_t len, count;
+    bool (*fn)(const xs *key, size_t i, void *arg);
+    void *arg;
+};
+
+static bool xs_fcdict_prefix_step(const xs *key, size_t i, void *arg)
+{
+    struct xs_fcdict_prefix_walk *w = arg;
+
+    if (xs_size(key) < w->len || memcmp(xs_data(key), w->prefix, w->len))
+        return false;
+    w->count++;
+    return w->fn(key, i, w->arg);
+}
+
+/* Hand @fn, in order, every key starting with @prefix and its ordinal, until
+ * it returns false.  The key is a view, valid during the call only.  Returns
+ * the number of keys visited.
+ */
+size_t xs_fcdict_prefix(const struct xs_fcdict *d,
+                        const xs *prefix,
+                        bool (*fn)(const xs *key, size_t i, void *arg),
+                        void *arg)
+{
+    xs tmp;
+    const xs *flat = xs_flat(prefix, &tmp);
+    struct xs_fcdict_prefix_walk w = {
+        .len = xs_size(prefix),
+        .fn = fn,
+        .arg = arg,
+    };
+    bool found;
+    xs key;
+
+    if (flat) {
+        w.prefix = xs_data(flat);
+        xs_fcdict_walk(d, xs_fcdict_lower_bound(d, w.prefix, w.len, &found),
+                       xs_newempty(&key), xs_fcdict_prefix_step, &w);
+        xs_free(&key);
+    }
+    xs_free(&tmp);
+    return w.count;
+}
+
+/*
+ * Extended large strings: is_ext set, @ptr pointing at a struct xs_ext whose
+ * first member is the usual reference count, so CoW copies share them as any
+ * large string.  They have no flat bytes, so xs_data() gives NULL for them:
+ * xs_get_bytes() reads any form as it is, and xs_expand() turns a string
+ * back into a flat buffer of its own.  Functions changing a string expand it
+ * themselves and return NULL, false or XS_NPOS if that fails; those only
+ * reading one, through a const pointer, work on a flat copy from xs_flat()
+ * and fail the same way, and xs_sort() expands the strings it sorts.
+ */
+enum {
+    XS_EXT_LZ = 1,
+    XS_EXT_GAP,
+    XS_EXT_PAGED,
+};
+
+struct xs_ext {
+    int refcnt;
+    uint32_t kind;
+};
+
+/* Gap buffer, see xs_gap_mode(): the text is @buf[0, @start) followed by
+ * @buf[@end, @alloc)
+ */
+struct xs_gap {
+    struct xs_ext ext;
+    size_t start, end, alloc;
+    char buf[];
+};
+
+/* Pages of XS_PAGE_SIZE bytes, the last one partly used, each with a
+ * reference count of its own, see xs_paged_mode()
+ */
+#define XS_PAGE_SHIFT 16
+#define XS_PAGE_SIZE ((size_t) 1 << XS_PAGE_SHIFT)
+
+struct xs_page {
+    int refcnt;
+    char data[];
+};
+
+struct xs_paged {
+    struct xs_ext ext;
+    size_t nr_pages;
+    struct xs_page *page[];
+};
+
+/*
+ * LZ compression, in the LZ4 block format: each sequence is a token (the
+ * literal length in the high nibble, the match length - 4 in the low one,
+ * 15 meaning more follows in bytes up to 255), the literals, then the 16-bit
+ * little-endian offset of the match.  The last sequence has literals only.
+ */
+#define XS_LZ_HASH_BITS 14
+#define XS_LZ_MIN_MATCH 4
+/* the last match starts this far from the end at least, leaving literals */
+#define XS_LZ_TAIL 12
+
+struct xs_lz {
+    struct xs_ext ext;
+    size_t csize;
+    uint8_t data[];
+};
+
+static inline uint32_t xs_lz_load32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint8_t *xs_lz_put_len(uint8_t *op, size_t len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+/* Compress @n bytes into at most @cap; returns the size, or 0 if it does not
+ * fit
+ */
+static size_t xs_lz_compress(const uint8_t *src,
+                             size_t n,
+                             uint8_t *dst,
+                             size_t cap)
+{
+    uint32_t table[1 << XS_LZ_HASH_BITS] = {0};
+    const uint8_t *dend = dst + cap;
+    uint8_t *op = dst;
+    size_t ip = 1, anchor = 0;
+
+    while (n > XS_LZ_TAIL && ip < n - XS_LZ_TAIL) {
+        uint32_t seq = xs_lz_load32(src + ip);
+        uint32_t h = (seq * 2654435761U) >> (32 - XS_LZ_HASH_BITS);
+        size_t ref = table[h];
+
+        table[h] = ip;
+        if (ip - ref > 65535 || xs_lz_load32(src + ref) != seq) {
+            /* speed up through data that does not compress */
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        size_t len = XS_LZ_MIN_MATCH +
+                     xs_mismatch((const char *) src + ip + XS_LZ_MIN_MATCH,
+                                 (const char *) src + ref + XS_LZ_MIN_MATCH,
+                                 n - 5 - ip - XS_LZ_MIN_MATCH);
+        size_t lit = ip - anchor;
+
+        if ((size_t) (dend - op) < 1 + lit / 255 + 1 + lit + 2 + len / 255 + 1)
+            return 0;
+        uint8_t *token = op++;
+        *token = (lit < 15 ? lit : 15) << 4;
+        if (lit >= 15)
+            op = xs_lz_put_len(op, lit - 15);
+        memcpy(op, src + anchor, lit);
+        op += lit;
+        *op++ = (ip - ref) & 0xff;
+        *op++ = (ip - ref) >> 8;
+        len -= XS_LZ_MIN_MATCH;
+        *token |= len < 15 ? len : 15;
+        if (len >= 15)
+            op = xs_lz_put_len(op, len - 15);
+
+        ip += len + XS_LZ_MIN_MATCH;
+        anchor = ip;
+        table[(xs_lz_load32(src + ip - 2) * 2654435761U) >>
+              (32 - XS_LZ_HASH_BITS)] = ip - 2;
+    }
+
+    size_t lit = n - anchor;
+    if ((size_t) (dend - op) < 1 + lit / 255 + 1 + lit)
+        return 0;
+    *op++ = (lit < 15 ? lit : 15) << 4;
+    if (lit >= 15)
+        op = xs_lz_put_len(op, lit - 15);
+    memcpy(op, src + anchor, lit);
+    return op + lit - dst;
+}
+
+static inline bool xs_lz_get_len(const uint8_t **ip,
+                                 const uint8_t *iend,
+                                 size_t *len)
+{
+    uint8_t b;
+
+    do {
+        if (*ip >= iend)
+            return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+/* Expand @csize bytes into exactly @n; returns false on malformed input */
+static bool xs_lz_decompress(const uint8_t *src,
+                             size_t csize,
+                             uint8_t *dst,
+                             size_t n)
+{
+    const uint8_t *ip = src, *iend = src + csize;
+    uint8_t *op = dst, *oend = dst + n;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t lit = token >> 4, len = token & 15, off;
+
+        if (lit == 15 && !xs_lz_get_len(&ip, iend, &lit))
+            return false;
+        if (lit > (size_t) (iend - ip) || lit > (size_t) (oend - op))
+            return false;
+        /* short runs as one fixed-size copy where there is room to spare */
+        if (lit <= 16 && iend - ip >= 16 && oend - op >= 16)
+            memcpy(op, ip, 16);
+        else
+            memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return false;
+        off = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (len == 15 && !xs_lz_get_len(&ip, iend, &len))
+            return false;
+        len += XS_LZ_MIN_MATCH;
+        if (!off || off > (size_t) (op - dst) || len > (size_t) (oend - op))
+            return false;
+
+        const uint8_t *match = op - off;
+        uint8_t *end = op + len;
+        if (off >= 16 && len + 16 <= (size_t) (oend - op)) {
+            /* whole chunks, each reading only what is written before it,
+             * overrunning the match by less than a chunk
+             */
+            for (; op < end; op += 16, match += 16)
+                memcpy(op, match, 16);
+            op = end;
+        } else if (off >= 8 && len + 8 <= (size_t) (oend - op)) {
+            for (; op < end; op += 8, match += 8)
+                memcpy(op, match, 8);
+            op = end;
+        } else {
+            while (len--)
+                *op++ = *match++;
+        }
+    }
+    return op == oend;
+}
+
+/* Strings shorter than this are not worth compressing */
+#define XS_COMPRESS_MIN 1024
+
+/* Hold @x LZ-compressed if it is an unshared large string and shrinks by an
+ * eighth at least; returns whether it did.  xs_expand() undoes it.
+ */
+bool xs_compress(xs *x)
+{
+    if (!xs_is_ptr(x) || !xs_is_large_string(x) || x->is_ext ||
+        x->is_borrowed || x->size < XS_COMPRESS_MIN ||
+        xs_get_ref_count(x) != 1 || xs_in_shm(x))
+        return false;
+
+    size_t cap = x->size - x->size / 8;
+    struct xs_lz *z = malloc(sizeof(*z) + cap);
+    if (!z)
+        return false;
+    z->csize = xs_lz_compress((const uint8_t *) xs_data(x), x->size, z->data,
+                              cap);
+    if (!z->csize) {
+        free(z);
+        return false;
+    }
+
+    struct xs_lz *shrunk = realloc(z, sizeof(*z) + z->csize);
+    if (shrunk)
+        z = shrunk;
+    z->ext.refcnt = 1;
+    z->ext.kind = XS_EXT_LZ;
+    free(x->ptr);
+    x->ptr = (char *) z;
+    x->is_ext = true;
+    return true;
+}
+
+/* Give @x, if held in another form, a flat buffer of its own again; other
+ * copies keep the form they share.  Returns false, leaving @x as it was, if
+ * it is out of memory or the compressed stream is corrupt.
+ */
+bool xs_expand(xs *x)
+{
+    if (!xs_is_ptr(x) || !x->is_ext)
+        return true;
+
+    struct xs_ext *e = (struct xs_ext *) x->ptr;
+    xs flat = *x;
+
+    flat.is_ext = false;
+    flat.is_large_string = false;
+    xs_allocate_data(&flat, flat.size, 0);
+    if (!flat.ptr)
+        return false;
+    switch (e->kind) {
+    case XS_EXT_LZ: {
+        struct xs_lz *z = (struct xs_lz *) e;
+        if (!xs_lz_decompress(z->data, z->csize, (uint8_t *) xs_data(&flat),
+                              flat.size)) {
+            free(flat.ptr);
+            return false;
+        }
+        break;
+    }
+    case XS_EXT_GAP: {
+        struct xs_gap *g = (struct xs_gap *) e;
+        memcpy(xs_data(&flat), g->buf, g->start);
+        memcpy(xs_data(&flat) + g->start, g->buf + g->end, g->alloc - g->end);
+        break;
+    }
+    case XS_EXT_PAGED: {
+        struct xs_paged *p = (struct xs_paged *) e;
+        for (size_t i = 0, off = 0; i < p->nr_pages; i++, off += XS_PAGE_SIZE)
+            memcpy(xs_data(&flat) + off, p->page[i]->data,
+                   flat.size - off < XS_PAGE_SIZE ? flat.size - off
+                                                  : XS_PAGE_SIZE);
+        break;
+    }
+    }
+    xs_data(&flat)[flat.size] = 0;
+    if (xs_is_large_string(&flat))
+        xs_set_ref_count(&flat, 1 | XS_REF_RECENT);
+
+    if (xs_dec_ref_count(x) <= 0)
+        xs_ext_free(e);
+    *x = flat;
+    return true;
+}
+
+/* The XS_EXT_* kind @x is held in, 0 for a flat string */
+static inline uint32_t xs_ext_kind(const xs *x)
+{
+    return xs_is_ptr(x) && x->is_ext ? ((struct xs_ext *) x->ptr)->kind : 0;
+}
+
+/* Copy up to @n bytes of @x from @pos into @out, whatever form @x is held
+ * in, and return how many there were: none if @x is compressed and cannot be
+ * expanded
+ */
+size_t xs_get_bytes(const xs *x, size_t pos, void *out, size_t n)
+{
+    size_t size = xs_size(x);
+
+    if (pos >= size)
+        return 0;
+    if (n > size - pos)
+        n = size - pos;
+
+    switch (xs_ext_kind(x)) {
+    case XS_EXT_LZ: {
+        /* the stream has no random access: expand it aside */
+        const struct xs_lz *z = (const struct xs_lz *) x->ptr;
+        uint8_t *flat = malloc(size);
+        bool ok = flat && xs_lz_decompress(z->data, z->csize, flat, size);
+
+        if (ok)
+            memcpy(out, flat + pos, n);
+        free(flat);
+        if (!ok)
+            return 0;
+        break;
+    }
+    case XS_EXT_GAP: {
+        const struct xs_gap *g = (const struct xs_gap *) x->ptr;
+        size_t head = pos >= g->start        ? 0
+                      : n < g->start - pos ? n
+                                             : g->start - pos;
+        memcpy(out, g->buf + pos, head);
+        memcpy((char *) out + head, g->buf + g->end + (pos + head - g->start),
+               n - head);
+        break;
+    }
+    case XS_EXT_PAGED: {
+        const struct xs_paged *p = (const struct xs_paged *) x->ptr;
+        for (size_t done = 0, k; done < n; done += k) {
+            size_t off = (pos + done) & (XS_PAGE_SIZE - 1);
+            k = XS_PAGE_SIZE - off < n - done ? XS_PAGE_SIZE - off : n - done;
+            memcpy((char *) out + done,
+                   p->page[(pos + done) >> XS_PAGE_SHIFT]->data + off, k);
+        }
+        break;
+    }
+    default:
+        memcpy(out, xs_data(x) + pos, n);
+    }
+    return n;
+}
+
+/* @x itself if it is flat, otherwise a flat copy of it made in @tmp, for
+ * functions that only read @x; NULL if it is out of memory.  @tmp is to be
+ * passed to xs_free() afterwards either way.
+ */
+static const xs *xs_flat(const xs *x, xs *tmp)
+{
+    *tmp = xs_literal_empty();
+    if (!xs_is_ptr(x) || !x->is_ext)
+        return x;
+    xs_copy(tmp, (xs *) x);
+    if (xs_expand(tmp))
+        return tmp;
+    xs_free(tmp);
+    return NULL;
+}
+
+static void xs_ext_free(struct xs_ext *e)
+{
+    if (e->kind == XS_EXT_PAGED) {
+        struct xs_paged *p = (struct xs_paged *) e;
+        for (size_t i = 0; i < p->nr_pages; i++)
+            if (!__atomic_sub_fetch(&p->page[i]->refcnt, 1, __ATOMIC_ACQ_REL))
+                free(p->page[i]);
+    }
+    free(e);
+}
+
+/* One turn of a clock over @arr: large strings expanded since the last turn
+ * get a second chance, the others are compressed with xs_compress().
+ * Strings only ever read in place are not seen as used, so a hot one is
+ * expanded once every other sweep at most.  Returns the bytes saved.
+ */
+size_t xs_compress_idle(xs *arr, size_t n)
+{
+    size_t saved = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        xs *x = &arr[i];
+        if (!xs_is_ptr(x) || !xs_is_large_string(x) || x->is_ext ||
+            x->is_borrowed)
+            continue;
+
+        int *ref = (int *) x->ptr;
+        if (__atomic_load_n(ref, __ATOMIC_RELAXED) & XS_REF_RECENT) {
+            __atomic_and_fetch(ref, ~XS_REF_RECENT, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (xs_compress(x))
+            saved += ((size_t) 1 << x->capacity) + 4 - sizeof(struct xs_lz) -
+                     ((struct xs_lz *) x->ptr)->csize;
+    }
+    return saved;
+}
+
+/*
+ * Dictionary-encoded column: each row is a 32-bit code into a table holding
+ * every distinct value once, so a column of millions of rows over a few
+ * thousand values costs 4 bytes a row and no reference count traffic.
+ * Equality filters compare codes, 8 (AVX2) or 4 (SSE2) at a time.
+ */
+/* no code: what xs_dict_column_append() returns when out of memory */
+#define XS_DICT_NOCODE ((uint32_t) -1)
+
+struct xs_dict_column {
+    uint32_t *codes;
+    size_t nr_rows, rows_alloc;
+    /* code -> value */
+    xs *values;
+    size_t nr_values, values_alloc;
+    /* value -> code, in the map's value pointer */
+    xs_map index;
+};
+
+void xs_dict_column_init(struct xs_dict_column *c)
+{
+    *c = (struct xs_dict_column){0};
+    xs_map_init(&c->index);
+}
+
+void xs_dict_column_free(struct xs_dict_column *c)
+{
+    for (size_t i = 0; i < c->nr_values; i++)
+        xs_free(&c->values[i]);
+    free(c->values);
+    free(c->codes);
+    xs_map_free(&c->index);
+    xs_dict_column_init(c);
+}
+
+/* Code of @value, if it occurs in @c */
+bool xs_dict_column_find(const struct xs_dict_column *c,
+                         const xs *value,
+                         uint32_t *code)
+{
+    void **slot = xs_map_find(&c->index, value);
+
+    if (slot && code)
+        *code = (uint32_t) (uintptr_t) *slot;
+    return slot;
+}
+
+/* Append a row holding @value; returns its code, or XS_DICT_NOCODE if it is
+ * out of memory, leaving @c as it was
+ */
+uint32_t xs_dict_column_append(struct xs_dict_column *c, const xs *value)
+{
+    uint32_t code;
+
+    if (c->nr_rows == c->rows_alloc) {
+        size_t alloc = c->rows_alloc ? c->rows_alloc * 2 : 1024;
+        uint32_t *codes = realloc(c->codes, alloc * sizeof(uint32_t));
+        if (!codes)
+            return XS_DICT_NOCODE;
+        c->codes = codes;
+        c->rows_alloc = alloc;
+    }
+    if (!xs_dict_column_find(c, value, &code)) {
+        if (c->nr_values == c->values_alloc) {
+            size_t alloc = c->values_alloc ? c->values_alloc * 2 : 64;
+            xs *values = realloc(c->values, alloc * sizeof(xs));
+            if (!values)
+                return XS_DICT_NOCODE;
+            c->values = values;
+            c->values_alloc = alloc;
+        }
+        if (xs_map_insert(&c->index, value,
+                          (void *) (uintptr_t) c->nr_values) < 0)
+            return XS_DICT_NOCODE;
+        code = c->nr_values++;
+        xs_copy(&c->values[code], (xs *) value);
+    }
+    c->codes[c->nr_rows++] = code;
+    return code;
+}
+
+/* The value of @row, owned by @c */
+static inline const xs *xs_dict_column_get(const struct xs_dict_column *c,
+                                           size_t row)
+{
+    return &c->values[c->codes[row]];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) static size_t
+xs_codes_eq_avx2(const uint32_t *codes, size_t n, uint32_t code, size_t *rows)
+{
+    __m256i v = _mm256_set1_epi32(code);
+    size_t i = 0, k = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i c = _mm256_loadu_si256((const __m256i *) (codes + i));
+        uint32_t bits = _mm256_movemask_ps(
+            _mm256_castsi256_ps(_mm256_cmpeq_epi32(c, v)));
+        for (; bits; bits &= bits - 1)
+            rows[k++] = i + __builtin_ctz(bits);
+    }
+    for (; i < n; i++)
+        if (codes[i] == code)
+            rows[k++] = i;
+    return k;
+}
+#endif
+
+/* Rows of @c holding @value, in order, into @rows (room for every row of
+ * @c); returns how many
+ */
+size_t xs_dict_column_filter_eq(const struct xs_dict_column *c,
+                                const xs *value,
+                                size_t *rows)
+{
+    const uint32_t *codes = c->codes;
+    size_t n = c->nr_rows, i = 0, k = 0;
+    uint32_t code;
+
+    if (!xs_dict_column_find(c, value, &code))
+        return 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (xs_cpu_has_avx2())
+        return xs_codes_eq_avx2(codes, n, code, rows);
+#endif
+#ifdef __SSE2__
+    __m128i v = _mm_set1_epi32(code);
+    for (; i + 4 <= n; i += 4) {
+        __m128i cv = _mm_loadu_si128((const __m128i *) (codes + i));
+        uint32_t bits =
+            _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(cv, v)));
+        for (; bits; bits &= bits - 1)
+            rows[k++] = i + __builtin_ctz(bits);
+    }
+#endif
+    for (; i < n; i++)
+        if (codes[i] == code)
+            rows[k++] = i;
+    return k;
+}
+
+/* Rows [@from, @from + @n) as xs of their own, taken with xs_copy() */
+void xs_dict_column_materialize(const struct xs_dict_column *c,
+                                size_t from,
+                                size_t n,
+                                xs *out)
+{
+    for (size_t i = 0; i < n; i++)
+        xs_copy(&out[i], &c->values[c->codes[from + i]]);
+}
+
+/* Empty @x, keeping its buffer only if it is its own, and return room for
+ * @n bytes there
+ */
+static char *xs_reset(xs *x, size_t n)
+{
+    if (xs_is_ptr(x) &&
+        (x->is_borrowed || x->is_ext || xs_get_ref_count(x) > 1))
+        xs_free(x);
+    xs_set_size(x, 0);
+    return xs_append_space(x, n);
+}
+
+/*
+ * Base64 (RFC 4648, with padding) and hex.  The output size is known up
+ * front, so @x is sized once; the AVX2 kernels follow Muła and Lemire,
+ * "Faster Base64 Encoding and Decoding Using AVX2 Instructions" (2018), and
+ * the scalar loops finish what they leave.  The source must not be @x.
+ */
+static const char xs_base64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#if defined(__x86_64__) || defined(__i386__)
+/* 24 bytes, 12 per lane, at offsets 4..15 and 0..11 of the lanes, into 32
+ * sextets, one per byte
+ */
+__attribute__((target("avx2"))) static inline __m256i xs_base64_split(
+    __m256i in)
+{
+    in = _mm256_shuffle_epi8(
+        in, _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+                            14, 15, 13, 14, 11, 12, 10, 11, 8, 9, 7, 8, 5, 6,
+                            4, 5));
+    __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+    __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+    __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    return _mm256_or_si256(t1, t3);
+}
+
+/* sextets to characters: the offset to add depends on the range only */
+__attribute__((target("avx2"))) static inline __m256i xs_base64_chars_avx2(
+    __m256i in)
+{
+    const __m256i lut = _mm256_setr_epi8(
+        65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0, 65,
+        71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+    __m256i idx = _mm256_subs_epu8(in, _mm256_set1_epi8(51));
+    idx = _mm256_sub_epi8(idx,
+                          _mm256_cmpgt_epi8(in, _mm256_set1_epi8(25)));
+    return _mm256_add_epi8(in, _mm256_shuffle_epi8(lut, idx));
+}
+
+/* Returns how many bytes of @src it encoded, a multiple of 24 */
+__attribute__((target("avx2"))) static size_t
+xs_base64_encode_avx2(const uint8_t *src, size_t n, char *out)
+{
+    size_t i = 0;
+
+    if (n < 28)
+        return 0;
+    /* the first block cannot start 4 bytes early: mask them out */
+    __m256i in = _mm256_maskload_epi32(
+        (const int *) (src - 4),
+        _mm256_set_epi32(-1, -1, -1, -1, -1, -1, -1, 0));
+    for (;;) {
+        _mm256_storeu_si256((__m256i *) (out + i / 3 * 4),
+                            xs_base64_chars_avx2(xs_base64_split(in)));
+        i += 24;
+        if (n - i < 28)
+            return i;
+        in = _mm256_loadu_si256((const __m256i *) (src + i - 4));
+    }
+}
+
+/* Returns how many characters of @src it decoded, a multiple of 32, and
+ * stops early at anything that is not in the alphabet
+ */
+__attribute__((target("avx2"))) static size_t
+xs_base64_decode_avx2(const char *src, size_t n, uint8_t *out)
+{
+    const __m256i lut_lo = _mm256_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13,
+        0x1A, 0x1B, 0x1B, 0x1B, 0x1A, 0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lut_hi = _mm256_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+        0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0, 0, 16, 19,
+        4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+    size_t i = 0;
+
+    /* each store writes 32 bytes for 24: keep 8 of output to spare */
+    for (; n - i >= 45; i += 32) {
+        __m256i in = _mm256_loadu_si256((const __m256i *) (src + i));
+        __m256i hi_nibbles =
+            _mm256_and_si256(_mm256_srli_epi32(in, 4), mask_2f);
+        __m256i lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(in, mask_2f));
+        __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        if (!_mm256_testz_si256(lo, hi))
+            break;
+
+        __m256i eq_2f = _mm256_cmpeq_epi8(in, mask_2f);
+        in = _mm256_add_epi8(
+            in, _mm256_shuffle_epi8(lut_roll,
+                                    _mm256_add_epi8(eq_2f, hi_nibbles)));
+
+        /* 4 sextets to 3 bytes in every 32-bit word, then close the gaps */
+        in = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+        in = _mm256_madd_epi16(in, _mm256_set1_epi32(0x00011000));
+        in = _mm256_shuffle_epi8(
+            in, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1,
+                                 -1, -1, -1, 2, 1, 0, 6, 5, 4, 10, 9, 8, 14,
+                                 13, 12, -1, -1, -1, -1));
+        in = _mm256_permutevar8x32_epi32(
+            in, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1));
+        _mm256_storeu_si256((__m256i *) (out + i / 4 * 3), in);
+    }
+    return i;
+}
+#endif
+
+/* Replace @x with the base64 text of @n bytes at @src */
+xs *xs_base64_encode(xs *x, const void *src, size_t n)
+{
+    const uint8_t *s = src;
+    size_t len = (n + 2) / 3 * 4, i = 0;
+    char *out = xs_reset(x, len);
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (xs_cpu_has_avx2())
+        i = xs_base64_encode_avx2(s, n, out);
+#endif
+    for (char *o = out + i / 3 * 4; i + 3 <= n; i += 3, o += 4) {
+        uint32_t v = s[i] << 16 | s[i + 1] << 8 | s[i + 2];
+        o[0] = xs_base64_chars[v >> 18];
+        o[1] = xs_base64_chars[v >> 12 & 63];
+        o[2] = xs_base64_chars[v >> 6 & 63];
+        o[3] = xs_base64_chars[v & 63];
+    }
+    if (i < n) {
+        char *o = out + len - 4;
+        uint32_t v = s[i] << 16 | (i + 1 < n ? s[i + 1] << 8 : 0);
+        o[0] = xs_base64_chars[v >> 18];
+        o[1] = xs_base64_chars[v >> 12 & 63];
+        o[2] = i + 1 < n ? xs_base64_chars[v >> 6 & 63] : '=';
+        o[3] = '=';
+    }
+    xs_set_size(x, len);
+    xs_set_utf8(x, true);
+    return x;
+}
+
+/* Sextet of each character, 0xff for the rest */
+static uint8_t xs_base64_values[256];
+
+static void xs_base64_init(void)
+{
+    memset(xs_base64_values, 0xff, sizeof(xs_base64_values));
+    for (int i = 0; i < 64; i++)
+        xs_base64_values[(uint8_t) xs_base64_chars[i]] = i;
+}
+
+/* Replace @x with the bytes of the base64 text of @n characters at @src,
+ * padded or not.  Returns false, leaving @x empty, on any other character
+ * or a length no encoding has.
+ */
+bool xs_base64_decode(xs *x, const void *src, size_t n)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    const char *s = src;
+    size_t i = 0, len;
+
+    pthread_once(&once, xs_base64_init);
+    if (n % 4 == 0 && n && s[n - 1] == '=')
+        n -= 1 + (s[n - 2] == '=');
+    if (n % 4 == 1) {
+        xs_reset(x, 0);
+        return false;
+    }
+    len = n / 4 * 3 + (n % 4 ? n % 4 - 1 : 0);
+
+    uint8_t *out = (uint8_t *) xs_reset(x, len), *o;
+#if defined(__x86_64__) || defined(__i386__)
+    if (xs_cpu_has_avx2())
+        i = xs_base64_decode_avx2(s, n, out);
+#endif
+    uint32_t bad = 0;
+    for (o = out + i / 4 * 3; i + 4 <= n; i += 4, o += 3) {
+        uint32_t a = xs_base64_values[(uint8_t) s[i]],
+                 b = xs_base64_values[(uint8_t) s[i + 1]],
+                 c = xs_base64_values[(uint8_t) s[i + 2]],
+                 d = xs_base64_values[(uint8_t) s[i + 3]];
+        uint32_t v = a << 18 | b << 12 | c << 6 | d;
+        bad |= a | b | c | d;
+        o[0] = v >> 16;
+        o[1] = v >> 8;
+        o[2] = v;
+    }
+    if (i < n) {
+        uint32_t a = xs_base64_values[(uint8_t) s[i]],
+                 b = xs_base64_values[(uint8_t) s[i + 1]],
+                 c = n - i > 2 ? xs_base64_values[(uint8_t) s[i + 2]] : 0;
+        uint32_t v = a << 18 | b << 12 | c << 6;
+        bad |= a | b | c;
+        o[0] = v >> 16;
+        if (n - i > 2)
+            o[1] = v >> 8;
+    }
+    if (bad & 0x80) {
+        xs_reset(x, 0);
+        return false;
+    }
+    xs_set_size(x, len);
+    xs_set_utf8(x, false);
+    return true;
+}
+
+static const char xs_hex_chars[] = "0123456789abcdef";
+
+#if defined(__x86_64__) || defined(__i386__)
+/* 16 bytes at a time into 32 lowercase digits */
+__attribute__((target("avx2"))) static size_t
+xs_hex_encode_avx2(const uint8_t *src, size_t n, char *out)
+{
+    const __m256i lut = _mm256_setr_epi8(
+        '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd',
+        'e', 'f', '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b',
+        'c', 'd', 'e', 'f');
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m256i v = _mm256_cvtepu8_epi16(
+            _mm_loadu_si128((const __m128i *) (src + i)));
+        /* high nibble in the first byte of each pair, low one after it */
+        v = _mm256_or_si256(
+            _mm256_srli_epi16(v, 4),
+            _mm256_slli_epi16(_mm256_and_si256(v, _mm256_set1_epi16(15)), 8));
+        _mm256_storeu_si256((__m256i *) (out + 2 * i),
+                            _mm256_shuffle_epi8(lut, v));
+    }
+    return i;
+}
+
+/* 32 digits at a time into 16 bytes; stops early at a non-digit */
+__attribute__((target("avx2"))) static size_t
+xs_hex_decode_avx2(const char *src, size_t n, uint8_t *out)
+{
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+        __m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+        __m256i l = _mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(32)),
+                                    _mm256_set1_epi8('a'));
+        __m256i is_digit =
+            _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+        __m256i is_alpha =
+            _mm256_cmpeq_epi8(_mm256_min_epu8(l, _mm256_set1_epi8(5)), l);
+        if (~_mm256_movemask_epi8(_mm256_or_si256(is_digit, is_alpha)))
+            break;
+
+        v = _mm256_blendv_epi8(_mm256_add_epi8(l, _mm256_set1_epi8(10)), d,
+                               is_digit);
+        /* pairs of nibbles to bytes, then the two lanes' 8 bytes together */
+        v = _mm256_maddubs_epi16(v, _mm256_set1_epi16(0x0110));
+        v = _mm256_packus_epi16(v, v);
+        v = _mm256_permute4x64_epi64(v, 0x08);
+        _mm_storeu_si128((__m128i *) (out + i / 2), _mm256_castsi256_si128(v));
+    }
+    return i;
+}
+#endif
+
+/* Replace @x with the lowercase hex digits of @n bytes at @src */
+xs *xs_hex_encode(xs *x, const void *src, size_t n)
+{
+    const uint8_t *s = src;
+    char *out = xs_reset(x, 2 * n);
+    size_t i = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (xs_cpu_has_avx2())
+        i = xs_hex_encode_avx2(s, n, out);
+#endif
+    for (; i < n; i++) {
+        out[2 * i] = xs_hex_chars[s[i] >> 4];
+        out[2 * i + 1] = xs_hex_chars[s[i] & 15];
+    }
+    xs_set_size(x, 2 * n);
+    xs_set_utf8(x, true);
+    return x;
+}
+
+static inline int xs_hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 32;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/* Replace @x with the bytes of @n hex digits at @src, in either case.
+ * Returns false, leaving @x empty, on an odd count or a non-digit.
+ */
+bool xs_hex_decode(xs *x, const void *src, size_t n)
+{
+    const char *s = src;
+    uint8_t *out = (uint8_t *) xs_reset(x, n / 2);
+    size_t i = 0;
+
+    if (n % 2) {
+        xs_set_size(x, 0);
+        return false;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if (xs_cpu_has_avx2())
+        i = xs_hex_decode_avx2(s, n, out);
+#endif
+    for (; i < n; i += 2) {
+        int hi = xs_hex_value(s[i]), lo = xs_hex_value(s[i + 1]);
+        if ((hi | lo) < 0) {
+            xs_set_size(x, 0);
+            return false;
+        }
+        out[i / 2] = hi << 4 | lo;
+    }
+    xs_set_size(x, n / 2);
+    xs_set_utf8(x, false);
+    return true;
+}
+
+/*
+ * JSON and CSV escaping.  A vector scan finds the next byte that needs
+ * attention, everything before it is copied in bulk, and the exact output
+ * size is worked out with the same scan before anything is written, so @x
+ * grows once.  The source must not be @x.
+ */
+struct xs_special {
+    uint8_t c[4];
+    /* also stop at control characters, below 0x20 */
+    bool ctrl;
+};
+
+static const struct xs_special xs_json_special = {{'"', '\\', '"', '"'}, 1};
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) static size_t
+xs_scan_special_avx2(const uint8_t *s,
+                     size_t i,
+                     size_t n,
+                     const struct xs_special *sp)
+{
+    const __m256i c0 = _mm256_set1_epi8(sp->c[0]), c1 = _mm256_set1_epi8(sp->c[1]),
+                  c2 = _mm256_set1_epi8(sp->c[2]), c3 = _mm256_set1_epi8(sp->c[3]),
+                  lim = _mm256_set1_epi8(sp->ctrl ? 0x1f : 0);
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+        __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, c0), _mm256_cmpeq_epi8(v, c1)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, c2), _mm256_cmpeq_epi8(v, c3)));
+        if (sp->ctrl)
+            m = _mm256_or_si256(
+                m, _mm256_cmpeq_epi8(_mm256_min_epu8(v, lim), v));
+        uint32_t bits = _mm256_movemask_epi8(m);
+        if (bits)
+            return i + __builtin_ctz(bits);
+    }
+    return i;
+}
+#endif
+
+/* Index of the first byte of @s[@i..@n) that @sp asks for, or @n */
+static size_t xs_scan_special(const uint8_t *s,
+                              size_t i,
+                              size_t n,
+                              const struct xs_special *sp)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (n - i >= 32 && xs_cpu_has_avx2()) {
+        i = xs_scan_special_avx2(s, i, n, sp);
+        if (n - i >= 32)
+            return i;
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i c0 = _mm_set1_epi8(sp->c[0]), c1 = _mm_set1_epi8(sp->c[1]),
+                  c2 = _mm_set1_epi8(sp->c[2]), c3 = _mm_set1_epi8(sp->c[3]),
+                  lim = _mm_set1_epi8(sp->ctrl ? 0x1f : 0);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, c0), _mm_cmpeq_epi8(v, c1)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, c2), _mm_cmpeq_epi8(v, c3)));
+        if (sp->ctrl)
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(v, lim), v));
+        uint32_t bits = _mm_movemask_epi8(m);
+        if (bits)
+            return i + __builtin_ctz(bits);
+    }
+#endif
+    for (; i < n; i++) {
+        uint8_t c = s[i];
+        if (c == sp->c[0] || c == sp->c[1] || c == sp->c[2] ||
+            c == sp->c[3] || (sp->ctrl && c < 0x20))
+            return i;
+    }
+    return n;
+}
+
+/* The two-character escapes of control characters, 0 for \u00XX */
+static const char xs_json_short[32] = {
+    ['\b'] = 'b', ['\t'] = 't', ['\n'] = 'n', ['\f'] = 'f', ['\r'] = 'r',
+};
+
+/* Bytes that JSON escaping adds to @s: 1 per \" \\ or short control
+ * escape, 5 per \u00XX
+ */
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) static size_t
+xs_json_extra_avx2(const uint8_t *s, size_t *pi, size_t n)
+{
+    const __m256i quote = _mm256_set1_epi8('"'), bslash = _mm256_set1_epi8('\\'),
+                  lim = _mm256_set1_epi8(0x1f), bt = _mm256_set1_epi8('\b'),
+                  cr = _mm256_set1_epi8('\r'), ff = _mm256_set1_epi8('\f');
+    size_t i = *pi, extra = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+        __m256i ctrl = _mm256_cmpeq_epi8(_mm256_min_epu8(v, lim), v);
+        __m256i m = _mm256_or_si256(
+            ctrl, _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                  _mm256_cmpeq_epi8(v, bslash)));
+        uint32_t bits = _mm256_movemask_epi8(m);
+        if (!bits)
+            continue;
+        /* \b \t \n are 8..10, then \f and \r */
+        __m256i shrt = _mm256_or_si256(
+            _mm256_cmpeq_epi8(_mm256_max_epu8(_mm256_min_epu8(v, _mm256_set1_epi8('\n')), bt), v),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, ff), _mm256_cmpeq_epi8(v, cr)));
+        uint32_t lng = _mm256_movemask_epi8(_mm256_andnot_si256(shrt, ctrl));
+        extra += __builtin_popcount(bits) + 4 * __builtin_popcount(lng);
+    }
+    *pi = i;
+    return extra;
+}
+#endif
+
+static size_t xs_json_extra(const uint8_t *s, size_t n)
+{
+    size_t i = 0, extra = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (n >= 32 && xs_cpu_has_avx2())
+        extra = xs_json_extra_avx2(s, &i, n);
+#endif
+    for (i = xs_scan_special(s, i, n, &xs_json_special); i < n;
+         i = xs_scan_special(s, i + 1, n, &xs_json_special))
+        extra += s[i] < 0x20 && !xs_json_short[s[i]] ? 5 : 1;
+    return extra;
+}
+
+/* Write the escape of @c, one of the bytes xs_json_special stops at */
+static inline char *xs_json_escape_byte(char *o, uint8_t c)
+{
+    *o++ = '\\';
+    if (c >= 0x20) {
+        *o++ = c;
+    } else if (xs_json_short[c]) {
+        *o++ = xs_json_short[c];
+    } else {
+        memcpy(o, "u00", 3);
+        o[3] = xs_hex_chars[c >> 4];
+        o[4] = xs_hex_chars[c & 15];
+        o += 5;
+    }
+    return o;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* The clean run up to each special byte is copied with one 32-byte store,
+ * which may overshoot into what comes next; with a block to spare after
+ * the current one that stays inside both buffers.
+ */
+__attribute__((target("avx2"))) static char *
+xs_json_escape_avx2(const uint8_t *s, size_t *pi, size_t n, char *o)
+{
+    const __m256i quote = _mm256_set1_epi8('"'), bslash = _mm256_set1_epi8('\\'),
+                  lim = _mm256_set1_epi8(0x1f);
+    size_t i = *pi;
+
+    for (; i + 64 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+        __m256i m = _mm256_or_si256(
+            _mm256_cmpeq_epi8(_mm256_min_epu8(v, lim), v),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                            _mm256_cmpeq_epi8(v, bslash)));
+        uint32_t bits = _mm256_movemask_epi8(m);
+        unsigned k, prev = 0;
+
+        for (; bits; bits &= bits - 1, prev = k + 1) {
+            k = __builtin_ctz(bits);
+            _mm256_storeu_si256(
+                (__m256i *) o,
+                _mm256_loadu_si256((const __m256i *) (s + i + prev)));
+            o = xs_json_escape_byte(o + k - prev, s[i + k]);
+        }
+        _mm256_storeu_si256(
+            (__m256i *) o, _mm256_loadu_si256((const __m256i *) (s + i + prev)));
+        o += 32 - prev;
+    }
+    *pi = i;
+    return o;
+}
+#endif
+
+static xs *xs_json_escape(xs *x, const xs *s)
+{
+    const uint8_t *p = (const uint8_t *) xs_data(s);
+    size_t n = xs_size(s), size = xs_size(x), i = 0, j;
+    bool utf8 = xs_utf8_known(x) && xs_utf8_known(s);
+    size_t extra = xs_json_extra(p, n);
+    char *o = xs_append_space(x, n + extra);
+    if (!o)
+        return NULL;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (n >= 64 && xs_cpu_has_avx2())
+        o = xs_json_escape_avx2(p, &i, n, o);
+#endif
+    for (;; i = j + 1) {
+        j = xs_scan_special(p, i, n, &xs_json_special);
+        memcpy(o, p + i, j - i);
+        o += j - i;
+        if (j == n)
+            break;
+        o = xs_json_escape_byte(o, p[j]);
+    }
+    xs_set_size(x, size + n + extra);
+    xs_set_utf8(x, utf8);
+    return x;
+}
+
+/* Append @s as the body of a JSON string, without the quotes */
+xs *xs_append_json_escaped(xs *x, const xs *s)
+{
+    xs tmp;
+    const xs *flat = xs_flat(s, &tmp);
+    xs *r = flat ? xs_json_escape(x, flat) : NULL;
+
+    xs_free(&tmp);
+    return r;
+}
+
+static inline int xs_hex4(const uint8_t *p)
+{
+    int v = 0;
+
+    for (int k = 0; k < 4; k++) {
+        int d = xs_hex_value(p[k]);
+        if (d < 0)
+            return -1;
+        v = v << 4 | d;
+    }
+    return v;
+}
+
+static bool xs_json_unescape(xs *x, const xs *s)
+{
+    const uint8_t *p = (const uint8_t *) xs_data(s);
+    size_t n = xs_size(s), size = xs_size(x), i, j;
+    bool utf8 = xs_utf8_known(x) && xs_utf8_known(s);
+
+    /* nothing gets longer: \uXXXX is 3 bytes at most, a pair 4 */
+    char *start = xs_append_space(x, n), *o = start;
+    if (!start)
+        return false;
+    for (i = 0;; i = j) {
+        j = xs_scan_special(p, i, n, &xs_json_special);
+        memcpy(o, p + i, j - i);
+        o += j - i;
+        if (j == n)
+            break;
+        if (p[j] != '\\' || j + 1 == n)
+            goto fail;
+
+        uint8_t e = p[j + 1];
+        static const char simple[] = "\"\\/bfnrt", value[] = "\"\\/\b\f\n\r\t";
+        const char *k = e ? memchr(simple, e, sizeof(simple) - 1) : NULL;
+        j += 2;
+        if (k) {
+            *o++ = value[k - simple];
+            continue;
+        }
+        int cp = e == 'u' && n - j >= 4 ? xs_hex4(p + j) : -1;
+        if (cp < 0 || (cp >= 0xdc00 && cp < 0xe000))
+            goto fail;
+        j += 4;
+        if (cp >= 0xd800 && cp < 0xdc00) {
+            int lo = n - j >= 6 && p[j] == '\\' && p[j + 1] == 'u'
+                         ? xs_hex4(p + j + 2)
+                         : -1;
+            if (lo < 0xdc00 || lo >= 0xe000)
+                goto fail;
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+            j += 6;
+        }
+        if (cp < 0x80) {
+            *o++ = cp;
+        } else if (cp < 0x800) {
+            *o++ = 0xc0 | cp >> 6;
+            *o++ = 0x80 | (cp & 0x3f);
+        } else if (cp < 0x10000) {
+            *o++ = 0xe0 | cp >> 12;
+            *o++ = 0x80 | (cp >> 6 & 0x3f);
+            *o++ = 0x80 | (cp & 0x3f);
+        } else {
+            *o++ = 0xf0 | cp >> 18;
+            *o++ = 0x80 | (cp >> 12 & 0x3f);
+            *o++ = 0x80 | (cp >> 6 & 0x3f);
+            *o++ = 0x80 | (cp & 0x3f);
+        }
+    }
+    xs_set_size(x, size + (o - start));
+    xs_set_utf8(x, utf8);
+    return true;
+
+fail:
+    xs_set_size(x, size);
+    return false;
+}
+
+/* Append the text the body of a JSON string @s, without its quotes, stands
+ * for.  Returns false, leaving @x as it was, on a bad escape, a raw quote or
+ * control character, an unpaired surrogate, or out of memory.
+ */
+bool xs_append_json_unescaped(xs *x, const xs *s)
+{
+    xs tmp;
+    const xs *flat = xs_flat(s, &tmp);
+    bool r = flat && xs_json_unescape(x, flat);
+
+    xs_free(&tmp);
+    return r;
+}
+
+static xs *xs_csv_escape(xs *x, const xs *s, char sep)
+{
+    const struct xs_special sp = {{'"', sep, '\n', '\r'}, 0};
+    const uint8_t *p = (const uint8_t *) xs_data(s);
+    size_t n = xs_size(s), size = xs_size(x), quotes = 0, i, j;
+    bool quote = false, utf8 = xs_utf8_known(x) && xs_utf8_known(s);
+
+    for (i = xs_scan_special(p, 0, n, &sp); i < n;
+         i = xs_scan_special(p, i + 1, n, &sp)) {
+        quote = true;
+        quotes += p[i] == '"';
+    }
+
+    size_t len = n + (quote ? quotes + 2 : 0);
+    char *o = xs_append_space(x, len);
+    if (!o)
+        return NULL;
+    if (!quote) {
+        memcpy(o, p, n);
+    } else {
+        *o++ = '"';
+        for (i = 0;; i = j + 1) {
+            const uint8_t *q = memchr(p + i, '"', n - i);
+            j = q ? (size_t) (q - p) : n;
+            memcpy(o, p + i, j - i);
+            o += j - i;
+            if (j == n)
+                break;
+            memcpy(o, "\"\"", 2);
+            o += 2;
+        }
+        *o = '"';
+    }
+    xs_set_size(x, size + len);
+    xs_set_utf8(x, utf8);
+    return x;
+}
+
+/* Append @s as one CSV field (RFC 4180) for separator @sep: quoted, with
+ * its quotes doubled, if it holds a quote, @sep or a line break, and as it
+ * is otherwise
+ */
+xs *xs_append_csv_escaped(xs *x, const xs *s, char sep)
+{
+    xs tmp;
+    const xs *flat = xs_flat(s, &tmp);
+    xs *r = flat ? xs_csv_escape(x, flat, sep) : NULL;
+
+    xs_free(&tmp);
+    return r;
+}
+
+static bool xs_csv_unescape(xs *x, const xs *s)
+{
+    const uint8_t *p = (const uint8_t *) xs_data(s);
+    size_t n = xs_size(s), size = xs_size(x);
+    bool utf8 = xs_utf8_known(x) && xs_utf8_known(s);
+    char *start = xs_append_space(x, n), *o = start;
+
+    if (!start)
+        return false;
+    if (!n || p[0] != '"') {
+        memcpy(o, p, n);
+        o += n;
+    } else {
+        for (size_t i = 1;;) {
+            const uint8_t *q = memchr(p + i, '"', n - i);
+            if (!q)
+                goto fail;
+            size_t j = q - p;
+            memcpy(o, p + i, j - i);
+            o += j - i;
+            if (j == n - 1)
+                break;
+            if (p[j + 1] != '"')
+                goto fail;
+            *o++ = '"';
+            i = j + 2;
+        }
+    }
+    xs_set_size(x, size + (o - start));
+    xs_set_utf8(x, utf8);
+    return true;
+
+fail:
+    xs_set_size(x, size);
+    return false;
+}
+
+/* Append the value of the CSV field @s: a quoted field loses its quotes and
+ * has doubled ones halved, any other is taken as it is.  Returns false,
+ * leaving @x as it was, on a quoted field that is not closed properly or
+ * out of memory.
+ */
+bool xs_append_csv_unescaped(xs *x, const xs *s)
+{
+    xs tmp;
+    const xs *flat = xs_flat(s, &tmp);
+    bool r = flat && xs_csv_unescape(x, flat);
+
+    xs_free(&tmp);
+    return r;
+}
+
+/*
+ * Search and replace.  The matches are counted first, with the vector
+ * search, so the result is sized exactly; it is then written in one pass,
+ * in place when no replacement is longer than its needle and the buffer is
+ * not shared, into a new buffer otherwise.  Matches do not overlap and are
+ * taken from left to right.
+ */
+
+/* Next match at or after @from among the @k needles: the leftmost, the
+ * first listed of those starting there.  @next caches where each needle
+ * occurs next, XS_NPOS past the last one; empty needles never match.
+ */
+static size_t xs_next_match(const char *s,
+                            size_t n,
+                            const xs *needles,
+                            size_t k,
+                            size_t *next,
+                            size_t from,
+                            size_t *which)
+{
+    size_t best = XS_NPOS;
+
+    for (size_t j = 0; j < k; j++) {
+        if (next[j] < from) {
+            size_t pos = xs_find_bytes(s + from, n - from,
+                                       xs_data(&needles[j]),
+                                       xs_size(&needles[j]));
+            next[j] = pos == XS_NPOS ? XS_NPOS : from + pos;
+        }
+        if (next[j] < best) {
+            best = next[j];
+            *which = j;
+        }
+    }
+    return best;
+}
+
+static void xs_next_match_init(const char *s,
+                               size_t n,
+                               const xs *needles,
+                               size_t k,
+                               size_t *next)
+{
+    for (size_t j = 0; j < k; j++)
+        next[j] = xs_size(&needles[j]) ? xs_find_bytes(s, n,
+                                                       xs_data(&needles[j]),
+                                                       xs_size(&needles[j]))
+                                       : XS_NPOS;
+}
+
+/* Write the result of the replacement, @size bytes, into @x */
+static xs *xs_replace_apply(xs *x,
+                            const xs *needles,
+                            const xs *repls,
+                            size_t k,
+                            size_t *next,
+                            size_t size)
+{
+    char *s = xs_data(x);
+    size_t n = xs_size(x), i = 0, pos, j = 0;
+    bool in_place = !(xs_is_ptr(x) && x->is_borrowed) &&
+                    xs_get_ref_count(x) <= 1,
+         utf8 = xs_utf8_known(x);
+
+    for (size_t t = 0; t < k; t++) {
+        in_place &= xs_size(&repls[t]) <= xs_size(&needles[t]) &&
+                    &repls[t] != x && &needles[t] != x;
+        utf8 &= xs_utf8_known(&needles[t]) && xs_utf8_known(&repls[t]);
+    }
+
+    xs out = xs_literal_empty();
+    char *o = in_place ? s : xs_data(xs_grow(&out, size));
+
+    xs_next_match_init(s, n, needles, k, next);
+    while ((pos = xs_next_match(s, n, needles, k, next, i, &j)) != XS_NPOS) {
+        size_t r = xs_size(&repls[j]);
+        memmove(o, s + i, pos - i);
+        memcpy(o + (pos - i), xs_data(&repls[j]), r);
+        o += pos - i + r;
+        i = pos + xs_size(&needles[j]);
+    }
+    memmove(o, s + i, n - i);
+
+    if (!in_place) {
+        xs_free(x);
+        *x = out;
+    }
+    xs_set_size(x, size);
+    xs_set_utf8(x, utf8);
+    return x;
+}
+
+/* Replace every @needle in @x with @repl */
+xs *xs_replace_all(xs *x, const xs *needle, const xs *repl)
+{
+    if (!xs_expand(x))
+        return NULL;
+
+    xs tn, tr;
+    const xs *fn = xs_flat(needle, &tn), *fr = xs_flat(repl, &tr);
+    size_t count = fn && fr ? xs_count(x, fn) : 0, next;
+
+    if (!fn || !fr)
+        x = NULL;
+    else if (count)
+        xs_replace_apply(x, fn, fr, 1, &next,
+                         xs_size(x) - count * xs_size(fn) +
+                             count * xs_size(fr));
+    xs_free(&tn);
+    xs_free(&tr);
+    return x;
+}
+
+/* @arr itself if its @k strings are all flat, otherwise a new array of flat
+ * copies of them for xs_flat_array_free(); NULL if it is out of memory
+ */
+static const xs *xs_flat_array(const xs *arr, size_t k)
+{
+    size_t i = 0;
+
+    while (i < k && !(xs_is_ptr(&arr[i]) && arr[i].is_ext))
+        i++;
+    if (i == k)
+        return arr;
+
+    xs *copy = malloc(k * sizeof(*copy));
+    if (!copy)
+        return NULL;
+    for (i = 0; i < k; i++) {
+        xs_copy(&copy[i], (xs *) &arr[i]);
+        if (!xs_expand(&copy[i])) {
+            for (size_t j = 0; j <= i; j++)
+                xs_free(&copy[j]);
+            free(copy);
+            return NULL;
+        }
+    }
+    return copy;
+}
+
+static void xs_flat_array_free(const xs *flat, const xs *arr, size_t k)
+{
+    if (!flat || flat == arr)
+        return;
+    for (size_t i = 0; i < k; i++)
+        xs_free((xs *) &flat[i]);
+    free((xs *) flat);
+}
+
+/* xs_replace_multi() of flat @x, @needles and @repls */
+static xs *xs_replace_flat(xs *x, const xs *needles, const xs *repls, size_t k)
+{
+    const char *s = xs_data(x);
+    size_t n = xs_size(x), size = n, i = 0, pos, j = 0, count = 0;
+    size_t *next = malloc(k * sizeof(size_t));
+
+    if (!next && k)
+        return NULL;
+    xs_next_match_init(s, n, needles, k, next);
+    while ((pos = xs_next_match(s, n, needles, k, next, i, &j)) != XS_NPOS) {
+        size = size - xs_size(&needles[j]) + xs_size(&repls[j]);
+        i = pos + xs_size(&needles[j]);
+        count++;
+    }
+    if (count)
+        xs_replace_apply(x, needles, repls, k, next, size);
+    free(next);
+    return x;
+}
+
+/* Replace every @needles[i] in @x with @repls[i], at once: text a
+ * replacement brings in is not searched again.  Where several needles
+ * match, the one starting first wins, then the first listed.
+ */
+xs *xs_replace_multi(xs *x, const xs *needles, const xs *repls, size_t k)
+{
+    if (!xs_expand(x))
+        return NULL;
+
+    const xs *fn = xs_flat_array(needles, k), *fr = xs_flat_array(repls, k);
+    if (fn && fr)
+        x = xs_replace_flat(x, fn, fr, k);
+    else
+        x = NULL;
+    xs_flat_array_free(fn, needles, k);
+    xs_flat_array_free(fr, repls, k);
+    return x;
+}
+
+/*
+ * Insertion and removal at any position.  A flat string moves everything
+ * after the edit, which for a large document costs megabytes a keystroke;
+ * in gap mode the free space sits where the last edit was, so an edit only
+ * moves the text between it and the previous one.  xs_expand() makes the
+ * string flat again, xs_get_bytes() reads either form as it is.
+ */
+
+/* Least room in the gap a gap buffer is given */
+#define XS_GAP_MIN 4096
+
+static inline void xs_ext_set_size(xs *x, size_t size)
+{
+    x->size = size;
+    x->capacity = ilog2(size + 1) + 1;
+}
+
+/* Hold @x as a gap buffer from now on, with the gap at the end; returns
+ * false if it is out of memory
+ */
+bool xs_gap_mode(xs *x)
+{
+    if (xs_ext_kind(x) == XS_EXT_GAP)
+        return true;
+    if (!xs_expand(x))
+        return false;
+
+    size_t size = xs_size(x), alloc = size + XS_GAP_MIN + size / 8;
+    struct xs_gap *g = malloc(sizeof(*g) + alloc);
+    bool utf8 = xs_utf8_known(x);
+    if (!g)
+        return false;
+
+    memcpy(g->buf, xs_data(x), size);
+    g->ext.refcnt = 1;
+    g->ext.kind = XS_EXT_GAP;
+    g->start = size;
+    g->end = g->alloc = alloc;
+
+    xs_free(x);
+    *x = (xs){.ptr = NULL};
+    x->is_ptr = x->is_large_string = x->is_ext = true;
+    x->ptr = (char *) g;
+    xs_ext_set_size(x, size);
+    xs_set_utf8(x, utf8);
+    return true;
+}
+
+/* The gap buffer of @x, of its own and with room for @n more bytes, or NULL
+ * if it is out of memory
+ */
+static struct xs_gap *xs_gap_reserve(xs *x, size_t n)
+{
+    struct xs_gap *g = (struct xs_gap *) x->ptr;
+    bool shared = xs_get_ref_count(x) > 1;
+
+    if (!shared && g->end - g->start >= n)
+        return g;
+
+    size_t alloc = g->alloc, tail = g->alloc - g->end;
+    if (g->end - g->start < n && (alloc *= 2) < x->size + n + XS_GAP_MIN)
+        alloc = x->size + n + XS_GAP_MIN;
+    struct xs_gap *ng = malloc(sizeof(*ng) + alloc);
+    if (!ng)
+        return NULL;
+    *ng = *g;
+    ng->ext.refcnt = 1;
+    ng->alloc = alloc;
+    ng->end = alloc - tail;
+    memcpy(ng->buf, g->buf, g->start);
+    memcpy(ng->buf + ng->end, g->buf + g->end, tail);
+
+    /* the other holders may have let go since */
+    if (!shared || xs_dec_ref_count(x) <= 0)
+        free(g);
+    x->ptr = (char *) ng;
+    return ng;
+}
+
+/* Move the gap to @pos */
+static void xs_gap_move(struct xs_gap *g, size_t pos)
+{
+    if (pos < g->start) {
+        size_t n = g->start - pos;
+        memmove(g->buf + g->end - n, g->buf + pos, n);
+        g->start -= n;
+        g->end -= n;
+    } else if (pos > g->start) {
+        size_t n = pos - g->start;
+        memmove(g->buf + g->start, g->buf + g->end, n);
+        g->start += n;
+        g->end += n;
+    }
+}
+
+/* Whether offset @pos of @x is not inside a UTF-8 sequence */
+static bool xs_utf8_boundary(const xs *x, size_t pos)
+{
+    uint8_t c;
+
+    return !xs_get_bytes(x, pos, &c, 1) || (c & 0xc0) != 0x80;
+}
+
+/* Insert the @n bytes at @p, which must not be inside @x, before offset
+ * @pos of @x; a @pos past the end appends.  Returns NULL, leaving @x as it
+ * was, if it is out of memory.
+ */
+xs *xs_insert(xs *x, size_t pos, const void *p, size_t n)
+{
+    size_t size = xs_size(x);
+    bool utf8;
+
+    if (pos > size)
+        pos = size;
+    utf8 = xs_utf8_known(x) && xs_utf8_boundary(x, pos) &&
+           xs_utf8_validate(p, n);
+    if (xs_ext_kind(x) == XS_EXT_GAP) {
+        struct xs_gap *g = xs_gap_reserve(x, n);
+        if (!g)
+            return NULL;
+        xs_gap_move(g, pos);
+        memcpy(g->buf + g->start, p, n);
+        g->start += n;
+        xs_ext_set_size(x, size + n);
+    } else {
+        if (!xs_append_space(x, n))
+            return NULL;
+        char *data = xs_data(x);
+        memmove(data + pos + n, data + pos, size - pos);
+        memcpy(data + pos, p, n);
+        xs_set_size(x, size + n);
+    }
+    xs_set_utf8(x, utf8);
+    return x;
+}
+
+/* Remove up to @n bytes from offset @pos of @x; returns NULL, leaving @x as
+ * it was, if it is out of memory
+ */
+xs *xs_erase(xs *x, size_t pos, size_t n)
+{
+    size_t size = xs_size(x);
+
+    if (pos >= size || !n)
+        return x;
+    if (n > size - pos)
+        n = size - pos;
+
+    bool utf8 = xs_utf8_known(x) && xs_utf8_boundary(x, pos) &&
+                xs_utf8_boundary(x, pos + n);
+    if (xs_ext_kind(x) == XS_EXT_GAP) {
+        struct xs_gap *g = xs_gap_reserve(x, 0);
+        if (!g)
+            return NULL;
+        xs_gap_move(g, pos);
+        g->end += n;
+        xs_ext_set_size(x, size - n);
+    } else {
+        if (!xs_expand(x))
+            return NULL;
+        char *data = xs_data(x);
+        xs_cow_lazy_copy(x, &data);
+        memmove(data + pos, data + pos + n, size - pos - n);
+        xs_set_size(x, size - n);
+    }
+    xs_set_utf8(x, utf8);
+    return x;
+}
+
+/*
+ * Page-granular copy-on-write.  A string in paged mode is a table of pages
+ * that CoW copies share as a whole; the first change through a copy gives
+ * it a table of its own, whose pages are still shared, and then copies only
+ * the pages it writes to.  A one-byte edit of a shared 1 GB string thus
+ * costs a 128 KiB table and a 64 KiB page rather than 1 GB.  xs_set_bytes()
+ * edits in place and xs_get_bytes() reads; xs_expand() makes the string flat.
+ */
+
+/* Hold @x as reference-counted pages from now on; returns false if it is
+ * out of memory
+ */
+bool xs_paged_mode(xs *x)
+{
+    if (xs_ext_kind(x) == XS_EXT_PAGED)
+        return true;
+    if (!xs_expand(x))
+        return false;
+
+    size_t size = xs_size(x), nr = (size + XS_PAGE_SIZE - 1) >> XS_PAGE_SHIFT;
+    struct xs_paged *p = malloc(sizeof(*p) + nr * sizeof(p->page[0]));
+    const char *data = xs_data(x);
+    bool utf8 = xs_utf8_known(x);
+    if (!p)
+        return false;
+
+    for (size_t i = 0; i < nr; i++) {
+        size_t off = i << XS_PAGE_SHIFT,
+               len = size - off < XS_PAGE_SIZE ? size - off : XS_PAGE_SIZE;
+        if (!(p->page[i] = malloc(sizeof(struct xs_page) + XS_PAGE_SIZE))) {
+            while (i--)
+                free(p->page[i]);
+            free(p);
+            return false;
+        }
+        p->page[i]->refcnt = 1;
+        memcpy(p->page[i]->data, data + off, len);
+    }
+    p->ext.refcnt = 1;
+    p->ext.kind = XS_EXT_PAGED;
+    p->nr_pages = nr;
+
+    xs_free(x);
+    *x = (xs){.ptr = NULL};
+    x->is_ptr = x->is_large_string = x->is_ext = true;
+    x->ptr = (char *) p;
+    xs_ext_set_size(x, size);
+    xs_set_utf8(x, utf8);
+    return true;
+}
+
+/* The page table of @x, of its own: its pages may still be shared.  NULL if
+ * it is out of memory.
+ */
+static struct xs_paged *xs_paged_own(xs *x)
+{
+    struct xs_paged *p = (struct xs_paged *) x->ptr;
+
+    if (xs_get_ref_count(x) <= 1)
+        return p;
+
+    size_t bytes = sizeof(*p) + p->nr_pages * sizeof(p->page[0]);
+    struct xs_paged *np = malloc(bytes);
+    if (!np)
+        return NULL;
+    memcpy(np, p, bytes);
+    np->ext.refcnt = 1;
+    for (size_t i = 0; i < np->nr_pages; i++)
+        __atomic_add_fetch(&np->page[i]->refcnt, 1, __ATOMIC_RELAXED);
+
+    if (xs_dec_ref_count(x) <= 0)
+        xs_ext_free(&p->ext);
+    x->ptr = (char *) np;
+    return np;
+}
+
+/* Page @i of @p, of its own, or NULL if it is out of memory */
+static char *xs_page_own(struct xs_paged *p, size_t i)
+{
+    struct xs_page *pg = p->page[i];
+
+    if (__atomic_load_n(&pg->refcnt, __ATOMIC_ACQUIRE) == 1)
+        return pg->data;
+
+    struct xs_page *copy = malloc(sizeof(*copy) + XS_PAGE_SIZE);
+    if (!copy)
+        return NULL;
+    copy->refcnt = 1;
+    memcpy(copy->data, pg->data, XS_PAGE_SIZE);
+    if (!__atomic_sub_fetch(&pg->refcnt, 1, __ATOMIC_ACQ_REL))
+        free(pg);
+    p->page[i] = copy;
+    return copy->data;
+}
+
+/* Overwrite the bytes of @x from @pos with the @n bytes at @src, which must
+ * not be inside @x; what would go past the end is left out.  Paged and gap
+ * buffer strings are edited as they are, a shared flat one is copied first.
+ * Returns NULL, leaving @x as it was, if it is out of memory.
+ */
+xs *xs_set_bytes(xs *x, size_t pos, const void *src, size_t n)
+{
+    size_t size = xs_size(x);
+    const char *s = src;
+
+    if (pos >= size || !n)
+        return x;
+    if (n > size - pos)
+        n = size - pos;
+
+    bool utf8 = xs_utf8_known(x) && xs_utf8_boundary(x, pos) &&
+                xs_utf8_boundary(x, pos + n) && xs_utf8_validate(s, n);
+    switch (xs_ext_kind(x)) {
+    case XS_EXT_PAGED: {
+        struct xs_paged *p = xs_paged_own(x);
+        if (!p)
+            return NULL;
+        /* copy every page written to before changing any */
+        size_t last = (pos + n - 1) >> XS_PAGE_SHIFT;
+        for (size_t i = pos >> XS_PAGE_SHIFT; i <= last; i++)
+            if (!xs_page_own(p, i))
+                return NULL;
+        for (size_t done = 0, k; done < n; done += k) {
+            size_t off = (pos + done) & (XS_PAGE_SIZE - 1);
+            k = XS_PAGE_SIZE - off < n - done ? XS_PAGE_SIZE - off : n - done;
+            memcpy(p->page[(pos + done) >> XS_PAGE_SHIFT]->data + off,
+                   s + done, k);
+        }
+        break;
+    }
+    case XS_EXT_GAP: {
+        struct xs_gap *g = xs_gap_reserve(x, 0);
+        if (!g)
+            return NULL;
+        size_t head = pos >= g->start        ? 0
+                      : n < g->start - pos ? n
+                                             : g->start - pos;
+        memcpy(g->buf + pos, s, head);
+        memcpy(g->buf + g->end + (pos + head - g->start), s + head, n - head);
+        break;
+    }
+    default: {
+        if (!xs_expand(x))
+            return NULL;
+        char *data = xs_data(x);
+        xs_cow_lazy_copy(x, &data);
+        memcpy(data + pos, s, n);
+    }
+    }
+    xs_set_utf8(x, utf8);
+    return x;
+}
+
+/*
+ * Large strings shared between processes.  Their buffers come from a memfd
+ * region mapped at the same address in every process using it, so an xs
+ * holding one means the same in all of them, and its reference count, the
+ * usual atomic 4-byte header, counts holders across processes.  Children
+ * forked after xs_shm_create() inherit the mapping; other processes attach
+ * the memfd, passed over a UNIX socket for instance, with xs_shm_attach().
+ * Strings are handed over through the slots in the region or any other
+ * channel: a 16-byte xs is all it takes.  A process that dies holding
+ * references leaks them.
+ */
+#define XS_SHM_MAGIC "xsshmem1"
+#define XS_SHM_SLOTS 64
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1U
+#endif
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+struct xs_shm_header {
+    char magic[8];
+    /* where every process maps the region */
+    uint64_t base, size;
+    pthread_mutex_t lock;
+    /* free blocks by capacity, offsets from base chained through their
+     * first 8 bytes, 0 if none; past @top nothing was handed out yet
+     */
+    uint64_t free_list[64], top;
+    uint64_t in_use;
+    xs slots[XS_SHM_SLOTS];
+};
+
+static struct xs_shm_header *xs_shm;
+
+static inline size_t xs_shm_block_size(unsigned capacity)
+{
+    return (((size_t) 1 << capacity) + 4 + 15) & ~(size_t) 15;
+}
+
+static void xs_shm_lock(void)
+{
+    if (pthread_mutex_lock(&xs_shm->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&xs_shm->lock);
+}
+
+static char *xs_shm_alloc(unsigned capacity)
+{
+    size_t bytes = xs_shm_block_size(capacity);
+    char *p = NULL;
+
+    xs_shm_lock();
+    if (xs_shm->free_list[capacity]) {
+        p = (char *) xs_shm + xs_shm->free_list[capacity];
+        memcpy(&xs_shm->free_list[capacity], p, sizeof(uint64_t));
+    } else if (xs_shm->size - xs_shm->top >= bytes) {
+        p = (char *) xs_shm + xs_shm->top;
+        xs_shm->top += bytes;
+    }
+    if (p)
+        xs_shm->in_use += bytes;
+    pthread_mutex_unlock(&xs_shm->lock);
+    return p;
+}
+
+static void xs_shm_release(const xs *x)
+{
+    uint64_t off = (uintptr_t) x->ptr - xs_shm_base;
+
+    xs_shm_lock();
+    memcpy(x->ptr, &xs_shm->free_list[x->capacity], sizeof(uint64_t));
+    xs_shm->free_list[x->capacity] = off;
+    xs_shm->in_use -= xs_shm_block_size(x->capacity);
+    pthread_mutex_unlock(&xs_shm->lock);
+}
+
+static void xs_shm_set(struct xs_shm_header *h)
+{
+    xs_shm = h;
+    xs_shm_base = (uintptr_t) h;
+    xs_shm_end = xs_shm_base + h->size;
+}
+
+/* Create a region of @size bytes for this process and the ones it forks;
+ * returns its memfd, for xs_shm_attach() elsewhere, or -1 and errno
+ */
+int xs_shm_create(size_t size)
+{
+    pthread_mutexattr_t attr;
+    struct xs_shm_header *h;
+    int fd, err;
+
+    if (xs_shm || size < sizeof(*h)) {
+        errno = xs_shm ? EBUSY : EINVAL;
+        return -1;
+    }
+    fd = syscall(SYS_memfd_create, "xs", MFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, size) < 0)
+        goto fail;
+    h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (h == MAP_FAILED)
+        goto fail;
+
+    memcpy(h->magic, XS_SHM_MAGIC, sizeof(h->magic));
+    h->base = (uintptr_t) h;
+    h->size = size;
+    h->top = (sizeof(*h) + 15) & ~(size_t) 15;
+    for (int i = 0; i < XS_SHM_SLOTS; i++)
+        h->slots[i] = xs_literal_empty();
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&h->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    xs_shm_set(h);
+    return fd;
+
+fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+}
+
+/* Map the region of memfd @fd, made by xs_shm_create() in another process,
+ * at the address it has there; returns 0 or an errno value, EEXIST if that
+ * address is taken here
+ */
+int xs_shm_attach(int fd)
+{
+    struct xs_shm_header h;
+    ssize_t r;
+    void *p;
+
+    if (xs_shm)
+        return EBUSY;
+    if ((r = pread(fd, &h, sizeof(h), 0)) < 0)
+        return errno;
+    if (r != sizeof(h) || memcmp(h.magic, XS_SHM_MAGIC, sizeof(h.magic)))
+        return EINVAL;
+
+    p = mmap((void *) (uintptr_t) h.base, h.size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    if (p == MAP_FAILED)
+        return errno;
+    /* kernels before 4.17 take the address as a hint only */
+    if ((uintptr_t) p != h.base) {
+        munmap(p, h.size);
+        return EEXIST;
+    }
+    xs_shm_set(p);
+    return 0;
+}
+
+/* Build @x from the @n bytes at @p, in the shared region if it is large and
+ * there is room, on the heap otherwise
+ */
+xs *xs_shm_new(xs *x, const void *p, size_t n)
+{
+    unsigned capacity = ilog2(n + 1) + 1;
+    char *block;
+
+    *x = xs_literal_empty();
+    if (!xs_shm || n < LARGE_STRING_LEN || disable_cow ||
+        !(block = xs_shm_alloc(capacity))) {
+        memcpy(xs_append_space(x, n), p, n);
+        xs_set_size(x, n);
+        return x;
+    }
+
+    *x = (xs){.ptr = block};
+    x->is_ptr = x->is_large_string = true;
+    x->capacity = capacity;
+    x->size = n;
+    xs_set_ref_count(x, 1);
+    memcpy(block + 4, p, n);
+    block[4 + n] = 0;
+    return x;
+}
+
+/* Move large string @x into the shared region; returns whether it is there */
+bool xs_shm_share(xs *x)
+{
+    if (!xs_is_ptr(x) || !xs_is_large_string(x))
+        return false;
+    if (xs_in_shm(x))
+        return true;
+    if (!xs_expand(x))
+        return false;
+
+    bool utf8 = xs_utf8_known(x);
+    xs shared;
+    xs_shm_new(&shared, xs_data(x), xs_size(x));
+    if (!xs_in_shm(&shared)) {
+        xs_free(&shared);
+        return false;
+    }
+    xs_free(x);
+    *x = shared;
+    xs_set_utf8(x, utf8);
+    return true;
+}
+
+/* Slot @i of the region, an xs every process sees, or NULL; it may only
+ * hold strings of the region
+ */
+xs *xs_shm_slot(size_t i)
+{
+    return xs_shm && i < XS_SHM_SLOTS ? &xs_shm->slots[i] : NULL;
+}
+
+/* Bytes of the region taken by strings */
+size_t xs_shm_in_use(void)
+{
+    return xs_shm ? xs_shm->in_use : 0;
+}
+
+/* Unmap the region from this process, which must hold none of its strings
+ * any more; the memfd stays open for the caller to close
+ */
+void xs_shm_detach(void)
+{
+    if (!xs_shm)
+        return;
+    munmap(xs_shm, xs_shm->size);
+    xs_shm = NULL;
+    xs_shm_base = xs_shm_end = 0;
+}
+
+#define NR_TESTS 10000
+#define TEST_MAX_STRING (4 * 1024 * 1024 - 1)
+
+#define CONCAT_STRING_IDX_START 0
+#define CONCAT_STRING_IDX_END 99
+#define CONCAT_STRING_TIMES \
+    (CONCAT_STRING_IDX_END - CONCAT_STRING_IDX_START + 1)
+
+#define TRIM_STRING_IDX_START 100
+#define TRIM_STRING_IDX_END 199
+#define TRIM_STRING_TIMES (TRIM_STRING_IDX_END - TRIM_STRING_IDX_START + 1)
+
+enum {
+    SMALL_STRING,
+    MEDIUM_STRING,
+    LARGE_STRING,
+
+    NR_STRING_TYPE
+};
+
+static const char charset[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+static char random_string[NR_STRING_TYPE][TEST_MAX_STRING + 1];
+
+static void init_random_string(uint8_t *buf, uint32_t type)
+{
+    size_t length_array[] = {XS_INLINE_MAX, 255, TEST_MAX_STRING};
+    size_t len = length_array[type];
+    size_t n;
+
+    /* Bookmark for trimming string. */
+    buf[0] = '@';
+    for (n = 1; n < len - 1; n++)
+        buf[n] = charset[rand() % (sizeof charset - 1)];
+
+    /* Bookmark for trimming string. */
+    buf[n] = '#';
+    buf[n + 1] = 0;
+}
+
+/* bench.c shares the strings above; the tests and main stay out of it */
+#ifndef XS_NO_MAIN
+/* failed checks, reported with "[Error]: " and counted for the exit status */
+static int nr_errors;
+
+static void test_check(bool ok, const char *what)
+{
+    if (ok)
+        return;
+    printf("[Error]: %s\n", what);
+    nr_errors++;
+}
+
+static const char str_type_desc[NR_STRING_TYPE][8] = {"Small", "Medium",
+                                                      "Large"};
+static xs backup_string[NR_TESTS];
+
+static xs concat_prefix = xs_static("((("), concat_suffix = xs_static(")))");
+
+static void run_concat_test(xs *orig_string, xs *backup_string)
+{
+    int j;
+
+    printf("concatenate copied string for %d sets, ", CONCAT_STRING_TIMES);
+    for (j = CONCAT_STRING_IDX_START; j <= CONCAT_STRING_IDX_END; j++)
+        xs_concat(backup_string + j, &concat_prefix, &concat_suffix);
+
+    for (j = CONCAT_STRING_IDX_START; j <= CONCAT_STRING_IDX_END; j++) {
+        if (xs_is_large_string(backup_string + j) &&
+            xs_get_ref_count(backup_string + j) != 1) {
+            printf("[Error]: backup_string[%d] ref. count != 1\n", j);
+            nr_errors++;
+        }
+    }
+    printf("ref. count: %d\n", xs_get_ref_count(orig_string));
+}
+
+static void run_trim_test(xs *orig_string, xs *backup_string)
+{
+    int j;
+
+    printf("trim copied string for another %d sets, ", TRIM_STRING_TIMES);
+    for (j = TRIM_STRING_IDX_START; j <= TRIM_STRING_IDX_END; j++)
+        xs_trim(backup_string + j, "@#");
+
+    for (j = TRIM_STRING_IDX_START; j <= TRIM_STRING_IDX_END; j++) {
+        if (xs_is_large_string(backup_string + j) &&
+            xs_get_ref_count(backup_string + j) != 1) {
+            printf("[Error]: backup_string[%d] ref. count != 1\n", j);
+            nr_errors++;
+        }
+    }
+    printf("ref. count: %d\n", xs_get_ref_count(orig_string));
+}
+
+static void run_string_strategy_test(void)
+{
+    xs string;
+    int i, j;
+
+    srand((unsigned int) (time(NULL)));
+
+    for (i = SMALL_STRING; i < NR_STRING_TYPE; i++) {
+        init_random_string(random_string[i], i);
+
+        string = *xs_tmp(random_string[i]);
+
+        printf("-------------- %s string --------------\n", str_type_desc[i]);
+        printf("copy string %d times, ", NR_TESTS);
+
+        for (j = 0; j < NR_TESTS; j++)
+            xs_copy(&backup_string[j], &string);
+        printf("ref. count: %d\n", xs_get_ref_count(&string));
+
+        run_concat_test(&string, backup_string);
+        run_trim_test(&string, backup_string);
+        printf("------------------------------------------\n\n");
+
+        xs_free(&string);
+        for (j = 0; j < NR_TESTS; j++)
+            xs_free(&backup_string[j]);
+    }
+}
+
+static void func_test(void)
+{
+    xs string = *xs_tmp("\n foobarbar \n\n\n");
+    xs_trim(&string, "\n ");
+    printf("[%s] : %2zu\n", xs_data(&string), xs_size(&string));
+
+    xs prefix = *xs_tmp("((("), suffix = *xs_tmp(")))");
+    xs_concat(&string, &prefix, &suffix);
+    printf("[%s] : %2zu\n", xs_data(&string), xs_size(&string));
+}
+
+#define TEST_NR_KEYS 3000
+
+/* Key @i, a small, medium or large string by @i % 3 */
+static xs *test_key(xs *x, size_t i)
+{
+    static const int width[] = {4, 100, 300};
+    char buf[320];
+
+    snprintf(buf, sizeof(buf), "%0*zu", width[i % 3], i);
+    return xs_new(x, buf);
+}
+
+/* The @n bytes at @p, NULs included, as a new string */
+static xs *test_bytes(xs *x, const void *p, size_t n)
+{
+    *x = xs_literal_empty();
+    memcpy(xs_append_space(x, n), p, n);
+    xs_set_size(x, n);
+    return x;
+}
+
+/* Random inserts and erases, checked against a plain array */
+static void map_test(void)
+{
+    static void *ref[TEST_NR_KEYS];
+    size_t live = 0;
+    xs_map m;
+    xs key;
+
+    xs_map_init(&m);
+    srand(1);
+    for (int round = 0; round < 4 * TEST_NR_KEYS; round++) {
+        size_t i = rand() % TEST_NR_KEYS;
+
+        test_key(&key, i);
+        if (rand() % 3) {
+            void *v = (void *) (uintptr_t) (round + 1);
+            test_check(xs_map_insert(&m, &key, v) == !ref[i],
+                       "xs_map_insert() added an existing key");
+            live += !ref[i];
+            ref[i] = v;
+        } else {
+            test_check(xs_map_erase(&m, &key) == !!ref[i],
+                       "xs_map_erase() of a missing key");
+            live -= !!ref[i];
+            ref[i] = NULL;
+        }
+        xs_free(&key);
+    }
+    test_check(m.size == live, "xs_map size");
+    for (size_t i = 0; i < TEST_NR_KEYS; i++) {
+        void **slot = xs_map_find(&m, test_key(&key, i));
+        test_check(slot ? *slot == ref[i] : !ref[i], "xs_map_find()");
+        xs_free(&key);
+    }
+    xs_map_free(&m);
+}
+
+/* Equal large strings end up sharing one buffer, small ones are left alone */
+static void intern_test(void)
+{
+    xs a, b, c, small = *xs_tmp("tiny");
+
+    /* with CoW off there are no large strings to share */
+    if (disable_cow)
+        return;
+    xs_intern(test_key(&a, 2));
+    xs_intern(test_key(&b, 2));
+    test_check(a.ptr == b.ptr && xs_equal(&a, &b),
+               "xs_intern() of equal strings");
+    test_check(xs_get_ref_count(&a) == 3, "xs_intern() reference count");
+    xs_intern(test_key(&c, 5));
+    test_check(c.ptr != a.ptr, "xs_intern() of different strings");
+    test_check(xs_intern(&small) == &small && xs_size(&small) == 4,
+               "xs_intern() of a small string");
+
+    xs_free(&a);
+    xs_free(&b);
+    xs_free(&c);
+    xs_intern_purge();
+    xs_intern(test_key(&a, 2));
+    test_check(xs_get_ref_count(&a) == 2, "xs_intern_purge()");
+    xs_free(&a);
+    xs_intern_purge();
+}
+
+/* memcmp() over the common length, then the shorter first */
+static int test_ref_cmp(const char *a, size_t na, const char *b, size_t nb)
+{
+    int r = memcmp(a, b, na < nb ? na : nb);
+    return r ? r : (na > nb) - (na < nb);
+}
+
+/* Pairs differing in one byte, NUL and high bytes included, or in length */
+static void cmp_test(void)
+{
+    char p[400], q[400];
+
+    srand(2);
+    for (int i = 0; i < 20000; i++) {
+        size_t na = rand() % 300, nb = na;
+        xs a, b;
+
+        for (size_t j = 0; j < na; j++)
+            p[j] = "a\0\x80z"[rand() % 4];
+        memcpy(q, p, na);
+        if (rand() % 2 && na)
+            q[rand() % na] = "a\0\x80z"[rand() % 4];
+        else
+            nb = rand() % 2 ? rand() % 300 : na;
+        for (size_t j = na; j < nb; j++)
+            q[j] = "a\0\x80z"[rand() % 4];
+
+        test_bytes(&a, p, na);
+        test_bytes(&b, q, nb);
+        int ref = test_ref_cmp(p, na, q, nb), r = xs_cmp(&a, &b);
+        test_check((r > 0) - (r < 0) == (ref > 0) - (ref < 0), "xs_cmp()");
+        test_check(xs_equal(&a, &b) == !ref, "xs_equal()");
+        xs_free(&a);
+        xs_free(&b);
+    }
+}
+
+static int test_qsort_cmp(const void *a, const void *b)
+{
+    return xs_cmp(a, b);
+}
+
+/* Strings of @n, sharing prefixes and with duplicates, into @a and @b */
+static void test_fill_pair(xs *a, xs *b, size_t n)
+{
+    char p[300];
+
+    for (size_t i = 0; i < n; i++) {
+        size_t len = rand() % 8 ? rand() % 40 : 100 + rand() % 200;
+        for (size_t j = 0; j < len; j++)
+            p[j] = j < 12 ? "xs"[rand() % 2] : "ab\0\xff"[rand() % 4];
+        test_bytes(&a[i], p, len);
+        xs_copy(&b[i], &a[i]);
+    }
+}
+
+/* xs_sort() against qsort() with xs_cmp() */
+static void sort_test(void)
+{
+    enum { N = 5000 };
+    xs *a = malloc(N * sizeof(xs)), *b = malloc(N * sizeof(xs));
+
+    srand(3);
+    for (size_t n = 0; n <= N; n = n ? n * 5 : 1) {
+        test_fill_pair(a, b, n);
+        test_check(xs_sort(a, n), "xs_sort()");
+        qsort(b, n, sizeof(xs), test_qsort_cmp);
+        for (size_t i = 0; i < n; i++) {
+            test_check(xs_equal(&a[i], &b[i]), "xs_sort() order");
+            xs_free(&a[i]);
+            xs_free(&b[i]);
+        }
+    }
+    free(a);
+    free(b);
+}
+
+/* The batch operations on a pool against the same done one at a time */
+static void batch_test(void)
+{
+    enum { N = 40000 };
+    struct xs_pool *pool = xs_pool_create(4);
+    xs *a = malloc(N * sizeof(xs)), *b = malloc(N * sizeof(xs));
+    uint64_t *hash = malloc(N * sizeof(uint64_t));
+    size_t *pos = malloc(N * sizeof(size_t));
+    xs needle = *xs_tmp("sxs"), pre = *xs_tmp("<"), suf = *xs_tmp(">");
+
+    srand(4);
+    test_fill_pair(a, b, N);
+    test_check(xs_batch_sort(pool, a, N), "xs_batch_sort()");
+    xs_sort(b, N);
+    xs_batch_concat(pool, a, N, &pre, &suf);
+    xs_batch_trim(pool, a, N, "<");
+    xs_batch_hash(pool, a, N, hash);
+    xs_batch_find(pool, a, N, &needle, pos);
+    for (size_t i = 0; i < N; i++) {
+        xs_concat(&b[i], &pre, &suf);
+        xs_trim(&b[i], "<");
+        test_check(xs_equal(&a[i], &b[i]), "xs_batch_sort/concat/trim()");
+        test_check(hash[i] == xs_hash(&b[i]), "xs_batch_hash()");
+        test_check(pos[i] == xs_find(&b[i], &needle, 0), "xs_batch_find()");
+        xs_free(&a[i]);
+        xs_free(&b[i]);
+    }
+    xs_pool_destroy(pool);
+    free(a);
+    free(b);
+    free(hash);
+    free(pos);
+}
+
+/* Non-overlapping occurrences of @m bytes at @p in @n at @s, the plain way */
+static size_t test_ref_count(const char *s, size_t n, const char *p, size_t m)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; m && i + m <= n;) {
+        if (!memcmp(s + i, p, m)) {
+            count++;
+            i += m;
+        } else {
+            i++;
+        }
+    }
+    return count;
+}
+
+/* Searches, counts, copies and case changes of a 1 MiB string split across
+ * a pool, self-overlapping needles included, against the plain way
+ */
+static void parallel_test(void)
+{
+    static const char *const needles[] = {"ab", "aaaa", "abab", "bbbbbb",
+                                          "q"};
+    enum { N = 1 << 20 };
+    struct xs_pool *pool = xs_pool_create(4);
+    char *buf = malloc(N + 1);
+    xs x, copy, needle;
+
+    srand(5);
+    for (size_t i = 0; i < N; i++)
+        buf[i] = rand() % 5 ? 'a' : 'b';
+    buf[N] = 0;
+    xs_new(&x, buf);
+    xs_set_pool(pool, 4096);
+
+    for (size_t k = 0; k < sizeof(needles) / sizeof(needles[0]); k++) {
+        const char *p = needles[k];
+        size_t m = strlen(p);
+
+        xs_new(&needle, p);
+        test_check(xs_count(&x, &needle) == test_ref_count(buf, N, p, m),
+                   "xs_count() on a pool");
+        for (size_t from = 0; from < N; from += N / 7) {
+            size_t at = from;
+            while (at + m <= N && memcmp(buf + at, p, m))
+                at++;
+            test_check(xs_find(&x, &needle, from) ==
+                           (at + m <= N ? at : XS_NPOS),
+                       "xs_find() on a pool");
+        }
+        xs_free(&needle);
+    }
+
+    xs_copy(&copy, &x);
+    xs_toupper(&copy);
+    for (size_t i = 0; i < N; i++)
+        buf[i] = toupper((unsigned char) buf[i]);
+    test_check(xs_size(&copy) == N && !memcmp(xs_data(&copy), buf, N),
+               "xs_toupper() on a pool");
+    test_check(xs_data(&x)[0] == 'a' || xs_data(&x)[0] == 'b',
+               "xs_toupper() changed a CoW copy");
+
+    xs_set_pool(NULL, 0);
+    xs_pool_destroy(pool);
+    xs_free(&copy);
+    xs_free(&x);
+    free(buf);
+}
+
+static void test_lower(char *d, const char *s, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        d[i] = s[i] >= 'A' && s[i] <= 'Z' ? s[i] + 32 : s[i];
+}
+
+/* Case changes, xs_casecmp() and xs_casefind() on any bytes against plain
+ * ASCII loops
+ */
+static void case_test(void)
+{
+    char p[400], q[400], lp[400], lq[400];
+
+    srand(6);
+    for (int i = 0; i < 5000; i++) {
+        size_t na = rand() % 400, nb = rand() % 8;
+        xs a, b;
+
+        for (size_t j = 0; j < na; j++)
+            p[j] = "aZ@[`{\xc3\x80"[rand() % 8];
+        /* b is a piece of a, its case shuffled, or random */
+        size_t at = na > nb ? rand() % (na - nb) : 0;
+        for (size_t j = 0; j < nb; j++)
+            q[j] = rand() % 4 && at + j < na ? p[at + j] ^ (rand() % 2 * 32)
+                                            : "aZ@"[rand() % 3];
+        test_lower(lp, p, na);
+        test_lower(lq, q, nb);
+
+        test_bytes(&a, p, na);
+        test_bytes(&b, q, nb);
+        int ref = test_ref_cmp(lp, na, lq, nb), r = xs_casecmp(&a, &b);
+        test_check((r > 0) - (r < 0) == (ref > 0) - (ref < 0),
+                   "xs_casecmp()");
+
+        size_t hit = 0;
+        while (hit + nb <= na && memcmp(lp + hit, lq, nb))
+            hit++;
+        test_check(xs_casefind(&a, &b, 0) == (hit + nb <= na ? hit : XS_NPOS),
+                   "xs_casefind()");
+
+        xs_tolower(&a);
+        test_check(xs_size(&a) == na && !memcmp(xs_data(&a), lp, na),
+                   "xs_tolower()");
+        xs_toupper(&a);
+        for (size_t j = 0; j < na; j++)
+            lp[j] = lp[j] >= 'a' && lp[j] <= 'z' ? lp[j] - 32 : lp[j];
+        test_check(!memcmp(xs_data(&a), lp, na), "xs_toupper()");
+        xs_free(&a);
+        xs_free(&b);
+    }
+}
+
+/* Sequences placed at every offset of ASCII text, so the vector loops, their
+ * tails and the spots in between all see them
+ */
+static void utf8_test(void)
+{
+    static const struct {
+        const char *s;
+        size_t points; /* 0: invalid */
+    } cases[] = {
+        {"\xe2\x82\xac", 1},     {"\xf0\x9f\x98\x80", 1},
+        {"\xc3\xa9\xc3\xa9", 2}, {"\xef\xbf\xbf", 1},
+        {"\xc0\x80", 0},         {"\xed\xa0\x80", 0},
+        {"\xf4\x90\x80\x80", 0}, {"\xe2\x82", 0},
+        {"\x80", 0},             {"\xf8\x88\x80\x80\x80", 0},
+    };
+    char buf[160];
+
+    for (size_t k = 0; k < sizeof(cases) / sizeof(cases[0]); k++) {
+        size_t len = strlen(cases[k].s);
+        for (size_t at = 0; at + len <= 100; at++) {
+            xs x;
+
+            memset(buf, 'a', 100);
+            memcpy(buf + at, cases[k].s, len);
+            test_bytes(&x, buf, 100);
+            test_check(xs_utf8_valid(&x) == !!cases[k].points,
+                       "xs_utf8_valid()");
+            test_check(xs_utf8_length(&x) ==
+                           (cases[k].points ? 100 - len + cases[k].points
+                                            : XS_NPOS),
+                       "xs_utf8_length()");
+            xs_free(&x);
+        }
+    }
+}
+
+/* Random 64-bit values, of every length rather than mostly 19 digits */
+static uint64_t test_rand64(void)
+{
+    uint64_t v = (uint64_t) rand() << 40 ^ (uint64_t) rand() << 20 ^ rand();
+    return v >> rand() % 64;
+}
+
+/* Integers against snprintf(), doubles through a strtod() round trip, and
+ * malformed or overflowing input rejected
+ */
+static void number_test(void)
+{
+    static const char *const bad[] = {"", "-", "+", "12a", " 1", "1 ",
+                                      "9223372036854775808",
+                                      "-9223372036854775809", "0x10"};
+    static const char *const reals[] = {"0.1", "-2.5e-3", "1e308", "4.9e-324",
+                                        "123456789012345678901234", "1e400",
+                                        "-0", ".5", "5."};
+    char ref[64];
+    xs x;
+    int64_t i64;
+    double d;
+
+    srand(7);
+    for (int i = 0; i < 20000; i++) {
+        uint64_t u = test_rand64();
+        int64_t v = (int64_t) (rand() % 2 ? u : 0 - u);
+
+        if (i < 4)
+            v = (int64_t[]){0, -1, INT64_MAX, INT64_MIN}[i];
+        snprintf(ref, sizeof(ref), "%lld", (long long) v);
+        xs_append_int(xs_newempty(&x), v);
+        test_check(!strcmp(xs_data(&x), ref), "xs_append_int()");
+        test_check(xs_to_int64(&x, &i64) && i64 == v, "xs_to_int64()");
+        xs_free(&x);
+
+        snprintf(ref, sizeof(ref), "%llu", (unsigned long long) u);
+        xs_append_uint(xs_newempty(&x), u);
+        test_check(!strcmp(xs_data(&x), ref), "xs_append_uint()");
+        xs_free(&x);
+
+        memcpy(&d, &u, sizeof(d));
+        if (d != d)
+            continue;
+        xs_append_double(xs_newempty(&x), d);
+        double back = strtod(xs_data(&x), NULL);
+        test_check(!memcmp(&back, &d, sizeof(d)) || (!d && !back),
+                   "xs_append_double() round trip");
+        test_check(xs_to_double(&x, &back) && back == d, "xs_to_double()");
+        xs_free(&x);
+    }
+    for (size_t k = 0; k < sizeof(bad) / sizeof(bad[0]); k++) {
+        xs_new(&x, bad[k]);
+        test_check(!xs_to_int64(&x, &i64), "xs_to_int64() of bad input");
+        xs_free(&x);
+    }
+    for (size_t k = 0; k < sizeof(reals) / sizeof(reals[0]); k++) {
+        xs_new(&x, reals[k]);
+        test_check(xs_to_double(&x, &d) && d == strtod(reals[k], NULL),
+                   "xs_to_double() against strtod()");
+        xs_free(&x);
+    }
+}
+
+/* xs_printf() against snprintf(), %S against %s, and %S of the destination */
+static void printf_test(void)
+{
+    char ref[2048], big[1000];
+    xs x = xs_literal_empty(), s;
+
+    memset(big, 'b', sizeof(big) - 1);
+    big[sizeof(big) - 1] = 0;
+    for (int w = 0; w < 600; w += 37) {
+        /* the last @w bytes of big */
+        const char *tail = big + sizeof(big) - 1 - w;
+
+        snprintf(ref, sizeof(ref), "%d|%-*s|%.3f|%x|%*s", w, w, "ab", w / 7.0,
+                 w, w, tail);
+        test_check(xs_printf(&x, "%d|%-*s|%.3f|%x|%*s", w, w, "ab", w / 7.0,
+                             w, w, tail) == &x &&
+                       !strcmp(xs_data(&x), ref) && xs_size(&x) == strlen(ref),
+                   "xs_printf()");
+
+        xs_new(&s, tail);
+        snprintf(ref, sizeof(ref), "[%10s][%-5.4s][%s]", tail, tail, tail);
+        xs_printf(&x, "[%10S][%-5.4S][%S]", &s, &s, &s);
+        test_check(!strcmp(xs_data(&x), ref), "xs_printf() %S");
+
+        size_t len = xs_size(&x);
+        test_check(xs_printf_append(&x, "%S", &x) == &x &&
+                       xs_size(&x) == 2 * len &&
+                       !memcmp(xs_data(&x) + len, xs_data(&x), len),
+                   "xs_printf_append() of itself");
+        xs_printf(&x, "%S!", &x);
+        test_check(xs_size(&x) == 2 * len + 1 && xs_data(&x)[2 * len] == '!',
+                   "xs_printf() of itself");
+        xs_free(&s);
+    }
+    xs_free(&x);
+}
+
+/* xs_new_batch() against strings made one at a time; a change to a string
+ * borrowing the slab must not reach its neighbours
+ */
+static void new_batch_test(void)
+{
+    enum { N = 500 };
+    static char text[N * 400];
+    static const char *ptrs[N];
+    static size_t lens[N];
+    xs *out = malloc(N * sizeof(xs)), one;
+    size_t off = 0;
+
+    srand(8);
+    for (size_t i = 0; i < sizeof(text); i++)
+        text[i] = charset[rand() % (sizeof charset - 1)];
+    for (size_t i = 0; i < N; i++) {
+        lens[i] = rand() % 400;
+        ptrs[i] = text + off;
+        off += lens[i];
+    }
+    void *slab = xs_new_batch(out, ptrs, lens, N);
+
+    for (size_t i = 0; i < N; i++) {
+        test_bytes(&one, ptrs[i], lens[i]);
+        test_check(xs_equal(&out[i], &one), "xs_new_batch()");
+        xs_free(&one);
+    }
+    for (size_t i = 0; i < N; i += 2)
+        xs_concat(&out[i], &concat_prefix, &concat_suffix);
+    for (size_t i = 1; i < N; i += 2) {
+        test_bytes(&one, ptrs[i], lens[i]);
+        test_check(xs_equal(&out[i], &one), "xs_new_batch() neighbours");
+        xs_free(&one);
+    }
+    for (size_t i = 0; i < N; i++)
+        xs_free(&out[i]);
+    free(slab);
+    free(out);
+}
+
+/* Strings across the inline limit of the layout built: made at once, and
+ * grown a byte at a time
+ */
+static void layout_test(void)
+{
+    char ref[XS_INLINE_SIZE + 8];
+    xs x = xs_literal_empty(), y, c = *xs_tmp("c"), empty = *xs_tmp("");
+
+    test_check(sizeof(xs) == XS_INLINE_SIZE, "xs size");
+    for (size_t n = 1; n <= XS_INLINE_SIZE + 4; n++) {
+        xs_concat(&x, &empty, &c);
+        memset(ref, 'c', n);
+        ref[n] = 0;
+        xs_new(&y, ref);
+        test_check(xs_size(&x) == n && !strcmp(xs_data(&x), ref),
+                   "growing across the inline limit");
+        test_check(xs_size(&y) == n && !strcmp(xs_data(&y), ref) &&
+                       xs_is_ptr(&y) == (n > XS_INLINE_MAX),
+                   "inline limit");
+        xs_free(&y);
+    }
+    xs_free(&x);
+}
+
+/* Copies of a constant share its bytes, changes go to a copy of their own,
+ * and freeing only empties the handle
+ */
+static void static_test(void)
+{
+    static const xs greeting = xs_static("hello, static string");
+    xs a = greeting, b;
+
+    xs_copy(&b, &a);
+    test_check(b.ptr == greeting.ptr && xs_equal(&b, &greeting),
+               "xs_copy() of a constant");
+    xs_toupper(&b);
+    test_check(!strcmp(xs_data(&b), "HELLO, STATIC STRING") &&
+                   !strcmp(xs_data(&greeting), "hello, static string"),
+               "changing a copy of a constant");
+    xs_concat(&a, &concat_prefix, &concat_suffix);
+    test_check(!strcmp(xs_data(&a), "(((hello, static string)))") &&
+                   a.ptr != greeting.ptr,
+               "xs_concat() of a constant");
+    xs_free(&a);
+    xs_free(&b);
+
+    a = greeting;
+    xs_free(&a);
+    test_check(!xs_is_ptr(&a) && !xs_size(&a), "xs_free() of a constant");
+    test_check(xs_size(&greeting) == 20, "constant after xs_free()");
+}
+
+/* The @n bytes written to @fd from its start, compared with @ref */
+static bool test_file_is(int fd, const char *ref, size_t n)
+{
+    char *buf = malloc(n + 1);
+    bool ok = buf && pread(fd, buf, n + 1, 0) == (ssize_t) n &&
+              !memcmp(buf, ref, n);
+
+    free(buf);
+    return ok;
+}
+
+/* xs_writev() and xs_writer to a file, read back; the writer's small and
+ * large strings are freed before the flush, which pins them
+ */
+static void writer_test(void)
+{
+    enum { N = 3000 };
+    char path[] = "/tmp/xs-test-XXXXXX";
+    int fd = mkstemp(path);
+    xs *arr = malloc(N * sizeof(xs));
+    char *ref = malloc(N * 300);
+    size_t total = 0;
+
+    if (fd < 0)
+        return test_check(false, "mkstemp() for the writer test");
+    unlink(path);
+    srand(9);
+    for (size_t i = 0; i < N; i++) {
+        test_key(&arr[i], i);
+        memcpy(ref + total, xs_data(&arr[i]), xs_size(&arr[i]));
+        total += xs_size(&arr[i]);
+    }
+
+    test_check(xs_writev(fd, arr, N) == (ssize_t) total &&
+                   test_file_is(fd, ref, total),
+               "xs_writev()");
+
+    struct xs_writer *w = NULL;
+    if (ftruncate(fd, 0) || lseek(fd, 0, SEEK_SET) ||
+        !(w = xs_writer_create(fd)))
+        test_check(false, "xs_writer_create()");
+    for (size_t i = 0; w && i < N; i += 500) {
+        test_check(!xs_writer_add(w, arr + i, 500), "xs_writer_add()");
+        /* keep only the medium strings, which are not pinned */
+        for (size_t j = i; j < i + 500; j++)
+            if (j % 3 != 1)
+                xs_free(&arr[j]);
+    }
+    if (w)
+        test_check(!xs_writer_destroy(w) && test_file_is(fd, ref, total),
+                   "xs_writer");
+
+    /* Every write fails while the queue is full: the chain in flight must
+     * be collected before the strings pinned for it are let go, and every
+     * pin released in the end.
+     */
+    enum { FULL = 3 * XS_WRITER_DEPTH * XS_IOV_MAX };
+    int dev_full = open("/dev/full", O_WRONLY | O_CLOEXEC);
+    xs *copies = malloc(FULL * sizeof(xs)), big;
+    test_bytes(&big, ref, 2 * LARGE_STRING_LEN);
+    for (size_t i = 0; i < FULL; i++)
+        xs_copy(&copies[i], &big);
+    if (dev_full >= 0 && (w = xs_writer_create(dev_full))) {
+        for (size_t i = 0; i < FULL; i += 128) {
+            int e = xs_writer_add(w, copies + i, 128);
+            test_check(!e || e == ENOSPC, "xs_writer_add() error");
+            for (size_t j = i; j < i + 128; j++)
+                xs_free(&copies[j]);
+        }
+        test_check(xs_writer_destroy(w) == ENOSPC &&
+                       (disable_cow || xs_get_ref_count(&big) == 1),
+                   "xs_writer after a failed write");
+    }
+    for (size_t i = 0; i < FULL; i++)
+        xs_free(&copies[i]);
+    xs_free(&big);
+    free(copies);
+    if (dev_full >= 0)
+        close(dev_full);
+
+    for (size_t i = 0; i < N; i++)
+        xs_free(&arr[i]);
+    free(arr);
+    free(ref);
+    close(fd);
+}
+
+/* Files of 0 bytes to 200 KB, a missing one and a procfs one, read into
+ * strings already holding something
+ */
+static void read_test(void)
+{
+    enum { N = 5 };
+    static const size_t sizes[N - 1] = {0, 10, 300, 200000};
+    char dir[] = "/tmp/xs-test-XXXXXX", paths[N][64];
+    const char *ptrs[N];
+    xs out[N], one;
+    int err[N];
+
+    if (!mkdtemp(dir))
+        return test_check(false, "mkdtemp() for the read test");
+    init_random_string((uint8_t *) random_string[LARGE_STRING], LARGE_STRING);
+    for (int i = 0; i < N; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "%s/%d", dir, i);
+        ptrs[i] = paths[i];
+        if (i == N - 1)
+            break;
+        int fd = open(paths[i], O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        test_check(fd >= 0 && write(fd, random_string[LARGE_STRING],
+                                    sizes[i]) == (ssize_t) sizes[i],
+                   "writing a file for the read test");
+        close(fd);
+    }
+
+    for (int i = 0; i < N; i++) {
+        test_key(&one, 2);
+        int e = xs_read_file(&one, paths[i]);
+        test_check(i < N - 1 ? !e && xs_size(&one) == sizes[i] &&
+                                   !memcmp(xs_data(&one),
+                                           random_string[LARGE_STRING],
+                                           sizes[i])
+                             : e == ENOENT && !xs_size(&one),
+                   "xs_read_file()");
+        xs_free(&one);
+        test_key(&out[i], i);
+    }
+    /* nothing left in flight: every file fails to open, or is empty */
+    for (int k = 0; k < 2; k++) {
+        const char *same[2] = {ptrs[k ? 0 : N - 1], ptrs[k ? 0 : N - 1]};
+        xs two[2];
+
+        test_key(&two[0], 1);
+        test_key(&two[1], 2);
+        test_check(xs_read_files(two, same, 2, err) == (size_t) (k ? 2 : 0) &&
+                       !xs_size(&two[0]) && !xs_size(&two[1]),
+                   "xs_read_files() with nothing to wait for");
+        xs_free(&two[0]);
+        xs_free(&two[1]);
+    }
+    test_check(xs_read_files(out, ptrs, N, err) == N - 1, "xs_read_files()");
+    for (int i = 0; i < N; i++) {
+        test_check(i < N - 1 ? !err[i] && xs_size(&out[i]) == sizes[i] &&
+                                   !memcmp(xs_data(&out[i]),
+                                           random_string[LARGE_STRING],
+                                           sizes[i])
+                             : err[i] == ENOENT && !xs_size(&out[i]),
+                   "xs_read_files() contents");
+        xs_free(&out[i]);
+        unlink(paths[i]);
+    }
+    rmdir(dir);
+
+    test_check(!xs_read_file(xs_newempty(&one), "/proc/self/stat") &&
+                   xs_size(&one) > 0,
+               "xs_read_file() of a file of unknown size");
+    xs_free(&one);
+}
+
+/* xs_save() and the archive read back, by index and all at once; a change
+ * to a string borrowing the mapping stays in that string, and a truncated
+ * file is refused
+ */
+static void archive_test(void)
+{
+    enum { N = 1000 };
+    char path[] = "/tmp/xs-test-XXXXXX";
+    int fd = mkstemp(path);
+    xs *arr = malloc(N * sizeof(xs)), *all = malloc(N * sizeof(xs)), x;
+    struct xs_archive a;
+
+    if (fd < 0)
+        return test_check(false, "mkstemp() for the archive test");
+    for (size_t i = 0; i < N; i++)
+        test_key(&arr[i], i);
+    xs_free(&arr[7]);
+
+    test_check(!xs_save(path, arr, N) && !xs_archive_open(&a, path) &&
+                   a.n == N,
+               "xs_save() and xs_archive_open()");
+    for (size_t i = 0; a.n == N && i < N; i++) {
+        test_check(xs_equal(xs_archive_get(&a, i, &x), &arr[i]),
+                   "xs_archive_get()");
+        xs_free(&x);
+    }
+    if (a.n == N) {
+        xs_archive_load(&a, all);
+        for (size_t i = 0; i < N; i++)
+            xs_concat(&all[i], &concat_prefix, &concat_suffix);
+        for (size_t i = 0; i < N; i++) {
+            test_check(xs_size(&all[i]) == xs_size(&arr[i]) + 6 &&
+                           xs_equal(xs_archive_get(&a, i, &x), &arr[i]),
+                       "changing a string borrowed from an archive");
+            xs_free(&x);
+            xs_free(&all[i]);
+        }
+    }
+    xs_archive_close(&a);
+
+    /* an index past the end, and a blob size that wraps the sum around */
+    struct xs_archive_header h;
+    struct stat st;
+    test_check(!fstat(fd, &st) && pread(fd, &h, sizeof(h), 0) == sizeof(h),
+               "reading an archive header");
+    h.n = st.st_size;
+    h.blob_size = (uint64_t) st.st_size - (sizeof(h) + (h.n + 1) * 8);
+    test_check(pwrite(fd, &h, sizeof(h), 0) == sizeof(h) &&
+                   xs_archive_open(&a, path) == EINVAL,
+               "xs_archive_open() of a wrapping header");
+
+    test_check(!ftruncate(fd, 100) && xs_archive_open(&a, path) == EINVAL,
+               "xs_archive_open() of a truncated file");
+    close(fd);
+    unlink(path);
+    for (size_t i = 0; i < N; i++)
+        xs_free(&arr[i]);
+    free(arr);
+    free(all);
+}
+
+static bool test_count_key(const xs *key, size_t i, void *arg)
+{
+    (void) key, (void) i;
+    ++*(size_t *) arg;
+    return true;
+}
+
+/* Front-coded lookups, rebuilt keys and prefix walks against the sorted
+ * array the dictionary was built from
+ */
+static void fcdict_test(void)
+{
+    enum { N = 3000 };
+    xs *keys = malloc(N * sizeof(xs)), *copies = malloc(N * sizeof(xs)), x;
+    xs empty = *xs_tmp(""), one = *xs_tmp("\x01");
+    struct xs_fcdict d;
+    size_t n = 0, at;
+
+    srand(10);
+    test_fill_pair(keys, copies, N);
+    xs_sort(keys, N);
+    /* distinct keys to the front, duplicates to the back */
+    for (size_t i = 0; i < N; i++) {
+        if (n && xs_equal(&keys[n - 1], &keys[i]))
+            continue;
+        xs t = keys[n];
+        keys[n++] = keys[i];
+        keys[i] = t;
+    }
+
+    test_check(!xs_fcdict_build(&d, keys, 0) && !d.n,
+               "xs_fcdict_build() of nothing");
+    xs_fcdict_free(&d);
+    if (xs_fcdict_build(&d, keys, n)) {
+        test_check(false, "xs_fcdict_build()");
+        n = 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+        test_check(xs_fcdict_find(&d, &keys[i], &at) && at == i,
+                   "xs_fcdict_find()");
+        test_check(xs_equal(xs_fcdict_get(&d, i, &x), &keys[i]),
+                   "xs_fcdict_get()");
+        xs_free(&x);
+
+        /* a key and a byte more is found only if it is a key itself */
+        xs_copy(&x, &keys[i]);
+        xs_concat(&x, &empty, &one);
+        test_check(!xs_fcdict_find(&d, &x, NULL) ||
+                       (i + 1 < n && xs_equal(&x, &keys[i + 1])),
+                   "xs_fcdict_find() of a missing key");
+        xs_free(&x);
+    }
+    for (size_t len = 0; len < 6; len++) {
+        xs prefix;
+        size_t count = 0, ref = 0;
+
+        test_bytes(&prefix, xs_data(&keys[n / 2]),
+                   len < xs_size(&keys[n / 2]) ? len : xs_size(&keys[n / 2]));
+        for (size_t i = 0; i < n; i++)
+            ref += xs_size(&keys[i]) >= xs_size(&prefix) &&
+                   !memcmp(xs_data(&keys[i]), xs_data(&prefix),
+                           xs_size(&prefix));
+        test_check(xs_fcdict_prefix(&d, &prefix, test_count_key, &count) ==
+                           ref &&
+                       count == ref,
+                   "xs_fcdict_prefix()");
+        xs_free(&prefix);
+    }
+    xs_fcdict_free(&d);
+
+    if (n > 1) {
+        xs t = keys[0];
+        keys[0] = keys[1];
+        keys[1] = t;
+        test_check(xs_fcdict_build(&d, keys, n) == EINVAL,
+                   "xs_fcdict_build() of unsorted keys");
+    }
+    for (size_t i = 0; i < N; i++) {
+        xs_free(&keys[i]);
+        xs_free(&copies[i]);
+    }
+    free(keys);
+    free(copies);
+}
+
+/* The functions that only read a string, on @x held in another form against
+ * @flat, a flat string with the same bytes
+ */
+static void test_readers(const xs *x, const xs *flat)
+{
+    size_t size = xs_size(flat), at, count = 0;
+    const char *s = xs_data(flat);
+    const xs arr[2] = {*flat, *x};
+    xs a = xs_literal_empty(), b = xs_literal_empty(), part;
+    int64_t i64[2];
+    double d[2];
+    xs_map m;
+    struct xs_fcdict fc;
+    struct xs_archive ar;
+
+    test_check(xs_equal(x, flat) && xs_equal(flat, x) && !xs_cmp(x, flat) &&
+                   !xs_casecmp(flat, x) && xs_hash(x) == xs_hash(flat),
+               "comparing a string in another form");
+    test_bytes(&part, s + size / 2, size - size / 2 < 16 ? size - size / 2 : 16);
+    test_check(xs_find(x, &part, 0) == xs_find(flat, &part, 0) &&
+                   xs_find(flat, x, 0) == 0 &&
+                   xs_casefind(x, &part, 1) == xs_casefind(flat, &part, 1) &&
+                   xs_count(x, &part) == xs_count(flat, &part) &&
+                   xs_count(flat, x) == !!size,
+               "searching a string in another form");
+    test_check(xs_to_int64(x, &i64[0]) == xs_to_int64(flat, &i64[1]) &&
+                   xs_to_double(x, &d[0]) == xs_to_double(flat, &d[1]),
+               "parsing a string in another form");
+
+    xs_map_init(&m);
+    test_check(xs_map_insert(&m, x, &m) == 1 &&
+                   xs_map_insert(&m, flat, NULL) == 0 && xs_map_find(&m, x) &&
+                   xs_map_erase(&m, x) && !m.size,
+               "xs_map keyed by a string in another form");
+    xs_map_free(&m);
+
+    test_check(xs_printf(&a, "<%S>", x) == &a &&
+                   xs_printf(&b, "<%S>", flat) == &b && xs_equal(&a, &b),
+               "xs_printf() %S of a string in another form");
+    test_check(xs_concat(&a, x, x) && xs_concat(&b, flat, flat) &&
+                   xs_equal(&a, &b),
+               "xs_concat() of a string in another form");
+
+    test_check(!xs_fcdict_build(&fc, x, 1) &&
+                   xs_fcdict_find(&fc, flat, &at) &&
+                   xs_fcdict_find(&fc, x, &at) &&
+                   xs_fcdict_prefix(&fc, x, test_count_key, &count) == 1,
+               "xs_fcdict of a string in another form");
+    xs_fcdict_free(&fc);
+
+    struct xs_dict_column col;
+    uint32_t code;
+    xs_dict_column_init(&col);
+    test_check(xs_dict_column_append(&col, x) == 0 &&
+                   xs_dict_column_append(&col, flat) == 0 &&
+                   xs_dict_column_find(&col, flat, &code) && !code &&
+                   xs_dict_column_find(&col, x, &code) && !code,
+               "xs_dict_column of a string in another form");
+    xs_dict_column_free(&col);
+
+    xs_free(&a);
+    xs_free(&b);
+    test_check(xs_append_json_escaped(&a, x) &&
+                   xs_append_json_escaped(&b, flat) &&
+                   xs_append_csv_escaped(&a, x, ',') &&
+                   xs_append_csv_escaped(&b, flat, ',') &&
+                   xs_append_json_unescaped(&a, x) ==
+                       xs_append_json_unescaped(&b, flat) &&
+                   xs_append_csv_unescaped(&a, x) ==
+                       xs_append_csv_unescaped(&b, flat) &&
+                   xs_equal(&a, &b),
+               "escaping a string in another form");
+
+    xs_free(&a);
+    xs_free(&b);
+    xs_copy(&a, (xs *) flat);
+    xs_copy(&b, (xs *) flat);
+    test_check(xs_replace_all(&a, &part, x) &&
+                   xs_replace_all(&b, &part, flat) && xs_equal(&a, &b) &&
+                   xs_replace_multi(&a, x, &part, 1) &&
+                   xs_replace_multi(&b, flat, &part, 1) && xs_equal(&a, &b),
+               "replacing with a string in another form");
+
+    char path[] = "/tmp/xs-test-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return test_check(false, "mkstemp() for the reader test");
+    test_check(xs_writev(fd, arr, 2) == (ssize_t) (2 * size) &&
+                   !xs_read_file(&a, path) && xs_size(&a) == 2 * size &&
+                   !memcmp(xs_data(&a), s, size) &&
+                   !memcmp(xs_data(&a) + size, s, size),
+               "xs_writev() of a string in another form");
+    close(fd);
+    bool saved = !xs_save(path, arr, 2) && !xs_archive_open(&ar, path);
+    xs_free(&b);
+    test_check(saved && xs_equal(xs_archive_get(&ar, 1, &b), flat),
+               "xs_save() of a string in another form");
+    if (saved)
+        xs_archive_close(&ar);
+    unlink(path);
+    xs_free(&part);
+    xs_free(&a);
+    xs_free(&b);
+}
+
+/* Compression round trips of repetitive and random text of many sizes,
+ * reads of compressed strings, and copies expanded one at a time
+ */
+static void compress_test(void)
+{
+    enum { N = 300000 };
+    char *text = malloc(N), *noise = malloc(N), part[64];
+    size_t off = 0;
+
+    srand(11);
+    for (size_t i = 0; i < N; i++)
+        noise[i] = rand();
+    while (off < N) {
+        int n = snprintf(part, sizeof(part), "GET /item/%d HTTP/1.1 %d\n",
+                         rand() % 50, rand() % 3 ? 200 : 404);
+        memcpy(text + off, part, off + n < N ? (size_t) n : N - off);
+        off += n;
+    }
+    for (size_t size = 1000; size <= N; size = size * 3 + 17) {
+        for (int random = 0; random < 2; random++) {
+            const char *src = random ? noise : text;
+            xs x, copy;
+            char buf[100];
+
+            test_bytes(&x, src, size);
+            if (!xs_compress(&x)) {
+                test_check(random || size < XS_COMPRESS_MIN || disable_cow,
+                           "xs_compress() of repetitive text");
+                xs_free(&x);
+                continue;
+            }
+            test_check(!xs_data(&x), "xs_data() of a compressed string");
+            test_check(xs_get_bytes(&x, size / 3, buf, sizeof(buf)) ==
+                               sizeof(buf) &&
+                           !memcmp(buf, src + size / 3, sizeof(buf)),
+                       "xs_get_bytes() of a compressed string");
+            xs_copy(&copy, &x);
+            test_check(xs_expand(&copy) && x.is_ext &&
+                           xs_size(&copy) == size &&
+                           !memcmp(xs_data(&copy), src, size),
+                       "xs_expand()");
+            test_readers(&x, &copy);
+            test_check(xs_expand(&x) && !memcmp(xs_data(&x), xs_data(&copy),
+                                                size),
+                       "xs_expand() of the last copy");
+            xs_free(&copy);
+            xs_free(&x);
+        }
+    }
+
+    /* a clock sweep compresses what was not expanded since the last one */
+    xs cache[4];
+    for (int i = 0; i < 4; i++)
+        test_bytes(&cache[i], text, 65536);
+    xs_compress_idle(cache, 4);
+    xs_expand(&cache[0]);
+    xs_compress_idle(cache, 4);
+    test_check(disable_cow || (!cache[0].is_ext && cache[1].is_ext),
+               "xs_compress_idle() second chance");
+    if (cache[1].is_ext)
+        test_readers(&cache[1], &cache[0]);
+    xs_compress_idle(cache, 4);
+    test_check(disable_cow || cache[0].is_ext, "xs_compress_idle()");
+    for (int i = 0; i < 4; i++)
+        xs_free(&cache[i]);
+    free(text);
+    free(noise);
+}
+
+/* A dictionary-encoded column against the plain array of its rows */
+static void column_test(void)
+{
+    enum { N = 20000, DISTINCT = 50 };
+    xs *rows = malloc(N * sizeof(xs)), *out = malloc(N * sizeof(xs)), x;
+    size_t *hits = malloc(N * sizeof(size_t));
+    struct xs_dict_column c;
+
+    srand(12);
+    xs_dict_column_init(&c);
+    for (size_t i = 0; i < N; i++) {
+        test_key(&rows[i], rand() % DISTINCT);
+        test_check(xs_dict_column_append(&c, &rows[i]) != XS_DICT_NOCODE,
+                   "xs_dict_column_append()");
+    }
+    test_check(c.nr_rows == N && c.nr_values <= DISTINCT,
+               "xs_dict_column sizes");
+
+    xs_dict_column_materialize(&c, 0, N, out);
+    for (size_t i = 0; i < N; i++) {
+        test_check(xs_equal(&out[i], &rows[i]) &&
+                       xs_equal(xs_dict_column_get(&c, i), &rows[i]),
+                   "xs_dict_column_materialize()");
+        xs_free(&out[i]);
+    }
+    for (size_t v = 0; v <= DISTINCT; v++) {
+        size_t n = xs_dict_column_filter_eq(&c, test_key(&x, v), hits), k = 0;
+        for (size_t i = 0; i < N; i++)
+            if (xs_equal(&rows[i], &x))
+                test_check(k < n && hits[k++] == i,
+                           "xs_dict_column_filter_eq() rows");
+        test_check(k == n, "xs_dict_column_filter_eq() count");
+        xs_free(&x);
+    }
+
+    xs_dict_column_free(&c);
+    for (size_t i = 0; i < N; i++)
+        xs_free(&rows[i]);
+    free(rows);
+    free(out);
+    free(hits);
+}
+
+/* Base64 of @n bytes at @p into @out, one sextet at a time */
+static size_t test_base64(const uint8_t *p, size_t n, char *out)
+{
+    size_t len = 0;
+
+    for (size_t bit = 0; bit < 8 * n; bit += 6) {
+        unsigned v = 0;
+        for (size_t b = bit; b < bit + 6; b++)
+            v = v << 1 | (b < 8 * n ? p[b / 8] >> (7 - b % 8) & 1 : 0);
+        out[len++] = v < 26   ? 'A' + v
+                     : v < 52 ? 'a' + v - 26
+                     : v < 62 ? '0' + v - 52
+                     : v == 62 ? '+'
+                               : '/';
+    }
+    while (len % 4)
+        out[len++] = '=';
+    return len;
+}
+
+/* Round trips at every short length and a few long ones, so both the
+ * vector kernels and the scalar tails run, against a plain encoder;
+ * then one bad character anywhere must fail the decode
+ */
+static void codec_test(void)
+{
+    static const char bad64[] = "*-_ \n\x80", badhex[] = "gG/:@` \x80";
+    enum { MAX = 70000 };
+    uint8_t *src = malloc(MAX);
+    char *ref = malloc(MAX / 3 * 4 + 4), *text = malloc(2 * MAX);
+    xs x, y;
+
+    srand(13);
+    for (size_t i = 0; i < MAX; i++)
+        src[i] = rand();
+    xs_new(&x, "");
+    xs_new(&y, "");
+    for (size_t n = 0; n <= MAX; n = n < 200 ? n + 1 : 17 * n + 5) {
+        size_t len = test_base64(src, n, ref);
+
+        xs_base64_encode(&x, src, n);
+        test_check(xs_size(&x) == len && !memcmp(xs_data(&x), ref, len),
+                   "xs_base64_encode()");
+        test_check(xs_base64_decode(&y, ref, len) && xs_size(&y) == n &&
+                       !memcmp(xs_data(&y), src, n),
+                   "xs_base64_decode()");
+        while (len && ref[len - 1] == '=')
+            len--;
+        test_check(xs_base64_decode(&y, ref, len) && xs_size(&y) == n &&
+                       !memcmp(xs_data(&y), src, n),
+                   "xs_base64_decode() unpadded");
+        if (len) {
+            size_t at = rand() % len;
+            char c = ref[at];
+            ref[at] = bad64[rand() % (sizeof(bad64) - 1)];
+            test_check(!xs_base64_decode(&y, ref, len) && !xs_size(&y),
+                       "xs_base64_decode() bad character");
+            /* in the last two of a whole quad it is padding proper */
+            ref[at] = '=';
+            if (len % 4 || at + 2 < len)
+                test_check(!xs_base64_decode(&y, ref, len) && !xs_size(&y),
+                           "xs_base64_decode() early padding");
+            ref[at] = c;
+        }
+        if (len % 4 == 0) {
+            ref[len] = 'A';
+            test_check(!xs_base64_decode(&y, ref, len + 1),
+                       "xs_base64_decode() length");
+        }
+
+        xs_hex_encode(&x, src, n);
+        const char *hex = xs_data(&x);
+        test_check(xs_size(&x) == 2 * n, "xs_hex_encode() size");
+        for (size_t i = 0; i < n; i++)
+            test_check(hex[2 * i] == "0123456789abcdef"[src[i] >> 4] &&
+                           hex[2 * i + 1] == "0123456789abcdef"[src[i] & 15],
+                       "xs_hex_encode()");
+        for (size_t i = 0; i < 2 * n; i++)
+            text[i] = rand() % 2 ? toupper(hex[i]) : hex[i];
+        test_check(xs_hex_decode(&y, text, 2 * n) && xs_size(&y) == n &&
+                       !memcmp(xs_data(&y), src, n),
+                   "xs_hex_decode()");
+        if (n) {
+            test_check(!xs_hex_decode(&y, text, 2 * n - 1) && !xs_size(&y),
+                       "xs_hex_decode() odd length");
+            text[rand() % (2 * n)] = badhex[rand() % (sizeof(badhex) - 1)];
+            test_check(!xs_hex_decode(&y, text, 2 * n) && !xs_size(&y),
+                       "xs_hex_decode() bad digit");
+        }
+    }
+    xs_free(&x);
+    xs_free(&y);
+    free(src);
+    free(ref);
+    free(text);
+}
+
+/* Bytes an escaper has to notice, and others it must leave alone */
+static uint8_t test_escape_byte(void)
+{
+    static const char special[] = "\"\\\n\r\t\b\f\x01\x1f,;\x7f\x80\xff";
+
+    return rand() % 4 ? 'a' + rand() % 26
+                      : special[rand() % (sizeof(special) - 1)];
+}
+
+/* JSON escaping of @n bytes at @p into @out, a byte at a time */
+static size_t test_json(const uint8_t *p, size_t n, char *out)
+{
+    static const char raw[] = "\"\\\b\f\n\r\t", esc[] = "\"\\bfnrt";
+    size_t len = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        const char *e = p[i] ? strchr(raw, p[i]) : NULL;
+        if (e)
+            len += sprintf(out + len, "\\%c", esc[e - raw]);
+        else if (p[i] < 0x20)
+            len += sprintf(out + len, "\\u%04x", p[i]);
+        else
+            out[len++] = p[i];
+    }
+    return len;
+}
+
+/* CSV field of @n bytes at @p into @out */
+static size_t test_csv(const uint8_t *p, size_t n, char sep, char *out)
+{
+    size_t len = 0;
+    bool quote = false;
+
+    for (size_t i = 0; i < n; i++)
+        quote |= p[i] == '"' || p[i] == sep || p[i] == '\n' || p[i] == '\r';
+    if (quote)
+        out[len++] = '"';
+    for (size_t i = 0; i < n; i++) {
+        if (p[i] == '"')
+            out[len++] = '"';
+        out[len++] = p[i];
+    }
+    if (quote)
+        out[len++] = '"';
+    return len;
+}
+
+/* Does @x hold the @n bytes at @p? */
+static bool test_is(const xs *x, const void *p, size_t n)
+{
+    return xs_size(x) == n && !memcmp(xs_data(x), p, n);
+}
+
+/* Escapes against plain ones and back, at lengths that reach the vector
+ * loops, then input the unescapers must turn down without touching @x
+ */
+static void escape_test(void)
+{
+    static const struct {
+        const char *in, *out;
+    } json[] = {
+        {"\\u0041\\/\\\"", "A/\""},
+        {"\\u00e9\\u00E9", "\xc3\xa9\xc3\xa9"},
+        {"\\u20ac", "\xe2\x82\xac"},
+        {"\\ud83d\\ude00", "\xf0\x9f\x98\x80"},
+        {"caf\xc3\xa9", "caf\xc3\xa9"},
+    };
+    static const char *bad_json[] = {
+        "\\",       "\\x",           "\\u12",         "\\u12g4",
+        "a\"b",     "a\nb",          "\\ud83d",       "\\ud83dx",
+        "\\ude00",  "\\ud83d\\u0041", "\\ud83d\\ud83d", "\\ud83d\\ude0",
+    };
+    static const char *bad_csv[] = {
+        "\"", "\"abc", "\"a\"b\"", "\"a\"\"", "\"a\" ",
+    };
+    enum { MAX = 5000 };
+    uint8_t *src = malloc(MAX);
+    char *ref = malloc(6 * MAX);
+    xs s, x;
+
+    srand(14);
+    xs_new(&x, "");
+    for (size_t n = 0; n <= MAX; n = n < 300 ? n + 1 : 4 * n) {
+        for (size_t i = 0; i < n; i++)
+            src[i] = test_escape_byte();
+        test_bytes(&s, src, n);
+        xs_free(&x);
+        xs_new(&x, "");
+        size_t len = test_json(src, n, ref);
+        test_check(test_is(xs_append_json_escaped(&x, &s), ref, len),
+                   "xs_append_json_escaped()");
+        xs_free(&s);
+        test_bytes(&s, ref, len);
+        xs_free(&x);
+        xs_new(&x, "");
+        test_check(xs_append_json_unescaped(&x, &s) && test_is(&x, src, n),
+                   "xs_append_json_unescaped()");
+        xs_free(&s);
+
+        char sep = rand() % 2 ? ',' : ';';
+        test_bytes(&s, src, n);
+        xs_free(&x);
+        xs_new(&x, "");
+        len = test_csv(src, n, sep, ref);
+        test_check(test_is(xs_append_csv_escaped(&x, &s, sep), ref, len),
+                   "xs_append_csv_escaped()");
+        xs_free(&s);
+        test_bytes(&s, ref, len);
+        xs_free(&x);
+        xs_new(&x, "");
+        test_check(xs_append_csv_unescaped(&x, &s) && test_is(&x, src, n),
+                   "xs_append_csv_unescaped()");
+        xs_free(&s);
+    }
+
+    for (size_t i = 0; i < sizeof(json) / sizeof(json[0]); i++) {
+        xs_free(&x);
+        xs_new(&x, "");
+        test_check(xs_append_json_unescaped(&x, xs_new(&s, json[i].in)) &&
+                       !strcmp(xs_data(&x), json[i].out),
+                   "xs_append_json_unescaped() \\u");
+        xs_free(&s);
+    }
+    for (size_t i = 0; i < sizeof(bad_json) / sizeof(bad_json[0]); i++) {
+        xs_free(&x);
+        xs_new(&x, "kept");
+        test_check(!xs_append_json_unescaped(&x, xs_new(&s, bad_json[i])) &&
+                       !strcmp(xs_data(&x), "kept"),
+                   "xs_append_json_unescaped() bad input");
+        xs_free(&s);
+    }
+    for (size_t i = 0; i < sizeof(bad_csv) / sizeof(bad_csv[0]); i++) {
+        xs_free(&x);
+        xs_new(&x, "kept");
+        test_check(!xs_append_csv_unescaped(&x, xs_new(&s, bad_csv[i])) &&
+                       !strcmp(xs_data(&x), "kept"),
+                   "xs_append_csv_unescaped() bad input");
+        xs_free(&s);
+    }
+    xs_free(&x);
+    free(src);
+    free(ref);
+}
+
+/* Naive replacement of @k needles in the @n bytes at @s into @out: at each
+ * position the first listed needle that matches there
+ */
+static size_t test_replace(const char *s,
+                           size_t n,
+                           const xs *needles,
+                           const xs *repls,
+                           size_t k,
+                           char *out)
+{
+    size_t len = 0, i = 0;
+
+    while (i < n) {
+        size_t j = 0;
+        for (; j < k; j++) {
+            size_t m = xs_size(&needles[j]);
+            if (m && m <= n - i && !memcmp(s + i, xs_data(&needles[j]), m))
+                break;
+        }
+        if (j == k) {
+            out[len++] = s[i++];
+            continue;
+        }
+        memcpy(out + len, xs_data(&repls[j]), xs_size(&repls[j]));
+        len += xs_size(&repls[j]);
+        i += xs_size(&needles[j]);
+    }
+    return len;
+}
+
+/* Random needles over a three-letter text, so matches overlap and run
+ * into each other, against a naive replacement; a CoW copy of the text
+ * must keep the old contents.  Long texts are counted on a pool.
+ */
+static void replace_test(void)
+{
+    enum { K = 4, MAX = 1 << 20 };
+    struct xs_pool *pool = xs_pool_create(4);
+    char *text = malloc(MAX), *ref = malloc(8 * MAX), buf[8];
+    xs needles[K], repls[K], x, y;
+
+    srand(15);
+    xs_set_pool(pool, 4096);
+    for (size_t n = 0, round = 0; n <= MAX; n = n < 600 ? n + 3 : 16 * n) {
+        size_t k = 1 + rand() % K;
+        for (size_t j = 0; j < k; j++) {
+            size_t m = rand() % 4, r = round % 3 ? rand() % 8 : rand() % (m + 1);
+            for (size_t i = 0; i < m; i++)
+                buf[i] = 'a' + rand() % 3;
+            test_bytes(&needles[j], buf, m);
+            for (size_t i = 0; i < r; i++)
+                buf[i] = 'A' + rand() % 3;
+            test_bytes(&repls[j], buf, r);
+        }
+        for (size_t i = 0; i < n; i++)
+            text[i] = 'a' + rand() % 3;
+        round++;
+
+        size_t len = test_replace(text, n, needles, repls, 1, ref);
+        test_bytes(&x, text, n);
+        xs_copy(&y, &x);
+        test_check(xs_replace_all(&x, &needles[0], &repls[0]) &&
+                       test_is(&x, ref, len),
+                   "xs_replace_all()");
+        test_check(test_is(&y, text, n), "xs_replace_all() copy");
+        xs_free(&x);
+        xs_free(&y);
+
+        len = test_replace(text, n, needles, repls, k, ref);
+        test_bytes(&x, text, n);
+        xs_copy(&y, &x);
+        test_check(xs_replace_multi(&x, needles, repls, k) &&
+                       test_is(&x, ref, len),
+                   "xs_replace_multi()");
+        test_check(test_is(&y, text, n), "xs_replace_multi() copy");
+        xs_free(&x);
+        xs_free(&y);
+
+        /* in place, with nobody else holding the buffer */
+        test_bytes(&x, text, n);
+        test_check(xs_replace_multi(&x, needles, needles, k) &&
+                       test_is(&x, text, n),
+                   "xs_replace_multi() with the needles themselves");
+        xs_free(&x);
+
+        for (size_t j = 0; j < k; j++) {
+            xs_free(&needles[j]);
+            xs_free(&repls[j]);
+        }
+    }
+    xs_set_pool(NULL, 0);
+    xs_pool_destroy(pool);
+    free(text);
+    free(ref);
+}
+
+/* Does @x, in whatever form, hold the @n bytes at @p?  Checked through a
+ * few random windows as well as whole.
+ */
+static bool test_holds(const xs *x, const char *p, size_t n)
+{
+    char *buf = malloc(n + 1);
+    bool ok = xs_size(x) == n && xs_get_bytes(x, 0, buf, n + 1) == n &&
+              !memcmp(buf, p, n);
+
+    for (int k = 0; ok && n && k < 4; k++) {
+        size_t pos = rand() % n, len = rand() % (n - pos + 1);
+        ok = xs_get_bytes(x, pos, buf, len) == len &&
+             !memcmp(buf, p + pos, len);
+    }
+    free(buf);
+    return ok;
+}
+
+/* Random inserts, erases and overwrites of a gap buffer and of a flat
+ * string against a plain array, with CoW copies taken along the way that
+ * must keep what they saw
+ */
+static void gap_test(void)
+{
+    enum { OPS = 2000, MAX_INSERT = 6000, COPIES = 4 };
+    static const size_t start[] = {0, 10, 300, 100000};
+    char *ins = malloc(MAX_INSERT);
+
+    srand(16);
+    for (size_t t = 0; t < sizeof(start) / sizeof(start[0]); t++) {
+        size_t n = start[t], cap = n + OPS * MAX_INSERT;
+        char *ref = malloc(cap), *snap[COPIES] = {NULL};
+        size_t snap_n[COPIES];
+        xs gap, flat, copy[COPIES];
+
+        for (size_t i = 0; i < n; i++)
+            ref[i] = 'a' + rand() % 26;
+        test_bytes(&gap, ref, n);
+        test_bytes(&flat, ref, n);
+        test_check(xs_gap_mode(&gap) && test_holds(&gap, ref, n),
+                   "xs_gap_mode()");
+
+        for (size_t op = 0; op < OPS; op++) {
+            size_t pos = rand() % (n + 1),
+                   len = rand() % 8 ? rand() % 64 : rand() % MAX_INSERT;
+            for (size_t i = 0; i < len; i++)
+                ins[i] = 'a' + rand() % 26;
+
+            switch (rand() % 3) {
+            case 0:
+                test_check(xs_insert(&gap, pos, ins, len) &&
+                               xs_insert(&flat, pos, ins, len),
+                           "xs_insert()");
+                memmove(ref + pos + len, ref + pos, n - pos);
+                memcpy(ref + pos, ins, len);
+                n += len;
+                break;
+            case 1:
+                len = len < n - pos ? len : n - pos;
+                test_check(xs_erase(&gap, pos, len) &&
+                               xs_erase(&flat, pos, len),
+                           "xs_erase()");
+                memmove(ref + pos, ref + pos + len, n - pos - len);
+                n -= len;
+                break;
+            default:
+                len = len < n - pos ? len : n - pos;
+                test_check(xs_set_bytes(&gap, pos, ins, len) &&
+                               xs_set_bytes(&flat, pos, ins, len),
+                           "xs_set_bytes()");
+                memcpy(ref + pos, ins, len);
+            }
+            test_check(xs_size(&gap) == n && xs_size(&flat) == n,
+                       "gap buffer size");
+
+            if (op % 97 == 0) {
+                test_check(test_holds(&gap, ref, n) &&
+                               test_holds(&flat, ref, n),
+                           "gap buffer contents");
+                size_t c = op / 97 % COPIES;
+                if (snap[c]) {
+                    test_check(test_holds(&copy[c], snap[c], snap_n[c]),
+                               "gap buffer CoW copy changed");
+                    xs_free(&copy[c]);
+                    free(snap[c]);
+                }
+                xs_copy(&copy[c], &gap);
+                snap[c] = malloc(n + 1);
+                memcpy(snap[c], ref, n);
+                snap_n[c] = n;
+            }
+        }
+
+        test_readers(&gap, &flat);
+        test_check(xs_expand(&gap) && test_is(&gap, ref, n) &&
+                       test_is(&flat, ref, n),
+                   "xs_expand() of a gap buffer");
+        for (size_t c = 0; c < COPIES; c++) {
+            if (!snap[c])
+                continue;
+            test_check(test_holds(&copy[c], snap[c], snap_n[c]),
+                       "gap buffer CoW copy changed");
+            xs_free(&copy[c]);
+            free(snap[c]);
+        }
+        xs_free(&gap);
+        xs_free(&flat);
+        free(ref);
+    }
+    free(ins);
+}
+
+/* Overwrites, many across page boundaries, of a chain of CoW copies of a
+ * paged string, each against its own flat copy: writing through one must
+ * leave every other as it was
+ */
+static void paged_test(void)
+{
+    enum { GEN = 6, OPS = 300 };
+    size_t n = 5 * XS_PAGE_SIZE + 123;
+    char *ref[GEN], *buf = malloc(3 * XS_PAGE_SIZE);
+    xs x[GEN];
+
+    srand(17);
+    ref[0] = malloc(n);
+    for (size_t i = 0; i < n; i++)
+        ref[0][i] = 'a' + rand() % 26;
+    test_bytes(&x[0], ref[0], n);
+    test_check(xs_paged_mode(&x[0]) && test_holds(&x[0], ref[0], n),
+               "xs_paged_mode()");
+
+    for (size_t g = 1; g < GEN; g++) {
+        xs_copy(&x[g], &x[g - 1]);
+        ref[g] = malloc(n);
+        memcpy(ref[g], ref[g - 1], n);
+
+        for (size_t op = 0; op < OPS; op++) {
+            /* any generation, the original included */
+            size_t w = rand() % (g + 1), len, pos;
+            if (rand() % 2) {
+                pos = (1 + rand() % 5) * XS_PAGE_SIZE - rand() % 100;
+                len = rand() % 200;
+            } else {
+                pos = rand() % n;
+                len = rand() % 8 ? rand() % 100 : rand() % (3 * XS_PAGE_SIZE);
+            }
+            for (size_t i = 0; i < len; i++)
+                buf[i] = 'A' + rand() % 26;
+            test_check(xs_set_bytes(&x[w], pos, buf, len) != NULL,
+                       "xs_set_bytes() on pages");
+            if (len > n - pos)
+                len = n - pos;
+            memcpy(ref[w] + pos, buf, len);
+        }
+        for (size_t k = 0; k <= g; k++)
+            test_check(test_holds(&x[k], ref[k], n),
+                       "xs_set_bytes() on pages changed a copy");
+    }
+
+    xs flat;
+    test_readers(&x[GEN - 1], test_bytes(&flat, ref[GEN - 1], n));
+    xs_free(&flat);
+    for (size_t g = 0; g < GEN; g++) {
+        test_check(xs_expand(&x[g]) && test_is(&x[g], ref[g], n),
+                   "xs_expand() of a paged string");
+        xs_free(&x[g]);
+        free(ref[g]);
+    }
+    free(buf);
+}
+
+/* A string shared before a fork is read by the child, which drops its
+ * reference and hands a string back through a slot; once both are freed
+ * the region is as full as it was, and it is detached at the end.  Skipped
+ * where memfds are not to be had.
+ */
+static void shm_test(void)
+{
+    enum { N = 100000 };
+    char *text;
+    int fd, status;
+    size_t in_use;
+    xs x, small;
+    pid_t pid;
+
+    /* without CoW no string is large enough to go there */
+    if (disable_cow || (fd = xs_shm_create((size_t) 1 << 20)) < 0)
+        return;
+    if (!(text = malloc(N))) {
+        test_check(false, "malloc() for the shm test");
+        xs_shm_detach();
+        close(fd);
+        return;
+    }
+    in_use = xs_shm_in_use();
+    srand(18);
+    for (size_t i = 0; i < N; i++)
+        text[i] = 'a' + rand() % 26;
+
+    test_bytes(&x, text, N);
+    test_check(xs_shm_share(&x) && xs_in_shm(&x) && xs_shm_in_use() > in_use,
+               "xs_shm_share()");
+    xs_shm_new(&small, "small", 5);
+    test_check(!xs_in_shm(&small), "xs_shm_new() of a small string");
+    xs_free(&small);
+    test_check(xs_shm_attach(fd) == EBUSY, "xs_shm_attach() twice");
+    xs_copy(xs_shm_slot(0), &x);
+    test_check(xs_get_ref_count(&x) == 2, "xs_shm_slot() reference");
+
+    if ((pid = fork()) == 0) {
+        xs *in = xs_shm_slot(0), back;
+        bool ok = test_is(in, text, N);
+
+        for (size_t i = 0; i < N; i++)
+            text[i] = toupper((unsigned char) text[i]);
+        xs_free(in);
+        xs_shm_new(&back, text, N);
+        ok &= xs_in_shm(&back);
+        *xs_shm_slot(1) = back;
+        _exit(ok ? 0 : 1);
+    }
+    test_check(pid > 0 && waitpid(pid, &status, 0) == pid &&
+                   WIFEXITED(status) && !WEXITSTATUS(status),
+               "xs_shm child read the slot");
+    test_check(!xs_size(xs_shm_slot(0)) && xs_get_ref_count(&x) == 1,
+               "xs_shm child dropped its reference");
+    for (size_t i = 0; i < N; i++)
+        text[i] = toupper((unsigned char) text[i]);
+    test_check(test_is(xs_shm_slot(1), text, N),
+               "xs_shm child handed a string back");
+
+    xs_free(xs_shm_slot(1));
+    xs_free(&x);
+    test_check(xs_shm_in_use() == in_use, "xs_shm_in_use() after freeing");
+    xs_shm_detach();
+    close(fd);
+    /* gone, so that another can be made */
+    fd = xs_shm_create(4096);
+    test_check(fd >= 0, "xs_shm_create() after xs_shm_detach()");
+    xs_shm_detach();
+    if (fd >= 0)
+        close(fd);
+    free(text);
+}
+
+static void usage(char *cmd)
+{
+    printf("Usage: %s [-h] [-d] \n", cmd);
+    printf("\t-h         Print this information\n");
+    printf("\t-d         Disable CoW\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+
+    while ((c = getopt(argc, argv, "hd")) != -1) {
+        switch (c) {
+        case 'h':
+            usage(argv[0]);
+            break;
+        case 'd':
+            disable_cow = 1;
+            break;
+        default:
+            printf("Unknown option '%c'\n", c);
+            usage(argv[0]);
+            break;
+        }
+    }
+
+    func_test();
+    map_test();
+    intern_test();
+    cmp_test();
+    sort_test();
+    batch_test();
+    parallel_test();
+    case_test();
+    utf8_test();
+    number_test();
+    printf_test();
+    new_batch_test();
+    layout_test();
+    static_test();
+    writer_test();
+    read_test();
+    archive_test();
+    fcdict_test();
+    compress_test();
+    column_test();
+    codec_test();
+    escape_test();
+    replace_test();
+    gap_test();
+    paged_test();
+    shm_test();
+    run_string_strategy_test();
+    return nr_errors ? 1 : 0;
 }
+#endif